@@ -5,37 +5,84 @@
 extern "C" {
 #endif
 
+#include "stats.h"
 #include "types.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
-#define MAX_PORTS 255
+#define MAX_PORTS 256
+#define MAX_TRAPS 8
 
-extern const char *instruction_table[];
+// With LAZY_FLAGS the ALU only records its operands and result, and S, Z, P,
+// AC and CY are worked out when something reads them. Build with
+// -DLAZY_FLAGS=0 to update Register.f after every instruction instead.
+#ifndef LAZY_FLAGS
+#define LAZY_FLAGS 1
+#endif
 
-enum Status { HALTED, RUNNING };
+// With TRACE a CPU records every instruction it runs while its `trace`
+// points to a recorder, see trace.h. Build with -DTRACE=1 (make TRACE=1) to
+// have the hook; without it there is none and nothing to pay for it.
+#ifndef TRACE
+#define TRACE 0
+#endif
 
-typedef struct i8080 {
-  size_t cycle;
+// Bits of Register.f
+#define FLAG_CY 0x01
+#define FLAG_B1 0x02 // always 1
+#define FLAG_P 0x04
+#define FLAG_B3 0x08 // always 0
+#define FLAG_AC 0x10
+#define FLAG_B5 0x20 // always 0
+#define FLAG_Z 0x40
+#define FLAG_S 0x80
 
-  bool inte_pending;
-  u8 inte_handle;
-  bool inte;
+extern const char *instruction_table[];
 
-  u8 out[MAX_PORTS];
-  u8 in[MAX_PORTS];
+// Cycles and length in bytes of each opcode. Ccc and Rcc take 6 more cycles
+// when the condition holds.
+extern const u8 OPCODES_CYCLES[256];
+extern const u8 OPCODES_LENGTH[256];
 
-  enum Status status;
+enum Status { HALTED, RUNNING };
+
+// How i8080_execute dispatches opcodes. ENGINE_SWITCH goes through the
+// switch in i8080_decode, ENGINE_THREADED jumps straight to each handler
+// with computed goto and ENGINE_BLOCK runs cached blocks of predecoded
+// instructions (both GCC/Clang only, otherwise the switch is used).
+// ENGINE_JIT also translates hot blocks to x86-64 code (see jit.h), except
+// in builds with STATS.
+enum Engine { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+
+struct memory;
+struct block_cache;
+struct profile;
+struct callgraph;
+struct trace;
+
+// A device on an I/O port. `cycle` is state->cycle at the end of the IN or
+// OUT that called it.
+typedef u8 (*port_read_fn)(void *ctx, u8 port, u64 cycle);
+typedef void (*port_write_fn)(void *ctx, u8 port, u8 value, u64 cycle);
+
+struct port {
+  port_read_fn read;
+  port_write_fn write;
+  void *ctx;
+};
 
+typedef struct i8080 {
+  // The registers and flag state come first so everything an instruction
+  // touches sits in the first cache line of the struct.
   struct {
     u16 pc;
     u16 sp;
-    u8 f;
-    u8 a;
 
     union {
       struct {
+        u8 f;
+        u8 a;
         u8 c;
         u8 b;
         u8 e;
@@ -45,6 +92,7 @@ typedef struct i8080 {
       };
 
       struct {
+        u16 psw;
         u16 bc;
         u16 de;
         u16 hl;
@@ -53,25 +101,59 @@ typedef struct i8080 {
 
   } Register;
 
+#if LAZY_FLAGS
+  // Last flag-setting ALU op. While `pending` is set, Register.f is stale
+  // and i8080_flags_sync() has to be called before reading it.
   struct {
-    u8 s;
-    u8 z;
-    u8 p;
-    u8 ac;
-    u8 cy;
-  } Flag;
+    u16 res; // result, carry in bit 8
+    u8 a;
+    u8 b;
+    bool pending;
+  } Lazy;
+#endif
+
+  u64 cycle;
+
+  enum Status status;
+  enum Engine engine;
+
+  bool inte_pending;
+  u8 inte_handle;
+  bool inte;
 
+  // Devices by port, see i8080_attach_port()
+  struct port ports[MAX_PORTS];
+
+  // Addresses i8080_run stops in front of, see i8080_trap()
+  u16 traps[MAX_TRAPS];
+  u8 trap_count;
+
+  // Owned by the CPU and shared by its copies; i8080_free() releases them.
+  struct memory *mem;
+  struct block_cache *cache; // ENGINE_BLOCK and ENGINE_JIT only
+
+#if STATS
+  struct i8080_stats stats;    // zeroed by i8080_init_engine()
+  struct profile *profile;     // NULL, or counts by address, see profile.h
+  struct callgraph *callgraph; // NULL, or tracks calls, see profile.h
+#endif
+#if TRACE
+  struct trace *trace; // NULL, or records instructions, see trace.h
+#endif
 } i8080;
 
-void flag_check_s(i8080 *state, const u16 reg);
-void flag_check_z(i8080 *state, const u16 reg);
-void flag_check_p(i8080 *state, const u16 reg);
-void flag_check_ac(i8080 *state, const u8 reg, const u8 val);
-void flag_check_cy(i8080 *state, const u8 reg);
+void i8080_flags_sync(i8080 *state);
 
 void disassemble(struct i8080 *state, char *dest, const char *src);
 
 i8080 i8080_init(void);
+i8080 i8080_init_engine(enum Engine engine);
+
+// A CPU in the same state as `parent`, on a copy-on-write clone of its
+// memory (see mem_clone()), with its traps but no ports attached. `parent`
+// must not run while the clone exists.
+i8080 i8080_clone(const struct i8080 *parent, enum Engine engine);
+void i8080_free(struct i8080 *state);
 void i8080_dump(struct i8080 *state);
 void i8080_reset(struct i8080 *state);
 void i8080_step(struct i8080 *state);
@@ -80,6 +162,24 @@ u8 i8080_fetch(struct i8080 *state);
 void i8080_decode(struct i8080 *state, u8 opcode);
 void i8080_execute(struct i8080 *state);
 
+// Runs instructions until at least `cycle_budget` cycles have passed, an
+// interrupt can be taken or the pc reaches a trap. The first instruction
+// always runs, and an interrupt that is already pending is taken before it.
+// A halted CPU idles to the end of the budget without running anything.
+// Returns the number of cycles run.
+u64 i8080_run(struct i8080 *state, u64 cycle_budget);
+
+// Makes i8080_run stop when the pc reaches `addr`. Returns 1 if all
+// MAX_TRAPS traps are in use.
+int i8080_trap(struct i8080 *state, u16 addr);
+void i8080_clear_traps(struct i8080 *state);
+
+// Connects a device to `port`; NULL callbacks disconnect it. Reads of a port
+// without a read callback return 0 and writes without one are dropped. A
+// device may raise an interrupt, which stops i8080_run after the IN or OUT.
+void i8080_attach_port(struct i8080 *state, u8 port, port_read_fn read,
+                       port_write_fn write, void *ctx);
+
 #ifdef __cplusplus
 }
 #endif
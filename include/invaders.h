@@ -0,0 +1,117 @@
+#ifndef INVADERS_H
+#define INVADERS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "constants.h"
+#include "cpu.h"
+#include "movie.h"
+#include "savestate.h"
+#include "scheduler.h"
+#include "types.h"
+#include <stddef.h>
+
+#define INVADERS_CLOCK 1996800
+#define INVADERS_FRAME_CYCLES (INVADERS_CLOCK / 60) // ~33,333 cycles
+
+// Bits of port 1, the coin slot and player one's controls
+#define INPUT_COIN 0x01
+#define INPUT_P2_START 0x02
+#define INPUT_P1_START 0x04
+#define INPUT_P1_FIRE 0x10
+#define INPUT_P1_LEFT 0x20
+#define INPUT_P1_RIGHT 0x40
+
+// The I/O ports of the Space Invaders board.
+//
+// IN 0-2 read `inputs`. OUT 4 shifts a byte into the top of the 16-bit
+// shift register, OUT 2 sets how far IN 3 reads from its top, which is how
+// the game moves sprites by single pixels. OUT 3 and 5 latch the sound
+// bits and OUT 6 kicks the watchdog.
+struct invaders_io {
+  u8 inputs[3];
+
+  u16 shift;
+  u8 shift_offset;
+
+  u8 sound[2];     // ports 3 and 5
+  u64 sound_cycle; // when either last changed
+  u64 watchdog;    // cycle of the last kick
+};
+
+// Resets `io` and connects it to the ports of `state`. `io` has to outlive
+// the CPU.
+void invaders_io_attach(struct invaders_io *io, struct i8080 *state);
+
+// The whole board: CPU, memory map, ports, and the two screen interrupts,
+// RST 1 when the beam is halfway down and RST 2 at vblank.
+struct invaders {
+  struct i8080 cpu;
+  struct invaders_io io;
+  struct scheduler sched;
+
+  // The upright picture as RGB, redrawn from video RAM at each vblank
+  u8 screen[GAME_HEIGHT][GAME_WIDTH][3];
+  u64 frames;
+};
+
+// Sets up `m` with the ROM at `rom` and the screen interrupts scheduled.
+// Returns 1 if the ROM didn't load; `m` still has to be freed then. `m` must
+// not move while it is in use.
+int invaders_init(struct invaders *m, const char *rom, enum Engine engine);
+void invaders_free(struct invaders *m);
+
+// Sets up `m` as a copy of `parent` that shares its ROM and, until they are
+// written, its RAM pages (see mem_clone()), so a checkpoint can be cloned
+// many times over. The screen is left for the next vblank to draw.
+// `parent` must not run or be freed while the clone exists, and `m` must
+// not move; it is freed with invaders_free().
+void invaders_clone(struct invaders *m, const struct invaders *parent,
+                    enum Engine engine);
+
+// Runs `cycles` cycles, taking the screen interrupts on the way.
+void invaders_run(struct invaders *m, u64 cycles);
+
+// Runs one instruction, for the debugger, and then the screen interrupts
+// and redraws that have come due.
+void invaders_step(struct invaders *m);
+
+// A saved state of the board is the CPU's (see savestate.h) followed by the
+// ports, shift register, latches, frame count and when the two screen
+// interrupts are due next.
+#define INVADERS_STATE_SIZE                                                    \
+  (SAVESTATE_HEADER_SIZE + SAVESTATE_CPU_SIZE + SAVESTATE_MEMORY_SIZE + 48)
+
+// Writes the state of `m` to `buf`, INVADERS_STATE_SIZE bytes.
+void invaders_save(struct invaders *m, u8 *buf);
+
+// Puts `m` back in the state in `buf`, `length` bytes. `m` has to be set up
+// with invaders_init(). The screen is left as it was until the next vblank
+// or invaders_draw(), which takes far longer than the rest of the load.
+// Returns 1, leaving `m` as it was, if `buf` isn't a state of the board.
+int invaders_load(struct invaders *m, const u8 *buf, size_t length);
+
+// The same to and from a file, which is mapped rather than read. Loading a
+// file redraws the screen. Return 1 on failure.
+int invaders_save_file(struct invaders *m, const char *path);
+int invaders_load_file(struct invaders *m, const char *path);
+
+// Starts recording a movie (see movie.h) of `m` from where it is, taking
+// the input ports 0-2 over until movie_stop(). Returns NULL on failure.
+struct movie *invaders_record(struct invaders *m);
+
+// Loads the start of `mv` into `m` and feeds the ports from it. The replay
+// runs out at movie_done(). Returns 1, leaving `m` as it was, if `mv` isn't
+// a movie of the board.
+int invaders_replay(struct invaders *m, struct movie *mv);
+
+// Redraws `screen` from video RAM, as happens at each vblank.
+void invaders_draw(struct invaders *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
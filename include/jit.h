@@ -0,0 +1,64 @@
+#ifndef JIT_H
+#define JIT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "cpu.h"
+#include "memory.h"
+#include "types.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// The recompiler emits x86-64 machine code into an anonymous RWX mapping.
+// Everywhere else ENGINE_JIT runs as ENGINE_BLOCK.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_X86_64 1
+#else
+#define JIT_X86_64 0
+#endif
+
+// A predecoded instruction, as the block cache in cpu.c stores it. `handler`
+// is the interpreter's label for the opcode; the JIT only reads the rest.
+struct insn {
+  const void *handler;
+  u16 operand;
+  u8 opcode;
+  u8 length;
+  u8 cycles;
+};
+
+// The code cache of one CPU
+struct jit;
+
+// Sets up a code cache for code in `mem`. Returns NULL when the host can't
+// run the JIT.
+struct jit *jit_create(const memory *mem);
+void jit_destroy(struct jit *jit);
+
+// Native code for the block starting at `addr`, or NULL if there is none.
+void *jit_lookup(const struct jit *jit, u16 addr);
+
+// Translates the `count` instructions starting at `start`.
+void *jit_compile(struct jit *jit, u16 start, const struct insn *insn,
+                  u8 count);
+
+// Drops the native code of the block starting at `addr`.
+void jit_invalidate(struct jit *jit, u16 addr);
+
+// Drops all native code.
+void jit_flush(struct jit *jit);
+
+// Runs native code from `code`, which must be the block at the current pc,
+// following jumps from block to block while there is code for them. Stops
+// before a block that would run into state->cycle reaching `limit`, on HLT,
+// after EI and when a write replaces code that is running. Returns the
+// number of cycles run, which is 0 if the first block didn't fit.
+u64 jit_run(const struct jit *jit, i8080 *state, void *code, u64 limit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,20 +7,155 @@ extern "C" {
 
 #include "types.h"
 #include "utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define MAX_MEMORY 0x10000
 
-extern u8 mem[MAX_MEMORY];
+// The bus is split into 256 pages of 256 bytes
+#define PAGE_SHIFT 8
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_COUNT (MAX_MEMORY / PAGE_SIZE)
 
-u8 mem_read_byte(u16 val);
-u8 mem_read_word(u16 val);
+// Bits of memory.watch
+#define WATCH_CODE 0x01  // the CPU's block cache has code here
+#define WATCH_READ 0x02  // reads don't come from data[addr]
+#define WATCH_WRITE 0x04 // writes don't go to data[addr]
+#define WATCH_SHARED 0x08 // reads come from a page of another memory that
+                          // never changes, see mem_clone()
 
-void mem_write_byte(u16 addr, u8 data);
-void mem_write_word(u16 addr, u16 data);
+typedef u8 (*mem_read_fn)(void *ctx, u16 addr);
+typedef void (*mem_write_fn)(void *ctx, u16 addr, u8 data);
 
-int mem_load_file(const char *rom, const u16 address);
+// The address space of one machine. Every CPU has its own, so any number of
+// them can run side by side, on any threads.
+typedef struct memory {
+  // RAM and ROM live here, at their own addresses
+  u8 data[MAX_MEMORY];
 
-void mem_dump(void);
+  // One byte per address. Code that only handles data[] directly (the JIT)
+  // has to leave reads and writes to the functions below wherever WATCH_READ
+  // or WATCH_WRITE is set. Writes to an address with WATCH_CODE set call
+  // write_hook after the write. The CPU's block cache uses this to notice
+  // self-modifying code.
+  u8 watch[MAX_MEMORY];
+  void (*write_hook)(void *ctx, u16 addr);
+  void *hook_ctx;
+  bool plain_reads; // no page has WATCH_READ
+
+  // The page map. A page either has a host buffer that reads and writes go
+  // straight to, or NULL and a handler.
+  u8 *read[PAGE_COUNT];
+  u8 *write[PAGE_COUNT];
+  struct {
+    mem_read_fn read;
+    mem_write_fn write;
+    void *ctx;
+  } io[PAGE_COUNT];
+
+  // The page of data[] each page is stored in: itself, or for a mirror the
+  // page it repeats
+  u8 home[PAGE_COUNT];
+
+  // Pages of data[] a clone has taken its own copy of
+  bool dirty[PAGE_COUNT];
+} memory;
+
+enum RegionKind {
+  REGION_RAM,
+  REGION_ROM,    // writes are dropped
+  REGION_MIRROR, // repeats `source_size` bytes from `source`, as they are
+                 // mapped by the regions before it
+  REGION_MMIO,   // goes through `read` and `write`
+};
+
+// One entry of a machine description. `start` and `size` are multiples of
+// PAGE_SIZE.
+struct mem_region {
+  enum RegionKind kind;
+  u16 start;
+  u32 size;
+
+  u16 source;
+  u32 source_size;
+
+  mem_read_fn read;
+  mem_write_fn write;
+  void *ctx;
+};
+
+// Returns zeroed memory with RAM at every address, or NULL if it can't be
+// allocated.
+memory *mem_create(void);
+void mem_destroy(memory *m);
+
+// Returns memory that reads the same as `parent` and has its page map, or
+// NULL if it can't be allocated. Nothing is copied: the clone reads the
+// pages of `parent` until it writes one, which copies that page into its
+// own data[] and marks it in dirty[]. Pages that are never written, like
+// ROM, stay shared, and the parts of data[] they would take are never
+// touched. `parent` must neither be written nor freed while the clone
+// exists, so clone a checkpoint rather than a machine that keeps running.
+memory *mem_clone(const memory *parent);
+
+// Rebuilds the page map from a machine description. Pages no region covers
+// read as 0xFF and ignore writes. Code cached from memory is dropped, and a
+// clone takes its own copy of every page it shares. Returns 1 if a region
+// is out of range or not page aligned, leaving the map as it was.
+int mem_map(memory *m, const struct mem_region *regions, size_t count);
+
+u8 mem_read_io(const memory *m, u16 addr);
+void mem_write_io(memory *m, u16 addr, u8 data);
+
+static inline u8 mem_read_byte(const memory *m, const u16 val) {
+  const u8 *page = m->read[val >> PAGE_SHIFT];
+  if (page != NULL)
+    return page[val & (PAGE_SIZE - 1)];
+  return mem_read_io(m, val);
+}
+
+// What the CPU would read at `addr`, for debuggers: pages with a handler
+// read as 0xFF rather than call it, as MMIO reads may have side effects.
+static inline u8 mem_peek_byte(const memory *m, const u16 addr) {
+  const u8 *page = m->read[addr >> PAGE_SHIFT];
+  return page != NULL ? page[addr & (PAGE_SIZE - 1)] : 0xFF;
+}
+
+static inline u8 mem_read_word(const memory *m, const u16 val) {
+  return mem_read_byte(m, val);
+}
+
+static inline void mem_write_byte(memory *m, const u16 addr, const u8 data) {
+  u8 *page = m->write[addr >> PAGE_SHIFT];
+  if (page == NULL) {
+    mem_write_io(m, addr, data);
+    return;
+  }
+
+  u8 *byte = &page[addr & (PAGE_SIZE - 1)];
+  *byte = data;
+
+  // code is watched where it lives in data[], whichever mirror the write
+  // came through
+  const uintptr_t at = (uintptr_t)byte - (uintptr_t)m->data;
+  if (at < MAX_MEMORY && (m->watch[at] & WATCH_CODE) && m->write_hook != NULL)
+    m->write_hook(m->hook_ctx, (u16)at);
+}
+
+void mem_write_word(memory *m, u16 addr, u16 data);
+
+// Copies what data[] holds, pages a clone shares included, to `out`.
+void mem_save(const memory *m, u8 *out);
+
+// Replaces data[] with a copy of `data`, as a state being loaded does.
+// Cached code is only dropped, and shared pages only copied, where it
+// changed.
+void mem_restore(memory *m, const u8 *data);
+
+int mem_load_file(memory *m, const char *rom, const u16 address);
+
+void mem_dump(const memory *m);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,83 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "cpu.h"
+#include "types.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Recordings of a run ("movies"): the state it started from and every
+// value the guest read from the machine's input ports, by cycle. Replaying
+// one feeds the same values to the same INs, which makes the run repeat
+// exactly, on any engine.
+//
+// Only reads that give something other than the port's last value are
+// kept, so a movie grows with what the player does rather than with its
+// length. Ports whose values follow from the guest's own OUTs, like the
+// shift register of Invaders, aren't recorded: the replay computes them
+// again. A file is, every number in little-endian order:
+//
+//   header  "I8080MOV", u16 version, u16 machine, u32 size of the state,
+//           u64 cycle the movie ends at, u64 number of events
+//   state   the state the movie starts from, see savestate.h
+//   events  varint cycles since the event before, u8 port, u8 value
+#define MOVIE_MAGIC "I8080MOV"
+#define MOVIE_VERSION 1
+#define MOVIE_HEADER_SIZE 32
+
+struct movie {
+  u16 machine; // MACHINE_*, see savestate.h
+  u8 *state;
+  u32 state_size;
+  u64 end_cycle; // set once recording stops
+  u64 count;     // events
+
+  u8 *events;
+  size_t size;
+  size_t capacity;
+
+  bool replaying;
+  bool desynced;   // a replay missed an event; reported once
+  size_t pos;      // next event to replay
+  u64 event_cycle; // of the last event recorded or replayed
+
+  // The ports the movie took over, what they were, and their last values,
+  // or 0x100 before the first
+  struct i8080 *cpu;
+  bool taken[MAX_PORTS];
+  struct port devices[MAX_PORTS];
+  u16 last[MAX_PORTS];
+};
+
+// Starts recording reads from `ports` of `state`, from the saved state
+// `start` of `size` bytes of a `machine`. Returns NULL if it can't be
+// allocated.
+struct movie *movie_record(struct i8080 *state, u16 machine, const u8 *start,
+                           u32 size, const u8 *ports, u8 count);
+
+// Gives `ports` of `state` the values of a movie, whose start state the
+// caller has loaded. Reads after its end keep the last values.
+void movie_replay(struct movie *mv, struct i8080 *state, const u8 *ports,
+                  u8 count);
+
+// Whether a replay has reached the end of the movie
+bool movie_done(const struct movie *mv);
+
+// Hands the ports back to their devices. A recording ends here.
+void movie_stop(struct movie *mv);
+
+void movie_destroy(struct movie *mv);
+
+// Return 1 and NULL, having printed why, on failure.
+int movie_write_file(const struct movie *mv, const char *path);
+struct movie *movie_read_file(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
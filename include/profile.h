@@ -0,0 +1,122 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "memory.h"
+#include "types.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Executions and cycles of the instruction at each address. A CPU built
+// with STATS (see stats.h) fills one in while its `profile` points to it;
+// the cycles include the extra ones of calls and returns taken. Interrupts
+// run an RST that isn't in memory, so they are left out.
+struct profile {
+  u64 executed[MAX_MEMORY];
+  u64 cycles[MAX_MEMORY];
+};
+
+// Zeroed, or NULL if it can't be allocated.
+struct profile *profile_create(void);
+void profile_destroy(struct profile *profile);
+
+#define MAX_SYMBOLS 1024
+#define MAX_SYMBOL_NAME 16
+
+// The labels of a program, sorted by address
+struct symbols {
+  u16 count;
+  struct symbol {
+    u16 addr;
+    char name[MAX_SYMBOL_NAME];
+  } symbol[MAX_SYMBOLS];
+};
+
+// Reads the labels defined in an assembler listing (.PRN), as written by
+// MACRO-80 and by the assembler of TST8080. Returns 1 if the file can't be
+// read.
+int symbols_load_prn(struct symbols *symbols, const char *path);
+
+// The symbol at or below `addr`, or NULL if there is none.
+const struct symbol *symbols_find(const struct symbols *symbols, u16 addr);
+
+// Prints the `top` costliest ranges of code. Addresses that ran merge into
+// a range while the gap between them is shorter than an instruction and no
+// label starts in between; each range is named after the label it is in.
+// `symbols` may be NULL.
+void profile_report(const struct profile *profile,
+                    const struct symbols *symbols, FILE *fp, int top);
+
+#define MAX_CALL_DEPTH 256
+#define MAX_CALL_NODES 4096
+
+// One subroutine on one call path. Node 0 holds the roots: the code outside
+// any call, in node 1, and each interrupt handler.
+struct call_node {
+  u32 parent;
+  u32 first_child;
+  u32 next_sibling;
+  u16 addr;
+  bool interrupt; // entered by an interrupt rather than a call
+  u64 calls;
+  u64 cycles; // spent in the subroutine itself
+};
+
+// A shadow call stack that charges the cycles between calls and returns to
+// the subroutine running, by call path. A CPU built with STATS feeds one
+// while its `callgraph` points to it.
+//
+// Each frame remembers where its return address is on the stack, so a RET
+// only ends the frame whose address it pops: a RET that pops something else
+// is a jump, and frames the stack pointer has moved past, by LXI SP, SPHL
+// or popping return addresses, are dropped. Beyond MAX_CALL_DEPTH the
+// outermost frames are forgotten, and once all MAX_CALL_NODES are used new
+// call paths are charged to their caller.
+struct callgraph {
+  struct call_frame {
+    u16 sp; // where the return address is
+    u32 node;
+  } stack[MAX_CALL_DEPTH];
+  u32 depth;
+
+  u32 node;       // running now
+  u64 cycle;      // when it was last charged
+  bool interrupt; // set while the CPU runs an interrupt's instruction
+  u64 lost_calls; // charged to their caller for want of nodes
+
+  u32 node_count;
+  struct call_node nodes[MAX_CALL_NODES];
+};
+
+// Empty, or NULL if it can't be allocated.
+struct callgraph *callgraph_create(void);
+void callgraph_destroy(struct callgraph *graph);
+
+// The CPU's hooks: a CALL or RST at `cycle` has just pushed its return
+// address at `sp` and jumped to `addr`, or a RET is about to pop one from
+// `sp`.
+void callgraph_call(struct callgraph *graph, u16 addr, u16 sp, u64 cycle);
+void callgraph_return(struct callgraph *graph, u16 sp, u64 cycle);
+
+// Charges the cycles up to `cycle` to the subroutine running, for a report
+// of everything so far.
+void callgraph_sync(struct callgraph *graph, u64 cycle);
+
+// One line per call path with cycles of its own, as "main;outer;inner N",
+// the folded stacks flame graph tools read. Interrupt handlers are roots of
+// their own, named irq:ADDR.
+void callgraph_folded(const struct callgraph *graph,
+                      const struct symbols *symbols, FILE *fp);
+
+// The `top` subroutines with the most cycles including their callees.
+void callgraph_report(const struct callgraph *graph,
+                      const struct symbols *symbols, FILE *fp, int top);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
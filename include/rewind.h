@@ -0,0 +1,67 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// A history of saved states (see savestate.h) to step back through, newest
+// first, in a bounded amount of memory.
+//
+// States are grouped behind keyframes. Only the newest keyframe is kept
+// whole. Every other state is stored as its XOR with the keyframe of its
+// group, and every keyframe as its XOR with the keyframe before it. Most
+// bytes of two nearby states are equal, so the XORs are mostly zeros and
+// are stored run-length encoded. Stepping back through a keyframe XORs its
+// delta into the whole one, which gives the keyframe before.
+//
+// Once the deltas take more than the budget, the oldest group goes.
+struct rewind_entry {
+  u8 *delta;
+  u32 size;
+  bool keyframe;
+};
+
+struct rewind {
+  size_t state_size;
+  u32 interval; // states from one keyframe to the next
+  size_t budget;
+  size_t bytes; // held by the entries and their deltas
+
+  u8 *key;     // the newest keyframe
+  u8 *scratch; // room for the longest delta
+
+  // Oldest first, in a ring that grows as needed
+  struct rewind_entry *entries;
+  size_t capacity;
+  size_t first;
+  size_t count;
+  u32 since_key; // states pushed since the newest keyframe
+};
+
+// A history of states of `state_size` bytes with a keyframe every
+// `interval` of them, held in about `budget` bytes. Returns NULL if it
+// can't be allocated.
+struct rewind *rewind_create(size_t state_size, u32 interval, size_t budget);
+void rewind_destroy(struct rewind *r);
+
+// Changes the budget, dropping the oldest states if they no longer fit
+void rewind_set_budget(struct rewind *r, size_t budget);
+
+// Adds `state` as the newest. Returns 1 if it couldn't be stored.
+int rewind_push(struct rewind *r, const u8 *state);
+
+// Takes the newest state off, into `state`. Returns 1 if there is none.
+int rewind_pop(struct rewind *r, u8 *state);
+
+void rewind_clear(struct rewind *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
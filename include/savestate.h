@@ -0,0 +1,100 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "cpu.h"
+#include "memory.h"
+#include "types.h"
+#include <stddef.h>
+
+// Snapshots of a whole machine, as bytes that are the same on every host.
+// A state is a header and then sections of fixed size, every number in
+// little-endian order:
+//
+//   header  "I8080SAV", u16 version, u16 machine, u32 size of the state
+//   cpu     u16 pc, sp, psw, bc, de, hl, u64 cycle, u8 status, inte,
+//           inte_pending, inte_handle
+//   memory  the 64K of data[], ROM included
+//   machine whatever the machine adds, see invaders_save()
+//
+// What the host sets up rather than the guest, like the engine, ports,
+// traps and the page map, is not part of a state: it is loaded into a
+// machine set up the same way. A version that changes a section bumps
+// SAVESTATE_VERSION.
+
+#define SAVESTATE_MAGIC "I8080SAV"
+#define SAVESTATE_VERSION 1
+
+#define SAVESTATE_HEADER_SIZE 16
+#define SAVESTATE_CPU_SIZE 24
+#define SAVESTATE_MEMORY_SIZE MAX_MEMORY
+
+// Machines a state can be of
+#define MACHINE_INVADERS 1
+
+// Little-endian fields, for the code that writes and reads states and movies
+static inline u8 *savestate_put_u8(u8 *p, const u8 v) {
+  *p = v;
+  return p + 1;
+}
+
+static inline u8 *savestate_put_u16(u8 *p, const u16 v) {
+  p[0] = (u8)v;
+  p[1] = (u8)(v >> 8);
+  return p + 2;
+}
+
+static inline u8 *savestate_put_u32(u8 *p, const u32 v) {
+  return savestate_put_u16(savestate_put_u16(p, (u16)v), (u16)(v >> 16));
+}
+
+static inline u8 *savestate_put_u64(u8 *p, const u64 v) {
+  return savestate_put_u32(savestate_put_u32(p, (u32)v), (u32)(v >> 32));
+}
+
+static inline u8 savestate_get_u8(const u8 **p) { return *(*p)++; }
+
+static inline u16 savestate_get_u16(const u8 **p) {
+  const u16 v = (u16)((*p)[0] | (*p)[1] << 8);
+  *p += 2;
+  return v;
+}
+
+static inline u32 savestate_get_u32(const u8 **p) {
+  const u32 lo = savestate_get_u16(p);
+  return lo | (u32)savestate_get_u16(p) << 16;
+}
+
+static inline u64 savestate_get_u64(const u8 **p) {
+  const u64 lo = savestate_get_u32(p);
+  return lo | (u64)savestate_get_u32(p) << 32;
+}
+
+// Write the header of a state of `size` bytes in all, and the sections of a
+// CPU and its memory, to `buf`. Return the end of what they wrote.
+u8 *savestate_put_header(u8 *buf, u16 machine, u32 size);
+u8 *savestate_put_cpu(u8 *buf, i8080 *state);
+
+// Read them back. The header check returns 1, having printed why, if `buf`
+// isn't a state of `size` bytes for `machine`; a state of a version this
+// build doesn't know is refused rather than guessed at.
+int savestate_check_header(const u8 *buf, size_t length, u16 machine,
+                           u32 size);
+const u8 *savestate_get_cpu(const u8 *buf, i8080 *state);
+
+// Writes `size` bytes of state to `path`. Returns 1 on failure.
+int savestate_write_file(const char *path, const u8 *buf, size_t size);
+
+// Maps `path` into memory, or reads it where mapping isn't available.
+// Returns NULL, having printed why, on failure.
+const u8 *savestate_map_file(const char *path, size_t *size);
+void savestate_unmap_file(const u8 *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "cpu.h"
+#include "types.h"
+
+#define MAX_EVENTS 32
+
+struct scheduler;
+
+// Called once the CPU reaches `cycle`, the deadline the event was added for.
+// Periodic events add themselves again, at `cycle` plus their period so the
+// period doesn't drift.
+typedef void (*event_fn)(struct scheduler *sched, void *ctx, u64 cycle);
+
+struct event {
+  u64 cycle;
+  u64 seq; // events due on the same cycle fire in the order they were added
+  event_fn fn;
+  void *ctx;
+};
+
+// Future events on the cycle timeline of one CPU, in a binary min-heap
+struct scheduler {
+  struct event events[MAX_EVENTS];
+  u8 count;
+  u64 seq;
+};
+
+void sched_init(struct scheduler *sched);
+
+// Makes `fn` fire once state->cycle reaches `cycle`. Returns 1 if all
+// MAX_EVENTS slots are in use.
+int sched_add(struct scheduler *sched, u64 cycle, event_fn fn, void *ctx);
+
+// Drops every pending event of `fn` with `ctx`.
+void sched_cancel(struct scheduler *sched, event_fn fn, void *ctx);
+
+// The deadline of the next event, or UINT64_MAX if there is none.
+u64 sched_next(const struct scheduler *sched);
+
+// Runs the CPU until its cycle count reaches `until`, stopping at each event
+// deadline on the way to fire the events that are due. As the CPU only stops
+// between instructions, an event fires after the instruction that reaches
+// its deadline. Returns early if the pc reaches a trap. Returns the number of
+// cycles run.
+u64 sched_run(struct scheduler *sched, struct i8080 *state, u64 until);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
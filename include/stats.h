@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+#include <stdio.h>
+
+// With STATS every CPU counts what it runs: executions of each opcode, how
+// often each conditional jump, call and return went either way, interrupts
+// taken and cycles spent halted. Build with -DSTATS=1 (make STATS=1) to turn
+// the counters on; without it they and everything below are compiled out.
+//
+// Native code has no counters, so with STATS ENGINE_JIT runs as
+// ENGINE_BLOCK.
+#ifndef STATS
+#define STATS 0
+#endif
+
+#if STATS
+
+struct i8080_stats {
+  u64 executed[256];
+  u64 taken[256]; // Jcc, Ccc and Rcc whose condition held
+  u64 interrupts;
+  u64 halted_cycles;
+};
+
+enum stats_format { STATS_CSV, STATS_JSON };
+
+void stats_reset(struct i8080_stats *stats);
+
+// Cycles spent running `opcode`, including the extra ones of the calls and
+// returns taken. Together with halted_cycles these add up to every cycle
+// run since the counters were reset.
+u64 stats_cycles(const struct i8080_stats *stats, u8 opcode);
+
+// One row per opcode that ran, plus the interrupts and halted cycles.
+void stats_print(const struct i8080_stats *stats, FILE *fp,
+                 enum stats_format format);
+
+// Writes the counters to `path`, as JSON if it ends in .json and as CSV
+// otherwise. Returns 1 if the file can't be written.
+int stats_write(const struct i8080_stats *stats, const char *path);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "cpu.h"
+#include "memory.h"
+#include "types.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// A record of every instruction a CPU runs, written to a file as it goes.
+// A CPU built with TRACE (see cpu.h) adds a record before each
+// instruction while its `trace` points to one. Interrupts run an RST that
+// isn't in memory and get none.
+//
+// Records go into a ring buffer that a writer thread drains to the file in
+// large blocks. The CPU is the only producer and the writer the only
+// consumer, so the two only share the head and tail counts. When the writer
+// falls a whole ring behind, the CPU waits for it rather than lose records.
+//
+// The file is a struct trace_header followed by the records, in the host's
+// byte order. tools/trace2txt.c turns it into text and tools/tracediff.c
+// finds where two traces part.
+
+#define TRACE_MAGIC "I8080TRC"
+#define TRACE_VERSION 1
+
+struct trace_header {
+  char magic[8];
+  u16 version;
+  u16 byte_order; // 0x0102 as the host wrote it
+  u16 record_size;
+  u16 reserved;
+};
+
+// The state in front of one instruction
+struct trace_record {
+  u64 cycle;
+  u16 pc;
+  u16 af;
+  u16 bc;
+  u16 de;
+  u16 hl;
+  u16 sp;
+  u8 bytes[4]; // at pc, 0 where reading could have side effects
+};
+
+// Why a file starting with `header` can't be read as a trace here, or NULL
+static inline const char *
+trace_header_error(const struct trace_header *header) {
+  if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != TRACE_VERSION)
+    return "is not a trace";
+  if (header->byte_order != 0x0102 ||
+      header->record_size != sizeof(struct trace_record))
+    return "was written by a different kind of host";
+  return NULL;
+}
+
+// Records in the ring, a power of two, and the most the writer writes at
+// once
+#define TRACE_RING (1u << 20)
+#define TRACE_CHUNK (1u << 16)
+
+struct trace {
+  struct trace_record *ring;
+
+  // Records ever added and written. Each side only writes its own, and
+  // reads the other's with acquire to see the records in between.
+  _Atomic u64 head;
+  _Atomic u64 tail;
+  u64 space_until; // the CPU's copy of tail + TRACE_RING
+
+  atomic_bool stop;
+  bool failed; // a write failed; the writer drops what comes after
+  FILE *fp;
+  pthread_t writer;
+};
+
+// Creates `path` and starts its writer thread. Returns NULL, having printed
+// why, if either fails.
+struct trace *trace_open(const char *path);
+
+// Writes the records still in the ring, stops the writer and closes the
+// file. Returns 1 if anything could not be written.
+int trace_close(struct trace *trace);
+
+// Waits for the writer to make room in the ring
+void trace_wait(struct trace *trace);
+
+static inline void trace_add(struct trace *trace, i8080 *state) {
+  const u64 head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+  if (head == trace->space_until)
+    trace_wait(trace);
+
+  struct trace_record *r = &trace->ring[head & (TRACE_RING - 1)];
+  const memory *mem = state->mem;
+  i8080_flags_sync(state);
+  r->cycle = state->cycle;
+  r->pc = state->Register.pc;
+  r->af = (u16)(state->Register.a << 8 | state->Register.f);
+  r->bc = state->Register.bc;
+  r->de = state->Register.de;
+  r->hl = state->Register.hl;
+  r->sp = state->Register.sp;
+  for (u8 i = 0; i < 4; i++) {
+    const u16 addr = state->Register.pc + i;
+    const u8 *page = mem->read[addr >> PAGE_SHIFT];
+    r->bytes[i] = page != NULL ? page[addr & (PAGE_SIZE - 1)] : 0;
+  }
+
+  atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+#endif
@@ -1,15 +1,74 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "cpu.h"
+#include "jit.h"
 #include "memory.h"
+#include "profile.h"
+#include "trace.h"
 #include "utils.h"
 
 #define MAX_INST 12
 
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_COMPUTED_GOTO 1
+#else
+#define HAVE_COMPUTED_GOTO 0
+#endif
+
+// Counters for the handlers, which all have the running opcode in `opcode`
+#if STATS
+#define STAT_EXECUTED() (state->stats.executed[opcode]++)
+#define STAT_TAKEN() (state->stats.taken[opcode]++)
+#else
+#define STAT_EXECUTED() ((void)0)
+#define STAT_TAKEN() ((void)0)
+#endif
+
+// Hooks around each instruction for state->trace and state->profile:
+// INSN_START() in front of one, which keeps its pc and cycle count in
+// `insn_pc` and `insn_cycle` for STATS, and INSN_END() after it.
+#if STATS || TRACE
+static inline void insn_start(i8080 *state) {
+#if TRACE
+  if (state->trace != NULL)
+    trace_add(state->trace, state);
+#else
+  (void)state;
+#endif
+}
+#endif
+
+#if STATS
+static inline void profile_count(const i8080 *state, const u16 pc,
+                                 const u64 cycle) {
+  if (state->profile != NULL) {
+    state->profile->executed[pc]++;
+    state->profile->cycles[pc] += state->cycle - cycle;
+  }
+}
+
+#define INSN_LOCALS                                                            \
+  u16 insn_pc;                                                                 \
+  u64 insn_cycle
+#define INSN_START()                                                           \
+  (insn_start(state), insn_pc = state->Register.pc,                            \
+   insn_cycle = state->cycle)
+#define INSN_END() profile_count(state, insn_pc, insn_cycle)
+#elif TRACE
+#define INSN_LOCALS
+#define INSN_START() insn_start(state)
+#define INSN_END() ((void)0)
+#else
+#define INSN_LOCALS
+#define INSN_START() ((void)0)
+#define INSN_END() ((void)0)
+#endif
+
 // clang-format off
-static const uint8_t OPCODES_CYCLES[256] = {
+const u8 OPCODES_CYCLES[256] = {
 //  0  1   2   3   4   5   6   7   8  9   A   B   C   D   E  F
     4, 10, 7,  5,  5,  5,  7,  4,  4, 10, 7,  5,  5,  5,  7, 4,  // 0
     4, 10, 7,  5,  5,  5,  7,  4,  4, 10, 7,  5,  5,  5,  7, 4,  // 1
@@ -30,6 +89,69 @@ static const uint8_t OPCODES_CYCLES[256] = {
 };
 // clang-format on
 
+// Instruction lengths in bytes, including the opcode. The undocumented
+// opcodes count as one byte.
+// clang-format off
+const u8 OPCODES_LENGTH[256] = {
+//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,  // 0
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,  // 1
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,  // 2
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,  // 3
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 4
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 5
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 6
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 7
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 8
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 9
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // A
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // B
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1,  // C
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 1, 2, 1,  // D
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,  // E
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,  // F
+};
+// clang-format on
+
+// S, Z and P for every 8-bit result, plus bit 1 which always reads as 1.
+// AC and CY are ORed in by the caller.
+// clang-format off
+static const u8 SZP_TABLE[256] = {
+    0x46, 0x02, 0x02, 0x06, 0x02, 0x06, 0x06, 0x02, // 00
+    0x02, 0x06, 0x06, 0x02, 0x06, 0x02, 0x02, 0x06, // 08
+    0x02, 0x06, 0x06, 0x02, 0x06, 0x02, 0x02, 0x06, // 10
+    0x06, 0x02, 0x02, 0x06, 0x02, 0x06, 0x06, 0x02, // 18
+    0x02, 0x06, 0x06, 0x02, 0x06, 0x02, 0x02, 0x06, // 20
+    0x06, 0x02, 0x02, 0x06, 0x02, 0x06, 0x06, 0x02, // 28
+    0x06, 0x02, 0x02, 0x06, 0x02, 0x06, 0x06, 0x02, // 30
+    0x02, 0x06, 0x06, 0x02, 0x06, 0x02, 0x02, 0x06, // 38
+    0x02, 0x06, 0x06, 0x02, 0x06, 0x02, 0x02, 0x06, // 40
+    0x06, 0x02, 0x02, 0x06, 0x02, 0x06, 0x06, 0x02, // 48
+    0x06, 0x02, 0x02, 0x06, 0x02, 0x06, 0x06, 0x02, // 50
+    0x02, 0x06, 0x06, 0x02, 0x06, 0x02, 0x02, 0x06, // 58
+    0x06, 0x02, 0x02, 0x06, 0x02, 0x06, 0x06, 0x02, // 60
+    0x02, 0x06, 0x06, 0x02, 0x06, 0x02, 0x02, 0x06, // 68
+    0x02, 0x06, 0x06, 0x02, 0x06, 0x02, 0x02, 0x06, // 70
+    0x06, 0x02, 0x02, 0x06, 0x02, 0x06, 0x06, 0x02, // 78
+    0x82, 0x86, 0x86, 0x82, 0x86, 0x82, 0x82, 0x86, // 80
+    0x86, 0x82, 0x82, 0x86, 0x82, 0x86, 0x86, 0x82, // 88
+    0x86, 0x82, 0x82, 0x86, 0x82, 0x86, 0x86, 0x82, // 90
+    0x82, 0x86, 0x86, 0x82, 0x86, 0x82, 0x82, 0x86, // 98
+    0x86, 0x82, 0x82, 0x86, 0x82, 0x86, 0x86, 0x82, // A0
+    0x82, 0x86, 0x86, 0x82, 0x86, 0x82, 0x82, 0x86, // A8
+    0x82, 0x86, 0x86, 0x82, 0x86, 0x82, 0x82, 0x86, // B0
+    0x86, 0x82, 0x82, 0x86, 0x82, 0x86, 0x86, 0x82, // B8
+    0x86, 0x82, 0x82, 0x86, 0x82, 0x86, 0x86, 0x82, // C0
+    0x82, 0x86, 0x86, 0x82, 0x86, 0x82, 0x82, 0x86, // C8
+    0x82, 0x86, 0x86, 0x82, 0x86, 0x82, 0x82, 0x86, // D0
+    0x86, 0x82, 0x82, 0x86, 0x82, 0x86, 0x86, 0x82, // D8
+    0x82, 0x86, 0x86, 0x82, 0x86, 0x82, 0x82, 0x86, // E0
+    0x86, 0x82, 0x82, 0x86, 0x82, 0x86, 0x86, 0x82, // E8
+    0x86, 0x82, 0x82, 0x86, 0x82, 0x86, 0x86, 0x82, // F0
+    0x82, 0x86, 0x86, 0x82, 0x86, 0x82, 0x82, 0x86, // F8
+};
+// clang-format on
+
 const char *instruction_table[] = {
     "nop",     "lxi b,#",  "stax b",  "inx b",   "inr b",   "dcr b",
     "mvi b,#", "rlc",      "ill",     "dad b",   "ldax b",  "dcx b",
@@ -86,12 +208,12 @@ void disassemble(struct i8080 *state, char *dest, const char *src) {
     if (src[position] == '$') {
       char number[5];
       sprintf(number, "%04X",
-              combine(mem_read_byte(state->Register.pc + 1),
-                      mem_read_byte(state->Register.pc)));
+              combine(mem_read_byte(state->mem, state->Register.pc + 1),
+                      mem_read_byte(state->mem, state->Register.pc)));
       memcpy(dest + position, number, 5);
     } else if (src[position] == '#') {
       char number[3];
-      sprintf(number, "%02X", mem_read_byte(state->Register.pc));
+      sprintf(number, "%02X", mem_read_byte(state->mem, state->Register.pc));
       memcpy(dest + position, number, 3);
     }
   }
@@ -102,52 +224,113 @@ static void unimplemented(const u16 opcode) {
   exit(1);
 }
 
-// returns if there was a carry between bit "bit_no" and "bit_no - 1" when
-// executing "a + b + cy"
-static inline bool carry(int bit_no, u8 a, u8 b, bool cy) {
-  int16_t result = a + b + cy;
-  int16_t carry = result ^ a ^ b;
-  return carry & (1 << bit_no);
-}
-
-void flag_check_s(i8080 *state, const u16 reg) {
-  state->Flag.s = (reg & 0xff) >> 7;
-}
-
-void flag_check_z(i8080 *state, const u16 reg) { state->Flag.z = reg == 0; }
-
-void flag_check_p(i8080 *state, const u16 reg) {
-  u8 count = 0;
-  for (size_t i = 0; i < 8; i++)
-    count += (reg >> i) & 1;
-  state->Flag.p = (count & 1) == 0;
-}
-
-void flag_check_ac_add(struct i8080 *state, const u8 a, const u8 b,
-                       const u8 carry) {
-  state->Flag.ac = ((a & 0xF) + (b & 0xF) + carry) > 0xF;
+// Every flag-setting op reports its result through flags_alu/flags_logic and
+// reads flags back through the flag_* getters, so LAZY_FLAGS can defer the
+// work without the handlers knowing about it.
+//
+// `res` is the 9-bit result with the carry (or borrow) in bit 8. `a` and `b`
+// are the operands as they went into the adder, so for subtraction `b` is
+// inverted and AC is bit 4 of a ^ b ^ res in both cases.
+static inline void flags_alu(i8080 *state, const u16 res, const u8 a,
+                             const u8 b) {
+#if LAZY_FLAGS
+  state->Lazy.res = res;
+  state->Lazy.a = a;
+  state->Lazy.b = b;
+  state->Lazy.pending = true;
+#else
+  state->Register.f = SZP_TABLE[res & 0xff] | ((a ^ b ^ res) & FLAG_AC) |
+                      ((res >> 8) & FLAG_CY);
+#endif
+}
+
+// ANA/XRA/ORA clear CY and set AC directly rather than through the adder.
+static inline void flags_logic(i8080 *state, const u8 res, const u8 ac) {
+  flags_alu(state, res, res ^ (ac << 4), 0);
+}
+
+static inline u8 flag_s(const i8080 *state) {
+#if LAZY_FLAGS
+  if (state->Lazy.pending)
+    return (state->Lazy.res >> 7) & 1;
+#endif
+  return (state->Register.f >> 7) & 1;
+}
+
+static inline u8 flag_z(const i8080 *state) {
+#if LAZY_FLAGS
+  if (state->Lazy.pending)
+    return (state->Lazy.res & 0xff) == 0;
+#endif
+  return (state->Register.f >> 6) & 1;
+}
+
+static inline u8 flag_p(const i8080 *state) {
+#if LAZY_FLAGS
+  if (state->Lazy.pending)
+    return (SZP_TABLE[state->Lazy.res & 0xff] >> 2) & 1;
+#endif
+  return (state->Register.f >> 2) & 1;
+}
+
+static inline u8 flag_ac(const i8080 *state) {
+#if LAZY_FLAGS
+  if (state->Lazy.pending)
+    return ((state->Lazy.a ^ state->Lazy.b ^ state->Lazy.res) >> 4) & 1;
+#endif
+  return (state->Register.f >> 4) & 1;
+}
+
+static inline u8 flag_cy(const i8080 *state) {
+#if LAZY_FLAGS
+  if (state->Lazy.pending)
+    return (state->Lazy.res >> 8) & 1;
+#endif
+  return state->Register.f & FLAG_CY;
+}
+
+// For the ops that only touch CY, leaving S, Z, P and AC (pending or not)
+// as they are.
+static inline void set_flag_cy(i8080 *state, const u8 cy) {
+#if LAZY_FLAGS
+  if (state->Lazy.pending) {
+    state->Lazy.res = (state->Lazy.res & 0xff) | (cy << 8);
+    return;
+  }
+#endif
+  state->Register.f = (state->Register.f & ~FLAG_CY) | cy;
 }
 
-void flag_check_ac_sub(struct i8080 *state, u8 a, u8 b, u8 carry) {
-  state->Flag.ac = ((a & 0xF) + ((~b) & 0xF) + !carry) > 0xF;
-}
+void i8080_flags_sync(i8080 *state) {
+#if LAZY_FLAGS
+  if (!state->Lazy.pending)
+    return;
 
-static void flag_check_szp(i8080 *state, const u16 reg) {
-  flag_check_s(state, reg);
-  flag_check_z(state, reg);
-  flag_check_p(state, reg);
+  state->Register.f =
+      SZP_TABLE[state->Lazy.res & 0xff] |
+      ((state->Lazy.a ^ state->Lazy.b ^ state->Lazy.res) & FLAG_AC) |
+      ((state->Lazy.res >> 8) & FLAG_CY);
+  state->Lazy.pending = false;
+#else
+  (void)state;
+#endif
 }
 
 static void hlt(i8080 *state) { state->status = HALTED; }
 
-static void out(i8080 *state) {
-  state->out[mem_read_byte(state->Register.pc)] = state->Register.a;
+static void out(i8080 *state, const u8 port) {
+  const struct port *device = &state->ports[port];
   state->Register.pc++;
+  if (device->write != NULL)
+    device->write(device->ctx, port, state->Register.a, state->cycle);
 }
 
-static void in(i8080 *state) {
-  state->Register.a = state->in[mem_read_byte(state->Register.pc)];
+static void in(i8080 *state, const u8 port) {
+  const struct port *device = &state->ports[port];
   state->Register.pc++;
+  state->Register.a = device->read != NULL
+                          ? device->read(device->ctx, port, state->cycle)
+                          : 0;
 }
 
 static inline void nop() {
@@ -155,147 +338,108 @@ static inline void nop() {
 }
 
 static void add(i8080 *state, const u8 reg) {
-  u8 res = state->Register.a + reg;
-  flag_check_szp(state, res);
-  state->Flag.ac = carry(4, state->Register.a, reg, 0);
-  state->Flag.cy = ((u16)state->Register.a + (u16)reg) > 0xFF;
+  u16 res = state->Register.a + reg;
+  flags_alu(state, res, state->Register.a, reg);
   state->Register.a = res;
 }
 
-static void sub(i8080 *state, const u8 reg) {
-  u8 res = state->Register.a - reg;
-  flag_check_szp(state, res);
-
-  state->Flag.ac = carry(4, state->Register.a, ~reg, 1);
-  state->Flag.cy = carry(8, state->Register.a, ~reg, 1);
+static void adc(i8080 *state, const u8 reg) {
+  u16 res = state->Register.a + reg + flag_cy(state);
+  flags_alu(state, res, state->Register.a, reg);
+  state->Register.a = res;
+}
 
-  state->Flag.cy = !state->Flag.cy;
+static void sub(i8080 *state, const u8 reg) {
+  u16 res = state->Register.a - reg;
+  flags_alu(state, res, state->Register.a, ~reg);
   state->Register.a = res;
 }
 
 static void sbb(i8080 *state, const u8 reg) {
-  u8 res = state->Register.a - reg - state->Flag.cy;
-  flag_check_szp(state, res);
-
-  state->Flag.ac = carry(4, state->Register.a, ~reg, !state->Flag.cy);
-  state->Flag.cy = carry(8, state->Register.a, ~reg, !state->Flag.cy);
-
-  state->Flag.cy = !state->Flag.cy;
+  u16 res = state->Register.a - reg - flag_cy(state);
+  flags_alu(state, res, state->Register.a, ~reg);
   state->Register.a = res;
 }
 
 static void ana(i8080 *state, const u8 reg) {
   u8 res = state->Register.a & reg;
-
-  flag_check_szp(state, res);
-
-  state->Flag.ac = ((state->Register.a | reg) & 0x80) != 0;
-
-  state->Flag.cy = 0;
-
-  state->Register.a = res;
-}
-
-static void ani(i8080 *state) {
-  u8 res = state->Register.a & mem_read_byte(state->Register.pc);
-
-  flag_check_szp(state, res);
-
-  state->Flag.ac =
-      ((state->Register.a | mem_read_byte(state->Register.pc)) & 0x08) != 0;
-
-  state->Flag.cy = 0;
-
+  flags_logic(state, res, ((state->Register.a | reg) & 0x08) != 0);
   state->Register.a = res;
-
-  state->Register.pc++;
 }
 
 static void xra(i8080 *state, const u8 reg) {
   u8 res = state->Register.a ^ reg;
-
-  flag_check_szp(state, res);
-
-  state->Flag.ac = 0;
-  state->Flag.cy = 0;
-
+  flags_logic(state, res, 0);
   state->Register.a = res;
 }
 
-static void xri(i8080 *state) {
-  u8 res = state->Register.a ^ mem_read_byte(state->Register.pc);
-  flag_check_szp(state, res);
-  state->Flag.ac = 0;
-  state->Flag.cy = 0;
-  state->Register.a = res;
-  state->Register.pc++;
-}
-
 static void ora(i8080 *state, const u8 reg) {
   u8 res = state->Register.a | reg;
-
-  flag_check_szp(state, res);
-
-  state->Flag.ac = 0;
-  state->Flag.cy = 0;
-
+  flags_logic(state, res, 0);
   state->Register.a = res;
 }
 
-static void ori(i8080 *state) {
-  u8 res = state->Register.a | mem_read_byte(state->Register.pc);
-
-  flag_check_szp(state, res);
-
-  state->Flag.ac = 0;
-  state->Flag.cy = 0;
+static void cmp(i8080 *state, const u8 reg) {
+  u16 res = state->Register.a - reg;
+  flags_alu(state, res, state->Register.a, ~reg);
+}
 
-  state->Register.a = res;
+static void adi(i8080 *state, const u8 d8) {
+  add(state, d8);
+  state->Register.pc++;
+}
 
+static void aci(struct i8080 *state, const u8 d8) {
+  adc(state, d8);
   state->Register.pc++;
 }
 
-static void cpi(i8080 *state) {
-  u8 d8 = mem_read_byte(state->Register.pc);
-  u16 res = (u16)state->Register.a - (u16)d8;
+static void sui(i8080 *state, const u8 d8) {
+  sub(state, d8);
+  state->Register.pc++;
+}
 
-  flag_check_szp(state, res);
-  state->Flag.ac =
-      carry(4, state->Register.a, ~mem_read_byte(state->Register.pc), 1);
-  state->Flag.cy = state->Register.a < d8;
+static void sbi(i8080 *state, const u8 d8) {
+  sbb(state, d8);
+  state->Register.pc++;
+}
 
+static void ani(i8080 *state, const u8 d8) {
+  ana(state, d8);
   state->Register.pc++;
 }
 
-static void cmp(i8080 *state, const u8 reg) {
-  u8 res = state->Register.a - reg;
+static void xri(i8080 *state, const u8 d8) {
+  xra(state, d8);
+  state->Register.pc++;
+}
 
-  flag_check_szp(state, res);
-  state->Flag.cy = carry(8, state->Register.a, ~reg, 1);
-  state->Flag.ac = carry(4, state->Register.a, ~reg, 1);
-  state->Flag.cy = !state->Flag.cy;
+static void ori(i8080 *state, const u8 d8) {
+  ora(state, d8);
+  state->Register.pc++;
 }
 
-static void adc(i8080 *state, const u8 reg) {
-  u8 res = state->Register.a + reg + state->Flag.cy;
-  flag_check_szp(state, res);
-  state->Flag.ac = carry(4, state->Register.a, reg, state->Flag.cy);
-  state->Flag.cy = carry(8, state->Register.a, reg, state->Flag.cy);
-  state->Register.a = res;
+static void cpi(i8080 *state, const u8 d8) {
+  cmp(state, d8);
+  state->Register.pc++;
 }
 
 static void daa(struct i8080 *state) {
-  if ((state->Register.a & 0x0F) > 9 || state->Flag.ac) {
-    flag_check_ac_add(state, state->Register.a, 6, 0);
-    state->Register.a += 0x06;
-  }
+  u8 a = state->Register.a;
+  u8 cy = flag_cy(state);
+  u8 correction = 0;
+
+  if ((a & 0x0F) > 9 || flag_ac(state))
+    correction |= 0x06;
 
-  if (((state->Register.a & 0xF0) >> 4) > 9 || state->Flag.cy) {
-    state->Register.a += 0x60;
-    state->Flag.cy = 1;
+  if ((a >> 4) > 9 || cy || ((a >> 4) == 9 && (a & 0x0F) > 9)) {
+    correction |= 0x60;
+    cy = 1;
   }
 
-  flag_check_szp(state, state->Register.a);
+  u8 res = a + correction;
+  flags_alu(state, (cy << 8) | res, a, correction);
+  state->Register.a = res;
 }
 
 static void lxi_bc(struct i8080 *state, const u16 d16) {
@@ -320,241 +464,155 @@ static void lxi_sp(struct i8080 *state, const u16 d16) {
 
 static inline void mov(u8 *dest, const u8 src) { *dest = src; }
 
-static void stack_push(i8080 *state, const u8 hi, const u8 lo) {
-  mem_write_byte(state->Register.sp - 1, hi);
-  mem_write_byte(state->Register.sp - 2, lo);
+static void stack_push(i8080 *state, const u16 val) {
+  mem_write_byte(state->mem, state->Register.sp - 1, get_hi(val));
+  mem_write_byte(state->mem, state->Register.sp - 2, get_lo(val));
   state->Register.sp -= 2;
 }
 
-static void stack_pop(i8080 *state, u8 *hi, u8 *lo) {
-  *hi = mem_read_byte(state->Register.sp + 1);
-  *lo = mem_read_byte(state->Register.sp);
+static u16 stack_pop(i8080 *state) {
+  u16 val = combine(mem_read_byte(state->mem, state->Register.sp + 1),
+                    mem_read_byte(state->mem, state->Register.sp));
   state->Register.sp += 2;
+  return val;
+}
+
+static inline void jmp(i8080 *state, const u16 addr) {
+  state->Register.pc = addr;
+}
+
+// Calls and returns for state->callgraph
+#if STATS
+static inline void track_call(const i8080 *state) {
+  if (state->callgraph != NULL)
+    callgraph_call(state->callgraph, state->Register.pc, state->Register.sp,
+                   state->cycle);
 }
 
-static inline void jmp(i8080 *state) {
-  state->Register.pc = combine(mem_read_byte(state->Register.pc + 1),
-                               mem_read_byte(state->Register.pc));
+static inline void track_return(const i8080 *state) {
+  if (state->callgraph != NULL)
+    callgraph_return(state->callgraph, state->Register.sp, state->cycle);
 }
+#else
+#define track_call(state) ((void)0)
+#define track_return(state) ((void)0)
+#endif
 
-static void call(i8080 *state) {
-  u16 ret = state->Register.pc + 2;
-  stack_push(state, get_hi(ret), get_lo(ret));
-  jmp(state);
+static void call(i8080 *state, const u16 addr) {
+  stack_push(state, state->Register.pc + 2);
+  jmp(state, addr);
+  track_call(state);
 }
 
 static void rst(i8080 *state, u8 addr) {
-  stack_push(state, get_hi(state->Register.pc), get_lo(state->Register.pc));
+  stack_push(state, state->Register.pc);
   state->Register.pc = addr;
+  track_call(state);
 }
 
 static void ret(i8080 *state) {
-  u8 lo, hi;
-  stack_pop(state, &hi, &lo);
-  state->Register.pc = combine(hi, lo);
+  track_return(state);
+  state->Register.pc = stack_pop(state);
 }
 
 static inline void push_psw(i8080 *state) {
-  state->Register.f = 0;
-  state->Register.f |= state->Flag.s << 7;
-  state->Register.f |= state->Flag.z << 6;
-  state->Register.f |= state->Flag.ac << 4;
-  state->Register.f |= state->Flag.p << 2;
-  state->Register.f |= 1 << 1;
-  state->Register.f |= state->Flag.cy;
-  stack_push(state, state->Register.a, state->Register.f);
+  i8080_flags_sync(state);
+  stack_push(state, state->Register.psw);
 }
 
 static inline void pop_psw(i8080 *state) {
-  stack_pop(state, &state->Register.a, &state->Register.f);
+  state->Register.psw = stack_pop(state);
 
-  state->Flag.cy = state->Register.f & 0x1;
-  state->Flag.p = (state->Register.f >> 2) & 0x1;
-  state->Flag.ac = (state->Register.f >> 4) & 0x1;
-  state->Flag.z = (state->Register.f >> 6) & 0x1;
-  state->Flag.s = (state->Register.f >> 7) & 0x1;
-}
-
-static void adi(i8080 *state) {
-  u8 res = state->Register.a + mem_read_byte(state->Register.pc);
-  flag_check_szp(state, res);
-  state->Flag.ac = carry(4, state->Register.a,
-                         mem_read_byte(state->Register.pc), state->Flag.cy);
-  state->Flag.cy = carry(8, state->Register.a,
-                         mem_read_byte(state->Register.pc), state->Flag.cy);
-
-  state->Register.a = res;
-
-  state->Register.pc++;
+  // bits 1, 3 and 5 are not real flags and always read back as 1, 0, 0
+  state->Register.f = (state->Register.f & ~(FLAG_B3 | FLAG_B5)) | FLAG_B1;
+#if LAZY_FLAGS
+  state->Lazy.pending = false;
+#endif
 }
 
-static void sui(i8080 *state) {
-  u8 res = state->Register.a - mem_read_byte(state->Register.pc);
-  flag_check_szp(state, res);
-
-  state->Flag.ac =
-      carry(4, state->Register.a, ~mem_read_byte(state->Register.pc), 1);
-
-  state->Flag.cy =
-      carry(8, state->Register.a, ~mem_read_byte(state->Register.pc), 1);
-
-  state->Register.a = res;
-
-  state->Flag.cy = !state->Flag.cy;
-  state->Register.pc++;
+// INR and DCR set every flag but CY, which is carried through bit 8.
+static u8 inr(i8080 *state, const u8 val) {
+  u8 res = val + 1;
+  flags_alu(state, (flag_cy(state) << 8) | res, val, 0);
+  return res;
 }
 
-static void aci(struct i8080 *state) {
-  u8 res =
-      state->Register.a + mem_read_byte(state->Register.pc) + state->Flag.cy;
-
-  flag_check_szp(state, res);
-
-  state->Flag.ac =
-      (state->Register.a ^ res ^ mem_read_byte(state->Register.pc)) & 0x10;
-  state->Flag.cy =
-      ((u16)state->Register.a + (u16)mem_read_byte(state->Register.pc) +
-       (u16)state->Flag.cy) > 0xFF;
-
-  state->Register.a = res;
-
-  state->Register.pc++;
-}
-
-static void sbi(i8080 *state) {
-  u8 res =
-      state->Register.a - mem_read_byte(state->Register.pc) - state->Flag.cy;
-
-  flag_check_szp(state, res);
-
-  state->Flag.ac = carry(4, state->Register.a,
-                         ~mem_read_byte(state->Register.pc), !state->Flag.cy);
-
-  state->Flag.cy = carry(8, state->Register.a,
-                         ~mem_read_byte(state->Register.pc), !state->Flag.cy);
-
-  state->Flag.cy = !state->Flag.cy;
-
-  state->Register.a = res;
-
-  state->Register.pc++;
+static u8 dcr(i8080 *state, const u8 val) {
+  u8 res = val - 1;
+  flags_alu(state, (flag_cy(state) << 8) | res, val, 0xFE);
+  return res;
 }
 
 static void inr_a(struct i8080 *state) {
-  u8 result = state->Register.a + 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = ((result & 0xF) == 0xF);
-  state->Register.a = result;
+  state->Register.a = inr(state, state->Register.a);
 }
 
 static void dcr_a(struct i8080 *state) {
-  u8 result = state->Register.a - 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = !((result & 0xF) == 0xF);
-  state->Register.a = result;
+  state->Register.a = dcr(state, state->Register.a);
 }
 
 static void inr_b(struct i8080 *state) {
-  u8 result = state->Register.b + 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = ((result & 0xF) == 0xF);
-  state->Register.b = result;
+  state->Register.b = inr(state, state->Register.b);
 }
 
 static void dcr_b(struct i8080 *state) {
-  u8 result = state->Register.b - 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = !((result & 0xF) == 0xF);
-  state->Register.b = result;
+  state->Register.b = dcr(state, state->Register.b);
 }
 
 static void inr_l(struct i8080 *state) {
-  u8 result = state->Register.l + 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = ((result & 0xF) == 0xF);
-  state->Register.l = result;
+  state->Register.l = inr(state, state->Register.l);
 }
 
 static void dcr_l(struct i8080 *state) {
-  u8 result = state->Register.l - 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = !((result & 0xF) == 0xF);
-  state->Register.l = result;
+  state->Register.l = dcr(state, state->Register.l);
 }
 
 static void inr_d(struct i8080 *state) {
-  u8 result = state->Register.d + 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = ((result & 0xF) == 0xF);
-  state->Register.d = result;
+  state->Register.d = inr(state, state->Register.d);
 }
 
 static void inr_h(struct i8080 *state) {
-  u8 result = state->Register.h + 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = ((result & 0xF) == 0xF);
-  state->Register.h = result;
+  state->Register.h = inr(state, state->Register.h);
 }
 
 static void inr_e(struct i8080 *state) {
-  u8 result = state->Register.e + 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = ((result & 0xF) == 0xF);
-  state->Register.e = result;
+  state->Register.e = inr(state, state->Register.e);
 }
 
 static void dcr_d(struct i8080 *state) {
-  u8 result = state->Register.d - 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = !((result & 0xF) == 0xF);
-  state->Register.d = result;
+  state->Register.d = dcr(state, state->Register.d);
 }
 
 static void dcr_h(struct i8080 *state) {
-  u8 result = state->Register.h - 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = !((result & 0xF) == 0xF);
-  state->Register.h = result;
+  state->Register.h = dcr(state, state->Register.h);
 }
 
 static void inr_c(struct i8080 *state) {
-  u8 result = state->Register.c + 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = ((result & 0xF) == 0xF);
-  state->Register.c = result;
+  state->Register.c = inr(state, state->Register.c);
 }
 
 static void dcr_c(struct i8080 *state) {
-  u8 result = state->Register.c - 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = !((result & 0xF) == 0xF);
-  state->Register.c = result;
+  state->Register.c = dcr(state, state->Register.c);
 }
 
 static void dcr_e(struct i8080 *state) {
-  u8 result = state->Register.e - 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = !((result & 0xF) == 0xF);
-  state->Register.e = result;
+  state->Register.e = dcr(state, state->Register.e);
 }
 
 static void inr_m(struct i8080 *state) {
-  u8 result = mem_read_byte(state->Register.hl) + 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = ((result & 0xF) == 0xF);
-  mem_write_byte(state->Register.hl, result);
+  mem_write_byte(state->mem, state->Register.hl,
+                 inr(state, mem_read_byte(state->mem, state->Register.hl)));
 }
 
 static void dcr_m(struct i8080 *state) {
-  u8 result = mem_read_byte(state->Register.hl) - 1;
-  flag_check_szp(state, result);
-  state->Flag.ac = !((result & 0xF) == 0xF);
-  mem_write_byte(state->Register.hl, result);
+  mem_write_byte(state->mem, state->Register.hl,
+                 dcr(state, mem_read_byte(state->mem, state->Register.hl)));
 }
 
 static void dad(struct i8080 *state, const u16 operand) {
   const u16 res = state->Register.hl + operand;
-  state->Flag.cy = (((u32)state->Register.hl + (u32)operand)) > 0xFFFF;
+  set_flag_cy(state,
+              (((u32)state->Register.hl + (u32)operand)) > 0xFFFF);
   state->Register.hl = res;
 }
 
@@ -562,50 +620,119 @@ static void rlc(struct i8080 *state) {
   u8 msb = (state->Register.a & 0x80) >> 7;
   state->Register.a <<= 1;
   state->Register.a |= msb;
-  state->Flag.cy = msb;
+  set_flag_cy(state, msb);
 }
 
 static void rrc(struct i8080 *state) {
   const u8 lsb = (state->Register.a & 0x01);
   state->Register.a >>= 1;
   state->Register.a |= lsb << 7;
-  state->Flag.cy = lsb;
+  set_flag_cy(state, lsb);
 }
 
 static void ral(struct i8080 *state) {
-  u8 old_cy = state->Flag.cy;        // Save the old carry
+  u8 old_cy = flag_cy(state);        // Save the old carry
   u8 msb = (state->Register.a >> 7); // Get current bit 7
 
   state->Register.a =
       (state->Register.a << 1) | old_cy; // Shift and pull in old carry
-  state->Flag.cy = msb;                  // Bit 7 becomes the new carry
+  set_flag_cy(state, msb);               // Bit 7 becomes the new carry
 }
 
 static void rar(struct i8080 *state) {
-  u8 old_cy = state->Flag.cy;          // Save the old carry
+  u8 old_cy = flag_cy(state);          // Save the old carry
   u8 lsb = (state->Register.a & 0x01); // Get current bit 0
 
   state->Register.a =
       (state->Register.a >> 1) | (old_cy << 7); // Shift and pull in old carry
-  state->Flag.cy = lsb;                         // Bit 0 becomes the new carry
+  set_flag_cy(state, lsb);                      // Bit 0 becomes the new carry
 }
 
+#if HAVE_COMPUTED_GOTO
+static struct block_cache *blocks_create(memory *mem, struct jit *jit);
+static void blocks_destroy(struct block_cache *cache);
+#endif
+
 i8080 i8080_init(void) {
+  return i8080_init_engine(HAVE_COMPUTED_GOTO ? ENGINE_THREADED
+                                              : ENGINE_SWITCH);
+}
+
+// A reset CPU on `mem`, which it takes over
+static i8080 init_cpu(enum Engine engine, memory *mem) {
   i8080 cpu;
   i8080_reset(&cpu);
 
-  memset(mem, 0, MAX_MEMORY);
-  memset(cpu.in, 0, MAX_PORTS);
-  memset(cpu.out, 0, MAX_PORTS);
+  cpu.mem = mem;
+  if (cpu.mem == NULL)
+    exit(1);
+
+  // fall back to the portable switch when the compiler has no computed goto,
+  // and to the block engine when the host can't run the JIT
+  cpu.engine = HAVE_COMPUTED_GOTO ? engine : ENGINE_SWITCH;
+  cpu.cache = NULL;
+#if HAVE_COMPUTED_GOTO
+  if (cpu.engine == ENGINE_BLOCK || cpu.engine == ENGINE_JIT) {
+    struct jit *jit =
+        cpu.engine == ENGINE_JIT && !STATS ? jit_create(cpu.mem) : NULL;
+    if (jit == NULL)
+      cpu.engine = ENGINE_BLOCK;
+    cpu.cache = blocks_create(cpu.mem, jit);
+  }
+#endif
+
+  memset(cpu.ports, 0, sizeof(cpu.ports));
+  cpu.trap_count = 0;
 
   cpu.status = RUNNING;
+#if STATS
+  stats_reset(&cpu.stats);
+  cpu.profile = NULL;
+  cpu.callgraph = NULL;
+#endif
+#if TRACE
+  cpu.trace = NULL;
+#endif
+
+  return cpu;
+}
 
+i8080 i8080_init_engine(enum Engine engine) {
+  return init_cpu(engine, mem_create());
+}
+
+i8080 i8080_clone(const i8080 *parent, enum Engine engine) {
+  i8080 cpu = init_cpu(engine, mem_clone(parent->mem));
+
+  cpu.Register = parent->Register;
+#if LAZY_FLAGS
+  cpu.Lazy = parent->Lazy;
+#endif
+  cpu.cycle = parent->cycle;
+  cpu.status = parent->status;
+  cpu.inte = parent->inte;
+  cpu.inte_pending = parent->inte_pending;
+  cpu.inte_handle = parent->inte_handle;
+
+  memcpy(cpu.traps, parent->traps, sizeof(cpu.traps));
+  cpu.trap_count = parent->trap_count;
   return cpu;
 }
 
+void i8080_free(i8080 *state) {
+#if HAVE_COMPUTED_GOTO
+  if (state->cache != NULL)
+    blocks_destroy(state->cache);
+#endif
+  mem_destroy(state->mem);
+  state->cache = NULL;
+  state->mem = NULL;
+}
+
 void i8080_reset(i8080 *state) {
   state->status = RUNNING;
 
+  state->inte = false;
   state->inte_pending = false;
   state->inte_handle = 0;
   state->cycle = 0;
@@ -613,1157 +740,702 @@ void i8080_reset(i8080 *state) {
   state->Register.pc = 0;
   state->Register.sp = 0;
 
-  state->Register.f = 0x02;
-  state->Register.a = 0;
+  state->Register.psw = FLAG_B1;
   state->Register.bc = 0;
   state->Register.de = 0;
   state->Register.hl = 0;
 
-  state->Flag.s = 0;
-  state->Flag.z = 0;
-  state->Flag.p = 0;
-  state->Flag.ac = 0;
-  state->Flag.cy = 0;
+#if LAZY_FLAGS
+  state->Lazy.pending = false;
+#endif
 }
 
 uint8_t i8080_fetch(i8080 *state) {
-  return mem_read_byte(state->Register.pc++);
+  return mem_read_byte(state->mem, state->Register.pc++);
 }
 
+// Immediate operands for the interpreters, read from just after the opcode.
+#define D8 mem_read_byte(state->mem, state->Register.pc)
+#define D16                                                                    \
+  combine(mem_read_byte(state->mem, state->Register.pc + 1),                   \
+          mem_read_byte(state->mem, state->Register.pc))
+
 void i8080_decode(i8080 *state, u8 opcode) {
 
   state->cycle += OPCODES_CYCLES[opcode];
+  STAT_EXECUTED();
 
-  switch (opcode) {
-  case 0x00:
-    nop();
-    break; // NOP
-
-  case 0x01: // LXI B, d16
-    lxi_bc(state, combine(mem_read_byte(state->Register.pc + 1),
-                          mem_read_byte(state->Register.pc)));
-    break;
-
-  case 0x02: // STAX B
-    mem_write_byte(state->Register.bc, state->Register.a);
-    break;
-
-  case 0x03: // INX B
-    state->Register.bc++;
-    break;
-
-  case 0x04: // INR B
-    inr_b(state);
-    break;
+#define OP(code) case code:
+#define NEXT break
 
-  case 0x05: // DCR B
-    dcr_b(state);
-    break;
-
-  case 0x06: // MVI B, d8
-    state->Register.b = mem_read_byte(state->Register.pc);
-    state->Register.pc++;
-    break;
-
-  case 0x07: // RLC
-    rlc(state);
-    break;
-
-  case 0x09:
-    dad(state, state->Register.bc);
-    break;
-
-  case 0x0A: // LDAX B
-    state->Register.a = mem_read_word(state->Register.bc);
-    break;
+  switch (opcode) {
+#include "opcodes.inc"
+  }
 
-  case 0x0B: // DCX B
-    state->Register.bc -= 1;
-    break;
+#undef OP
+#undef NEXT
+}
 
-  case 0x0C: // INR C
-    inr_c(state);
-    break;
+static inline bool at_trap(const i8080 *state, const u16 addr) {
+  for (u8 i = 0; i < state->trap_count; i++)
+    if (state->traps[i] == addr)
+      return true;
+  return false;
+}
 
-  case 0x0D: // DCR C
-    dcr_c(state);
-    break;
+// Stop condition shared by the batch engines, checked after every
+// instruction. Traps are checked separately, as the block engine only has to
+// look for them between blocks.
+static inline bool should_stop(const i8080 *state, const u64 limit) {
+  return state->cycle >= limit || state->status == HALTED ||
+         (state->inte && state->inte_pending);
+}
 
-  case 0x0E: // MVI C, d8
-    state->Register.c = mem_read_byte(state->Register.pc);
-    state->Register.pc++;
-    break;
+#if HAVE_COMPUTED_GOTO
+// Handler addresses for the engines below. Both name their labels op_XX, so
+// the same table works in either function.
+#define L(code) &&op_##code
 
-  case 0x0F: // RRC
-    rrc(state);
-    break;
+// clang-format off
+#define DISPATCH_TABLE {                                                       \
+    L(0x00), L(0x01), L(0x02), L(0x03), L(0x04), L(0x05), L(0x06), L(0x07),  \
+    L(0x08), L(0x09), L(0x0A), L(0x0B), L(0x0C), L(0x0D), L(0x0E), L(0x0F),  \
+    L(0x10), L(0x11), L(0x12), L(0x13), L(0x14), L(0x15), L(0x16), L(0x17),  \
+    L(0x18), L(0x19), L(0x1A), L(0x1B), L(0x1C), L(0x1D), L(0x1E), L(0x1F),  \
+    L(0x20), L(0x21), L(0x22), L(0x23), L(0x24), L(0x25), L(0x26), L(0x27),  \
+    L(0x28), L(0x29), L(0x2A), L(0x2B), L(0x2C), L(0x2D), L(0x2E), L(0x2F),  \
+    L(0x30), L(0x31), L(0x32), L(0x33), L(0x34), L(0x35), L(0x36), L(0x37),  \
+    L(0x38), L(0x39), L(0x3A), L(0x3B), L(0x3C), L(0x3D), L(0x3E), L(0x3F),  \
+    L(0x40), L(0x41), L(0x42), L(0x43), L(0x44), L(0x45), L(0x46), L(0x47),  \
+    L(0x48), L(0x49), L(0x4A), L(0x4B), L(0x4C), L(0x4D), L(0x4E), L(0x4F),  \
+    L(0x50), L(0x51), L(0x52), L(0x53), L(0x54), L(0x55), L(0x56), L(0x57),  \
+    L(0x58), L(0x59), L(0x5A), L(0x5B), L(0x5C), L(0x5D), L(0x5E), L(0x5F),  \
+    L(0x60), L(0x61), L(0x62), L(0x63), L(0x64), L(0x65), L(0x66), L(0x67),  \
+    L(0x68), L(0x69), L(0x6A), L(0x6B), L(0x6C), L(0x6D), L(0x6E), L(0x6F),  \
+    L(0x70), L(0x71), L(0x72), L(0x73), L(0x74), L(0x75), L(0x76), L(0x77),  \
+    L(0x78), L(0x79), L(0x7A), L(0x7B), L(0x7C), L(0x7D), L(0x7E), L(0x7F),  \
+    L(0x80), L(0x81), L(0x82), L(0x83), L(0x84), L(0x85), L(0x86), L(0x87),  \
+    L(0x88), L(0x89), L(0x8A), L(0x8B), L(0x8C), L(0x8D), L(0x8E), L(0x8F),  \
+    L(0x90), L(0x91), L(0x92), L(0x93), L(0x94), L(0x95), L(0x96), L(0x97),  \
+    L(0x98), L(0x99), L(0x9A), L(0x9B), L(0x9C), L(0x9D), L(0x9E), L(0x9F),  \
+    L(0xA0), L(0xA1), L(0xA2), L(0xA3), L(0xA4), L(0xA5), L(0xA6), L(0xA7),  \
+    L(0xA8), L(0xA9), L(0xAA), L(0xAB), L(0xAC), L(0xAD), L(0xAE), L(0xAF),  \
+    L(0xB0), L(0xB1), L(0xB2), L(0xB3), L(0xB4), L(0xB5), L(0xB6), L(0xB7),  \
+    L(0xB8), L(0xB9), L(0xBA), L(0xBB), L(0xBC), L(0xBD), L(0xBE), L(0xBF),  \
+    L(0xC0), L(0xC1), L(0xC2), L(0xC3), L(0xC4), L(0xC5), L(0xC6), L(0xC7),  \
+    L(0xC8), L(0xC9), L(0xCA), L(0xCB), L(0xCC), L(0xCD), L(0xCE), L(0xCF),  \
+    L(0xD0), L(0xD1), L(0xD2), L(0xD3), L(0xD4), L(0xD5), L(0xD6), L(0xD7),  \
+    L(0xD8), L(0xD9), L(0xDA), L(0xDB), L(0xDC), L(0xDD), L(0xDE), L(0xDF),  \
+    L(0xE0), L(0xE1), L(0xE2), L(0xE3), L(0xE4), L(0xE5), L(0xE6), L(0xE7),  \
+    L(0xE8), L(0xE9), L(0xEA), L(0xEB), L(0xEC), L(0xED), L(0xEE), L(0xEF),  \
+    L(0xF0), L(0xF1), L(0xF2), L(0xF3), L(0xF4), L(0xF5), L(0xF6), L(0xF7),  \
+    L(0xF8), L(0xF9), L(0xFA), L(0xFB), L(0xFC), L(0xFD), L(0xFE), L(0xFF),  \
+  }
+// clang-format on
 
-  case 0x11: // LXI D, d16
-    lxi_de(state, combine(mem_read_byte(state->Register.pc + 1),
-                          mem_read_byte(state->Register.pc)));
-    break;
+// Runs instructions until state->cycle reaches `limit`. Every handler ends
+// by fetching the next opcode and jumping straight to its handler through a
+// table of label addresses, so each one gets its own indirect branch instead
+// of all of them sharing the jump of the switch in i8080_decode. Stops early
+// when the CPU halts, an interrupt can be taken or the pc hits a trap.
+static void execute_threaded(i8080 *state, const u64 limit) {
+  static const void *const dispatch[256] = DISPATCH_TABLE;
+
+  const bool traps = state->trap_count != 0;
+  u8 opcode;
+  INSN_LOCALS;
+
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    INSN_START();                                                              \
+    opcode = mem_read_byte(state->mem, state->Register.pc++);                  \
+    state->cycle += OPCODES_CYCLES[opcode];                                    \
+    STAT_EXECUTED();                                                           \
+    goto *dispatch[opcode];                                                    \
+  } while (0)
+
+  DISPATCH();
+
+#define OP(code) op_##code:
+#define NEXT                                                                   \
+  INSN_END();                                                                  \
+  if (should_stop(state, limit) ||                                            \
+      (traps && at_trap(state, state->Register.pc)))                           \
+    return;                                                                    \
+  DISPATCH()
+
+#include "opcodes.inc"
+
+#undef OP
+#undef NEXT
+#undef DISPATCH
+}
+
+#define MAX_BLOCK_INSNS 32
+#define MAX_BLOCK_BYTES (MAX_BLOCK_INSNS * 3)
+
+// Times a block is entered before ENGINE_JIT translates it
+#define JIT_THRESHOLD 16
+
+// Times in a row an idle loop is found to have changed the registers before
+// it is taken for a counting loop and run like any other block
+#define IDLE_TRIES 4
+
+// A straight-line run of code, ending after the first control transfer, in
+// front of a trap or after MAX_BLOCK_INSNS instructions.
+struct block {
+  struct block *next_retired;
+  u16 start;
+  u8 size; // bytes of code covered, starting at `start`
+  u8 count;
+  u8 hits;
+  bool idle;  // see idle_loop()
+  u8 moving;  // entries in a row that found the idle loop making progress
+  u16 cycles; // of all its instructions
+  struct insn insn[];
+};
 
-  case 0x12: // STAX D
-    mem_write_word(state->Register.de, state->Register.a);
-    break;
+// The blocks of one CPU's memory.
+struct block_cache {
+  // Blocks are indexed by the address they start at. A block may start
+  // inside another one, e.g. when a jump lands mid-block, so a byte can
+  // belong to several of them.
+  struct block *blocks[MAX_MEMORY];
+
+  // Invalidated blocks may still be running, so they are only freed once the
+  // block engine is between blocks. `generation` tells it that the one it is
+  // in has gone stale.
+  struct block *retired;
+  u32 generation;
+
+  memory *mem;
+  struct jit *jit; // ENGINE_JIT only
+
+  // Registers and cycle count the last time an idle loop was entered in the
+  // current run, see idle_skip()
+  struct {
+    bool valid;
+    u16 start;
+    u64 cycle;
+    u16 regs[5];
+  } idle;
+};
 
-  case 0x13: // INX D
-    state->Register.de++;
-    break;
+static bool ends_block(const u8 opcode) {
+  switch (opcode) {
+  case 0x76: // HLT
+  case 0xE9: // PCHL
+  case 0xC3: // JMP
+  case 0xC9: // RET
+  case 0xCD: // CALL
+  case 0xFB: // EI, so an interrupt can be taken right after it
+  case 0xCB:
+  case 0xD9:
+  case 0xDD:
+  case 0xED:
+  case 0xFD:
+    return true;
+  }
 
-  case 0x14: // INR D
-    inr_d(state);
-    break;
+  // Jcc, Ccc, Rcc and RST
+  switch (opcode & 0xC7) {
+  case 0xC0:
+  case 0xC2:
+  case 0xC4:
+  case 0xC7:
+    return true;
+  }
 
-  case 0x15: // DCR D
-    dcr_d(state);
-    break;
+  return false;
+}
 
-  case 0x16: // MVI D,d8
-    state->Register.d = mem_read_byte(state->Register.pc);
-    state->Register.pc++;
-    break;
+static void blocks_free_retired(struct block_cache *cache) {
+  while (cache->retired != NULL) {
+    struct block *block = cache->retired;
+    cache->retired = block->next_retired;
+    free(block);
+  }
+}
 
-  case 0x17: // RAL
-    ral(state);
-    break;
+static void block_retire(struct block_cache *cache, const u16 start) {
+  struct block *block = cache->blocks[start];
+  cache->blocks[start] = NULL;
+  if (cache->jit != NULL)
+    jit_invalidate(cache->jit, start);
+  block->next_retired = cache->retired;
+  cache->retired = block;
+  cache->generation++;
+}
 
-  case 0x19: // DAD D
-    dad(state, state->Register.de);
-    break;
+// The memory's write hook: `addr` is covered by at least one block, or was
+// at some point. Drops every block that covers it.
+static void blocks_invalidate(void *ctx, const u16 addr) {
+  struct block_cache *cache = ctx;
+  bool covered = false;
 
-  case 0x1A: // LDAX D
-    state->Register.a = mem_read_word(state->Register.de);
-    break;
-
-  case 0x1B: // DCX D
-    state->Register.de--;
-    break;
-
-  case 0x1C: // INR E
-    inr_e(state);
-    break;
-
-  case 0x1D: // DCR E
-    dcr_e(state);
-    break;
-
-  case 0x1E:
-    state->Register.e = mem_read_byte(state->Register.pc);
-    state->Register.pc++;
-    break;
-
-  case 0x1F:
-    rar(state);
-    break;
-
-  case 0x21: // LXI H, d16
-    lxi_hl(state, combine(mem_read_byte(state->Register.pc + 1),
-                          mem_read_byte(state->Register.pc)));
-    break;
-
-  case 0x22: { // SHLD a16
-    u16 addr = combine(mem_read_byte(state->Register.pc + 1),
-                       mem_read_byte(state->Register.pc));
-    mem_write_byte(addr, state->Register.l);
-    mem_write_byte(addr + 1, state->Register.h);
-    state->Register.pc += 2;
-    break;
+  for (u16 i = 0; i < MAX_BLOCK_BYTES; i++) {
+    const u16 start = addr - i;
+    if (cache->blocks[start] != NULL && i < cache->blocks[start]->size) {
+      block_retire(cache, start);
+      covered = true;
+    }
   }
 
-  case 0x23: // INX H
-    state->Register.hl++;
-    break;
+  // stop watching bytes whose blocks are long gone
+  if (!covered)
+    cache->mem->watch[addr] &= ~WATCH_CODE;
+}
 
-  case 0x24: //  INR H
-    inr_h(state);
-    break;
+static struct block_cache *blocks_create(memory *mem, struct jit *jit) {
+  struct block_cache *cache = calloc(1, sizeof(*cache));
+  if (cache == NULL) {
+    fprintf(stderr, "Failed to allocate the block cache\n");
+    exit(1);
+  }
 
-  case 0x25: // DCR H
-    dcr_h(state);
-    break;
+  cache->mem = mem;
+  cache->jit = jit;
 
-  case 0x26: // MVI H,d8
-    state->Register.h = mem_read_byte(state->Register.pc);
-    state->Register.pc++;
-    break;
+  mem->write_hook = blocks_invalidate;
+  mem->hook_ctx = cache;
+  return cache;
+}
 
-  case 0x27:
-    daa(state);
-    break;
+static void blocks_destroy(struct block_cache *cache) {
+  for (u32 start = 0; start < MAX_MEMORY; start++)
+    free(cache->blocks[start]);
+  blocks_free_retired(cache);
+  if (cache->jit != NULL)
+    jit_destroy(cache->jit);
+  free(cache);
+}
 
-  case 0x29: // DAD H
-    dad(state, state->Register.hl);
-    break;
+// Whether a read from a byte with these watch bits always gives the same
+// value until a write to it: RAM, ROM, or a page shared with the memory a
+// clone was made from.
+static bool reads_plain(const u8 watch) {
+  return (watch & (WATCH_READ | WATCH_SHARED)) != WATCH_READ;
+}
 
-  case 0x2A: // LHLD a16
-    u16 addr = combine(mem_read_byte(state->Register.pc + 1),
-                       mem_read_byte(state->Register.pc));
-    state->Register.l = mem_read_byte(addr);
-    state->Register.h = mem_read_byte(addr + 1);
-    state->Register.pc += 2;
-    break;
+// Whether the instruction at `addr` lies in plain RAM or ROM, where writes
+// to it can be watched. Anything else runs without the cache.
+static bool code_is_plain(const memory *mem, const u16 addr) {
+  if (!reads_plain(mem->watch[addr]))
+    return false;
 
-  case 0x2B: // DCX H
-    state->Register.hl--;
-    break;
+  const u8 length = OPCODES_LENGTH[mem_read_byte(mem, addr)];
+  for (u8 i = 1; i < length; i++)
+    if (!reads_plain(mem->watch[(u16)(addr + i)]))
+      return false;
+  return true;
+}
 
-  case 0x2C: // INR L
-    inr_l(state);
-    break;
+// Instructions an idle loop may contain: no stores, stack, I/O or control
+// transfers, so an iteration can only change registers and flags.
+static bool idle_safe(const u8 op) {
+  if (op >= 0x40 && op < 0xC0) // MOV and ALU ops, but not MOV M,r or HLT
+    return (op & 0xF8) != 0x70;
 
-  case 0x2D: // DCR L
-    dcr_l(state);
-    break;
+  switch (op & 0xC7) {
+  case 0x04: // INR
+  case 0x05: // DCR
+  case 0x06: // MVI
+    return ((op >> 3) & 7) != 6;
+  case 0xC6: // immediate ALU ops
+    return true;
+  }
 
-  case 0x2E: // MVI L,d8
-    state->Register.l = mem_read_byte(state->Register.pc);
-    state->Register.pc++;
-    break;
+  switch (op & 0xCF) {
+  case 0x01: // LXI
+  case 0x03: // INX
+  case 0x09: // DAD
+  case 0x0B: // DCX
+    return true;
+  }
 
+  switch (op) {
+  case 0x00: // NOP
+  case 0x07: // RLC
+  case 0x0F: // RRC
+  case 0x17: // RAL
+  case 0x1F: // RAR
+  case 0x27: // DAA
   case 0x2F: // CMA
-    state->Register.a = ~state->Register.a;
-    break;
-
-  case 0x31: // LXI SP, d16
-    lxi_sp(state, combine(mem_read_byte(state->Register.pc + 1),
-                          mem_read_byte(state->Register.pc)));
-    break;
-
-  case 0x32: // STA a16
-    mem_write_byte(combine(mem_read_byte(state->Register.pc + 1),
-                           mem_read_byte(state->Register.pc)),
-                   state->Register.a);
-    state->Register.pc += 2;
-    break;
-
-  case 0x33: // INX SP
-    state->Register.sp++;
-    break;
-
-  case 0x34: // INR M
-    inr_m(state);
-    break;
-
-  case 0x35: // DCR M
-    dcr_m(state);
-    break;
-
-  case 0x36: // MVI M,d8
-    mem_write_byte(state->Register.hl, mem_read_byte(state->Register.pc));
-    state->Register.pc++;
-    break;
-
   case 0x37: // STC
-    state->Flag.cy = 1;
-    break;
-
-  case 0x39: // DAD SP
-    dad(state, state->Register.sp);
-    break;
-
-  case 0x3A:
-    state->Register.a =
-        mem_read_byte(combine(mem_read_byte(state->Register.pc + 1),
-                              mem_read_byte(state->Register.pc)));
-    state->Register.pc += 2;
-    break;
-
-  case 0x3B: // DCX SP
-    state->Register.sp -= 1;
-    break;
-
-  case 0x3C: // INR A
-    inr_a(state);
-    break;
-
-  case 0x3D: // DCR A
-    dcr_a(state);
-    break;
-
-  case 0x3E: // MVI A, d8
-    state->Register.a = mem_read_byte(state->Register.pc);
-    state->Register.pc++;
-    break;
-
   case 0x3F: // CMC
-    state->Flag.cy = !state->Flag.cy;
-    break;
-
-  case 0x40: // MOV B, B
-    mov(&state->Register.b, state->Register.b);
-    break;
-
-  case 0x41: // MOV B, C
-    mov(&state->Register.b, state->Register.c);
-    break;
-
-  case 0x42: // MOV B, D
-    mov(&state->Register.b, state->Register.d);
-    break;
-
-  case 0x43: // MOV B, E
-    mov(&state->Register.b, state->Register.e);
-    break;
-
-  case 0x44: // MOV B, H
-    mov(&state->Register.b, state->Register.h);
-    break;
-
-  case 0x45: // MOV B, L
-    mov(&state->Register.b, state->Register.l);
-    break;
-
-  case 0x46: // MOV B, M
-    mov(&state->Register.b, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x47: // MOV B, A
-    mov(&state->Register.b, state->Register.a);
-    break;
-
-  case 0x48: // MOV C, B
-    mov(&state->Register.c, state->Register.b);
-    break;
-
-  case 0x49: // MOV C, C
-    mov(&state->Register.c, state->Register.c);
-    break;
-
-  case 0x4A: // MOV C, D
-    mov(&state->Register.c, state->Register.d);
-    break;
-
-  case 0x4B: // MOV C, E
-    mov(&state->Register.c, state->Register.e);
-    break;
-
-  case 0x4C: // MOV C, H
-    mov(&state->Register.c, state->Register.h);
-    break;
-
-  case 0x4D: // MOV C, L
-    mov(&state->Register.c, state->Register.l);
-    break;
-
-  case 0x4E: // MOV C, M
-    mov(&state->Register.c, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x4F: // MOV C, A
-    mov(&state->Register.c, state->Register.a);
-    break;
-
-  case 0x50: // MOV D, B
-    mov(&state->Register.d, state->Register.b);
-    break;
-
-  case 0x51: // MOV D, C
-    mov(&state->Register.d, state->Register.c);
-    break;
-
-  case 0x52: // MOV D, D
-    mov(&state->Register.d, state->Register.d);
-    break;
-
-  case 0x53: // MOV D, E
-    mov(&state->Register.d, state->Register.e);
-    break;
-
-  case 0x54: // MOV D, H
-    mov(&state->Register.d, state->Register.h);
-    break;
-
-  case 0x55: // MOV D, L
-    mov(&state->Register.d, state->Register.l);
-    break;
-
-  case 0x56: // MOV D, M
-    mov(&state->Register.d, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x57: // MOV D, A
-    mov(&state->Register.d, state->Register.a);
-    break;
-
-  case 0x58: // MOV E, B
-    mov(&state->Register.e, state->Register.b);
-    break;
-
-  case 0x59: // MOV E, C
-    mov(&state->Register.e, state->Register.c);
-    break;
-
-  case 0x5A: // MOV E, D
-    mov(&state->Register.e, state->Register.d);
-    break;
-
-  case 0x5B: // MOV E, E
-    mov(&state->Register.e, state->Register.e);
-    break;
-
-  case 0x5C: // MOV E, H
-    mov(&state->Register.e, state->Register.h);
-    break;
-
-  case 0x5D: // MOV E, L
-    mov(&state->Register.e, state->Register.l);
-    break;
-
-  case 0x5E: // MOV E, M
-    mov(&state->Register.e, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x5F: // MOV E, A
-    mov(&state->Register.e, state->Register.a);
-    break;
-
-  case 0x60: // MOV H, B
-    mov(&state->Register.h, state->Register.b);
-    break;
-
-  case 0x61: // MOV H, C
-    mov(&state->Register.h, state->Register.c);
-    break;
-
-  case 0x62: // MOV H, D
-    mov(&state->Register.h, state->Register.d);
-    break;
-
-  case 0x63: // MOV H, E
-    mov(&state->Register.h, state->Register.e);
-    break;
-
-  case 0x64: // MOV H, H
-    mov(&state->Register.h, state->Register.h);
-    break;
-
-  case 0x65: // MOV H, L
-    mov(&state->Register.h, state->Register.l);
-    break;
-
-  case 0x66: // MOV H, M
-    mov(&state->Register.h, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x67: // MOV H, A
-    mov(&state->Register.h, state->Register.a);
-    break;
-
-  case 0x68: // MOV L, B
-    mov(&state->Register.l, state->Register.b);
-    break;
-
-  case 0x69: // MOV L, C
-    mov(&state->Register.l, state->Register.c);
-    break;
-
-  case 0x6A: // MOV L, D
-    mov(&state->Register.l, state->Register.d);
-    break;
-
-  case 0x6B: // MOV L, E
-    mov(&state->Register.l, state->Register.e);
-    break;
-
-  case 0x6C: // MOV L, H
-    mov(&state->Register.l, state->Register.h);
-    break;
-
-  case 0x6D: // MOV L, L
-    mov(&state->Register.l, state->Register.l);
-    break;
-
-  case 0x6E: // MOV L, M
-    mov(&state->Register.l, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x6F: // MOV L, A
-    mov(&state->Register.l, state->Register.a);
-    break;
-
-  case 0x70: // MOV M, B
-    mem_write_byte(state->Register.hl, state->Register.b);
-    break;
-
-  case 0x71: // MOV M, C
-    mem_write_byte(state->Register.hl, state->Register.c);
-    break;
-
-  case 0x72: // MOV M, D
-    mem_write_byte(state->Register.hl, state->Register.d);
-    break;
-
-  case 0x73: // MOV M, E
-    mem_write_byte(state->Register.hl, state->Register.e);
-    break;
-
-  case 0x74: // MOV M, H
-    mem_write_byte(state->Register.hl, state->Register.h);
-    break;
-
-  case 0x75: // MOV M, L
-    mem_write_byte(state->Register.hl, state->Register.l);
-    break;
-
-  case 0x76: // HLT
-    hlt(state);
-    break;
-
-  case 0x77: // MOV M, A
-    mem_write_byte(state->Register.hl, state->Register.a);
-    break;
-
-  case 0x78: // MOV A, B
-    mov(&state->Register.a, state->Register.b);
-    break;
-
-  case 0x79: // MOV A, C
-    mov(&state->Register.a, state->Register.c);
-    break;
-
-  case 0x7A: // MOV A, D
-    mov(&state->Register.a, state->Register.d);
-    break;
-
-  case 0x7B: // MOV A, E
-    mov(&state->Register.a, state->Register.e);
-    break;
-
-  case 0x7C: // MOV A, H
-    mov(&state->Register.a, state->Register.h);
-    break;
-
-  case 0x7D: // MOV A, L
-    mov(&state->Register.a, state->Register.l);
-    break;
-
-  case 0x7E: // MOV A, M
-    mov(&state->Register.a, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x7F: // MOV A, A
-    mov(&state->Register.a, state->Register.a);
-    break;
-
-  case 0x80: // ADD B
-    add(state, state->Register.b);
-    break;
-
-  case 0x81: // ADD C
-    add(state, state->Register.c);
-    break;
-
-  case 0x82: // ADD D
-    add(state, state->Register.d);
-    break;
-
-  case 0x83: // ADD E
-    add(state, state->Register.e);
-    break;
-
-  case 0x84: // ADD H
-    add(state, state->Register.h);
-    break;
-
-  case 0x85: // ADD L
-    add(state, state->Register.l);
-    break;
-
-  case 0x86: // ADD M
-    add(state, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x87: // ADD A
-    add(state, state->Register.a);
-    break;
-
-  case 0x88:
-    adc(state, state->Register.b);
-    break;
-
-  case 0x89:
-    adc(state, state->Register.c);
-    break;
-
-  case 0x8A:
-    adc(state, state->Register.d);
-    break;
-
-  case 0x8B:
-    adc(state, state->Register.e);
-    break;
-
-  case 0x8C:
-    adc(state, state->Register.h);
-    break;
-
-  case 0x8D:
-    adc(state, state->Register.l);
-    break;
-
-  case 0x8E:
-    adc(state, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x8F:
-    adc(state, state->Register.a);
-    break;
-
-  case 0x90: // SUB B
-    sub(state, state->Register.b);
-    break;
-
-  case 0x91: // SUB C
-    sub(state, state->Register.c);
-    break;
-
-  case 0x92: // SUB D
-    sub(state, state->Register.d);
-    break;
-
-  case 0x93: // SUB E
-    sub(state, state->Register.e);
-    break;
-
-  case 0x94: // SUB H
-    sub(state, state->Register.h);
-    break;
-
-  case 0x95: // SUB L
-    sub(state, state->Register.l);
-    break;
-
-  case 0x96: // SUB M
-    sub(state, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x97: // SUB A
-    sub(state, state->Register.a);
-    break;
-
-  case 0x98:
-    sbb(state, state->Register.b);
-    break;
-
-  case 0x99:
-    sbb(state, state->Register.c);
-    break;
-
-  case 0x9A:
-    sbb(state, state->Register.d);
-    break;
-
-  case 0x9B:
-    sbb(state, state->Register.e);
-    break;
-
-  case 0x9C:
-    sbb(state, state->Register.h);
-    break;
-
-  case 0x9D:
-    sbb(state, state->Register.l);
-    break;
-
-  case 0x9E:
-    sbb(state, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0x9F:
-    sbb(state, state->Register.a);
-    break;
-
-  case 0xA0: // ANA B
-    ana(state, state->Register.b);
-    break;
-
-  case 0xA1: // ANA C
-    ana(state, state->Register.c);
-    break;
-
-  case 0xA2: // ANA D
-    ana(state, state->Register.d);
-    break;
-
-  case 0xA3: // ANA E
-    ana(state, state->Register.e);
-    break;
-
-  case 0xA4: // ANA H
-    ana(state, state->Register.h);
-    break;
-
-  case 0xA5: // ANA L
-    ana(state, state->Register.l);
-    break;
-
-  case 0xA6: // ANA M
-    ana(state, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0xA7: // ANA A
-    ana(state, state->Register.a);
-    break;
-
-  case 0xA8:
-    xra(state, state->Register.b);
-    break;
-
-  case 0xA9:
-    xra(state, state->Register.c);
-    break;
-
-  case 0xAA:
-    xra(state, state->Register.d);
-    break;
-
-  case 0xAB:
-    xra(state, state->Register.e);
-    break;
-
-  case 0xAC:
-    xra(state, state->Register.h);
-    break;
-
-  case 0xAD:
-    xra(state, state->Register.l);
-    break;
-
-  case 0xAE:
-    xra(state, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0xAF:
-    xra(state, state->Register.a);
-    break;
-
-  case 0xB0: // ORA B
-    ora(state, state->Register.b);
-    break;
-
-  case 0xB1: // ORA C
-    ora(state, state->Register.c);
-    break;
-
-  case 0xB2: // ORA D
-    ora(state, state->Register.d);
-    break;
-
-  case 0xB3: // ORA E
-    ora(state, state->Register.e);
-    break;
-
-  case 0xB4: // ORA H
-    ora(state, state->Register.h);
-    break;
-
-  case 0xB5: // ORA L
-    ora(state, state->Register.l);
-    break;
-
-  case 0xB6: // ORA M
-    ora(state, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0xB7: // ORA A
-    ora(state, state->Register.a);
-    break;
-
-  case 0xB8:
-    cmp(state, state->Register.b);
-    break;
-
-  case 0xB9:
-    cmp(state, state->Register.c);
-    break;
-
-  case 0xBA:
-    cmp(state, state->Register.d);
-    break;
-
-  case 0xBB:
-    cmp(state, state->Register.e);
-    break;
-
-  case 0xBC:
-    cmp(state, state->Register.h);
-    break;
-
-  case 0xBD:
-    cmp(state, state->Register.l);
-    break;
-
-  case 0xBE:
-    cmp(state, mem_read_byte(state->Register.hl));
-    break;
-
-  case 0xBF:
-    cmp(state, state->Register.a);
-    break;
-
-  case 0xC0:
-    if (!state->Flag.z) {
-      state->cycle += 6;
-      ret(state);
-    }
-    break;
-
-  case 0xC2:
-    if (state->Flag.z == 0)
-      jmp(state);
-    else
-      state->Register.pc += 2;
-    break;
-
-  case 0xC3:
-    jmp(state);
-    break;
-
-  case 0xC4:
-    if (!state->Flag.z) {
-      state->cycle += 6;
-      call(state);
-    } else {
-      state->Register.pc += 2;
-    }
-    break;
-
-  case 0xC5:
-    stack_push(state, state->Register.b, state->Register.c);
-    break; // PUSH B
-
-  case 0xC6:
-    adi(state);
-    break;
-
-  case 0xC7:
-    rst(state, 0);
-    break;
-
-  case 0xC8:
-    if (state->Flag.z) {
-      state->cycle += 6;
-      ret(state);
-    }
-    break;
-
-  case 0xC9:
-    ret(state);
-    break;
-
-  case 0xCA:
-    if (state->Flag.z)
-      jmp(state);
-    else
-      state->Register.pc += 2;
-    break;
-
-  case 0xCC:
-    if (state->Flag.z) {
-      call(state);
-      state->cycle += 6;
+  case 0x0A: // LDAX B
+  case 0x1A: // LDAX D
+  case 0x2A: // LHLD
+  case 0x3A: // LDA
+  case 0xEB: // XCHG
+    return true;
+  }
+  return false;
+}
+
+// A block that jumps back to its own start and only reads memory, like a
+// loop polling a flag that an interrupt handler sets.
+static bool idle_loop(const struct block *block) {
+  const struct insn *jump = &block->insn[block->count - 1];
+  if ((jump->opcode != 0xC3 && (jump->opcode & 0xC7) != 0xC2) ||
+      jump->operand != block->start)
+    return false;
+
+  for (u8 i = 0; i + 1 < block->count; i++)
+    if (!idle_safe(block->insn[i].opcode))
+      return false;
+  return true;
+}
+
+// Whether every byte the loop reads, at the current register values, is
+// plain memory that reads the same each time.
+static bool idle_reads_plain(const i8080 *state, const struct block *block) {
+  const u8 *watch = state->mem->watch;
+
+  for (u8 i = 0; i + 1 < block->count; i++) {
+    const struct insn *in = &block->insn[i];
+    u16 addr;
+    u8 bytes = 1;
+    if (in->opcode == 0x3A) {
+      addr = in->operand;
+    } else if (in->opcode == 0x2A) {
+      addr = in->operand;
+      bytes = 2;
+    } else if (in->opcode == 0x0A) {
+      addr = state->Register.bc;
+    } else if (in->opcode == 0x1A) {
+      addr = state->Register.de;
+    } else if (in->opcode >= 0x40 && in->opcode < 0xC0 &&
+               (in->opcode & 7) == 6) { // MOV r,M and ALU ops on M
+      addr = state->Register.hl;
     } else {
-      state->Register.pc += 2;
+      continue;
     }
-    break;
-
-  case 0xCD:
-    call(state);
-    break;
 
-  case 0xCE:
-    aci(state);
-    break;
-
-  case 0xCF:
-    rst(state, 0x08);
-    break;
-
-  case 0xD0:
-    if (!state->Flag.cy) {
-      state->cycle += 6;
-      ret(state);
-    }
-    break;
-
-  case 0xD2:
-    if (!state->Flag.cy)
-      jmp(state);
-    else
-      state->Register.pc += 2;
-    break;
-
-  case 0xD3:
-    out(state);
-    break;
-
-  case 0xD4:
-    if (!state->Flag.cy) {
-      state->cycle += 6;
-      call(state);
-    } else {
-      state->Register.pc += 2;
+    for (u8 j = 0; j < bytes; j++)
+      if (!reads_plain(watch[(u16)(addr + j)]))
+        return false;
+  }
+  return true;
+}
+
+// Whether every instruction has to run for state->trace to see it
+static inline bool tracing(const i8080 *state) {
+#if TRACE
+  return state->trace != NULL;
+#else
+  (void)state;
+  return false;
+#endif
+}
+
+// Called on entering an idle loop. If it comes back to its start with the
+// registers and flags it left with, the next iterations do the same until
+// something outside the CPU writes memory, which only happens between runs.
+// Those iterations are skipped: the cycle count moves on by all the whole
+// ones that end before `limit`, and the last one runs as usual.
+//
+// A loop that keeps coming back with other registers, like one counting
+// down, is no longer treated as idle after IDLE_TRIES such entries, so that
+// it doesn't pay for the check each time and can be translated.
+static void idle_skip(i8080 *state, struct block *block, const u64 limit) {
+  struct block_cache *const cache = state->cache;
+
+  i8080_flags_sync(state);
+  const u16 regs[5] = {state->Register.sp, state->Register.psw,
+                       state->Register.bc, state->Register.de,
+                       state->Register.hl};
+
+  const bool again = cache->idle.valid && cache->idle.start == block->start &&
+                     cache->idle.cycle + block->cycles == state->cycle;
+  const bool same = again && memcmp(cache->idle.regs, regs, sizeof(regs)) == 0;
+  if (again && !same && ++block->moving >= IDLE_TRIES)
+    block->idle = false;
+  else if (same)
+    block->moving = 0;
+
+  if (same && idle_reads_plain(state, block) && !tracing(state) &&
+      state->cycle < limit) {
+    const u64 skipped = (limit - 1 - state->cycle) / block->cycles;
+    state->cycle += skipped * block->cycles;
+#if STATS
+    // every iteration runs the whole block and takes its jump back
+    u16 pc = block->start;
+    for (u8 i = 0; i < block->count; i++) {
+      const struct insn *in = &block->insn[i];
+      state->stats.executed[in->opcode] += skipped;
+      if (state->profile != NULL) {
+        state->profile->executed[pc] += skipped;
+        state->profile->cycles[pc] += skipped * in->cycles;
+      }
+      pc += in->length;
     }
-    break;
-
-  case 0xD5: // PUSH D
-    stack_push(state, state->Register.d, state->Register.e);
-    break;
-
-  case 0xD6:
-    sui(state);
-    break;
+    const u8 jump = block->insn[block->count - 1].opcode;
+    if (jump != 0xC3)
+      state->stats.taken[jump] += skipped;
+#endif
+  }
 
-  case 0xD7:
-    rst(state, 0x10);
-    break;
+  cache->idle.valid = true;
+  cache->idle.start = block->start;
+  cache->idle.cycle = state->cycle;
+  memcpy(cache->idle.regs, regs, sizeof(regs));
+}
 
-  case 0xD8:
-    if (state->Flag.cy) {
-      state->cycle += 6;
-      ret(state);
-    }
-    break;
-
-  case 0xDA:
-    if (state->Flag.cy)
-      jmp(state);
-    else
-      state->Register.pc += 2;
-    break;
-
-  case 0xDB:
-    in(state);
-    break;
-
-  case 0xDC:
-    if (state->Flag.cy) {
-      state->cycle += 6;
-      call(state);
-    } else {
-      state->Register.pc += 2;
+static struct block *block_compile(const i8080 *state, const u16 start,
+                                   const void *const *dispatch) {
+  struct insn insn[MAX_BLOCK_INSNS];
+  u8 count = 0;
+  u16 addr = start;
+
+  for (;;) {
+    const u8 opcode = mem_read_byte(state->mem, addr);
+    struct insn *in = &insn[count++];
+
+    in->handler = dispatch[opcode];
+    in->opcode = opcode;
+    in->length = OPCODES_LENGTH[opcode];
+    in->cycles = OPCODES_CYCLES[opcode];
+    in->operand = 0;
+    if (in->length == 2)
+      in->operand = mem_read_byte(state->mem, addr + 1);
+    else if (in->length == 3)
+      in->operand = combine(mem_read_byte(state->mem, addr + 2),
+                            mem_read_byte(state->mem, addr + 1));
+
+    // don't let a block wrap around the top of memory
+    if (ends_block(opcode) || count == MAX_BLOCK_INSNS ||
+        addr + in->length > 0xFFFF ||
+        at_trap(state, (u16)(addr + in->length)) ||
+        !code_is_plain(state->mem, (u16)(addr + in->length))) {
+      addr += in->length;
+      break;
     }
-    break;
-
-  case 0xDE:
-    sbi(state);
-    break;
+    addr += in->length;
+  }
 
-  case 0xDF:
-    rst(state, 0x18);
-    break;
+  struct block *block = malloc(sizeof(*block) + count * sizeof(*insn));
+  if (block == NULL) {
+    fprintf(stderr, "Failed to allocate block at %04X\n", start);
+    exit(1);
+  }
 
-  case 0xE0:
-    if (state->Flag.p == 0) {
-      state->cycle += 6;
-      ret(state);
+  block->start = start;
+  block->size = (u16)(addr - start);
+  block->count = count;
+  block->hits = 0;
+  memcpy(block->insn, insn, count * sizeof(*insn));
+  block->cycles = 0;
+  for (u8 i = 0; i < count; i++)
+    block->cycles += insn[i].cycles;
+  block->idle = idle_loop(block);
+  block->moving = 0;
+
+  for (u8 i = 0; i < block->size; i++)
+    state->mem->watch[(u16)(start + i)] |= WATCH_CODE;
+
+  state->cache->blocks[start] = block;
+  return block;
+}
+
+// Runs instructions like execute_threaded, but from blocks of predecoded
+// instructions: the opcode fetch, operand reads and cycle lookup are done
+// once when a block is built, and only the handler jump is left per
+// instruction. Writes to code drop the blocks that cover it.
+//
+// For ENGINE_JIT, blocks that have been entered JIT_THRESHOLD times are
+// translated to native code, which then runs in their place. Blocks that
+// start at a trap are never translated, so native code always comes back
+// to C in front of one. Neither are idle loops, which are skipped through
+// instead, until they turn out to be making progress. While state->trace
+// records, native code is passed over so that every instruction is seen.
+static void execute_blocks(i8080 *state, const u64 limit) {
+  static const void *const dispatch[256] = DISPATCH_TABLE;
+
+  struct block_cache *const cache = state->cache;
+  struct jit *const jit = cache->jit;
+  u8 opcode;
+  u32 generation;
+  struct block *block;
+  const struct insn *insn;
+  const struct insn *last;
+  INSN_LOCALS;
+
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    INSN_START();                                                              \
+    opcode = insn->opcode;                                                     \
+    state->Register.pc++;                                                      \
+    state->cycle += insn->cycles;                                              \
+    STAT_EXECUTED();                                                           \
+    goto *insn->handler;                                                       \
+  } while (0)
+
+  // memory may have changed since the last run
+  cache->idle.valid = false;
+
+  // the first instruction runs even at a trap
+  goto enter_block;
+
+leave_block:
+  if (at_trap(state, state->Register.pc))
+    return;
+
+enter_block:
+  blocks_free_retired(cache);
+  block = cache->blocks[state->Register.pc];
+  if (block == NULL) {
+    if (!code_is_plain(state->mem, state->Register.pc)) {
+      INSN_START();
+      i8080_decode(state, i8080_fetch(state));
+      INSN_END();
+      if (should_stop(state, limit))
+        return;
+      goto leave_block;
     }
-    break;
-
-  case 0xE2:
-    if (state->Flag.p == 0)
-      jmp(state);
-    else
-      state->Register.pc += 2;
-    break;
-
-  case 0xE3: {
-    u8 rl = state->Register.l;
-    state->Register.l = mem_read_byte(state->Register.sp);
-    mem_write_byte(state->Register.sp, rl);
-
-    u8 rh = state->Register.h;
-    state->Register.h = mem_read_byte(state->Register.sp + 1);
-    mem_write_byte(state->Register.sp + 1, rh);
-    break;
+    block = block_compile(state, state->Register.pc, dispatch);
   }
 
-  case 0xE4:
-    if (!state->Flag.p) {
-      state->cycle += 6;
-      call(state);
-    } else {
-      state->Register.pc += 2;
+  if (block->idle) {
+    idle_skip(state, block, limit);
+  } else if (jit != NULL && !tracing(state)) {
+    void *native = jit_lookup(jit, block->start);
+    if (native == NULL && !at_trap(state, block->start)) {
+      if (block->hits < JIT_THRESHOLD)
+        block->hits++;
+      else
+        native = jit_compile(jit, block->start, block->insn, block->count);
     }
-    break;
-
-  case 0xE5:
-    stack_push(state, state->Register.h, state->Register.l);
-    break; // PUSH H
-
-  case 0xE6:
-    ani(state);
-    break;
-
-  case 0xE7:
-    rst(state, 0x20);
-    break;
-
-  case 0xE8:
-    if (state->Flag.p) {
-      state->cycle += 6;
-      ret(state);
+    // if the limit falls inside the block, interpret it instead
+    if (native != NULL && jit_run(jit, state, native, limit) != 0) {
+      if (should_stop(state, limit))
+        return;
+      goto leave_block;
     }
-    break;
-
-  case 0xE9:
-    state->Register.pc = state->Register.hl;
-    break;
-
-  case 0xEA:
-    if (state->Flag.p == 1)
-      jmp(state);
-    else
-      state->Register.pc += 2;
-    break;
-
-  case 0xEB: {
-    u16 tmp = state->Register.hl;
-    state->Register.hl = state->Register.de;
-    state->Register.de = tmp;
-    break;
   }
 
-  case 0xEC:
-    if (state->Flag.p) {
-      state->cycle += 6;
-      call(state);
-    } else {
-      state->Register.pc += 2;
-    }
-    break;
-
-  case 0xEE:
-    xri(state);
-    break;
+  generation = cache->generation;
+  insn = block->insn;
+  last = insn + block->count;
+  DISPATCH();
+
+#undef D8
+#undef D16
+#define D8 ((u8)insn->operand)
+#define D16 (insn->operand)
+#define OP(code) op_##code:
+#define NEXT                                                                   \
+  INSN_END();                                                                  \
+  if (should_stop(state, limit))                                               \
+    return;                                                                    \
+  if (++insn == last || generation != cache->generation)                      \
+    goto leave_block;                                                          \
+  DISPATCH()
+
+#include "opcodes.inc"
+
+#undef OP
+#undef NEXT
+#undef DISPATCH
+}
+
+#undef DISPATCH_TABLE
+#undef L
+#endif
+
+// Runs the interrupt's instruction, usually an RST.
+static void take_interrupt(i8080 *state) {
+  state->inte = false;
+  state->inte_pending = false;
+  state->status = RUNNING;
+#if STATS
+  if (state->callgraph != NULL)
+    state->callgraph->interrupt = true;
+  i8080_decode(state, state->inte_handle);
+  if (state->callgraph != NULL)
+    state->callgraph->interrupt = false;
+  state->stats.interrupts++;
+#else
+  i8080_decode(state, state->inte_handle);
+#endif
+}
+
+// Runs instructions on the selected engine until should_stop() or a trap.
+static void execute(i8080 *state, const u64 limit) {
+#if HAVE_COMPUTED_GOTO
+  if (state->engine == ENGINE_THREADED) {
+    execute_threaded(state, limit);
+    return;
+  }
+  if (state->engine == ENGINE_BLOCK || state->engine == ENGINE_JIT) {
+    execute_blocks(state, limit);
+    return;
+  }
+#endif
+  INSN_LOCALS;
+  do {
+    INSN_START();
+    u8 opcode = i8080_fetch(state);
+    i8080_decode(state, opcode);
+    INSN_END();
+  } while (!should_stop(state, limit) && !at_trap(state, state->Register.pc));
+}
 
-  case 0xEF:
-    rst(state, 0x28);
-    break;
+void i8080_execute(i8080 *state) {
+  if (state->inte && state->inte_pending)
+    take_interrupt(state);
+  else if (state->status != HALTED)
+    execute(state, state->cycle + 1);
+}
 
-  case 0xF0:
-    if (!state->Flag.s) {
-      state->cycle += 6;
-      ret(state);
-    }
-    break;
-
-  case 0xF2:
-    if (!state->Flag.s)
-      jmp(state);
-    else
-      state->Register.pc += 2;
-    break;
-
-  case 0xF3:
-    state->inte = false;
-    break;
-
-  case 0xF4:
-    if (!state->Flag.s) {
-      state->cycle += 6;
-      call(state);
-    } else {
-      state->Register.pc += 2;
-    }
-    break;
+u64 i8080_run(i8080 *state, const u64 cycle_budget) {
+  const u64 start = state->cycle;
+  const u64 limit =
+      cycle_budget > UINT64_MAX - start ? UINT64_MAX : start + cycle_budget;
 
-  case 0xF5:
-    push_psw(state);
-    break;
+  if (state->inte && state->inte_pending) {
+    take_interrupt(state);
+    if (state->cycle >= limit || at_trap(state, state->Register.pc))
+      return state->cycle - start;
+  }
 
-  case 0xF6:
-    ori(state);
-    break;
+  if (state->status != HALTED)
+    execute(state, limit);
 
-  case 0xF7:
-    rst(state, 0x30);
-    break;
+  // Only an interrupt wakes the CPU, and the caller raises those between
+  // runs, so the rest of the budget passes in one step.
+  if (state->status == HALTED && state->cycle < limit) {
+#if STATS
+    state->stats.halted_cycles += limit - state->cycle;
+#endif
+    state->cycle = limit;
+  }
 
-  case 0xF8:
-    if (state->Flag.s) {
-      state->cycle += 6;
-      ret(state);
-    }
-    break;
-
-  case 0xF9:
-    state->Register.sp = state->Register.hl;
-    break;
-
-  case 0xFA:
-    if (state->Flag.s)
-      jmp(state);
-    else
-      state->Register.pc += 2;
-    break;
-
-  case 0xFB:
-    state->inte = true;
-    break;
-
-  case 0xFC:
-    if (state->Flag.s) {
-      state->cycle += 6;
-      call(state);
-    } else {
-      state->Register.pc += 2;
-    }
-    break;
-
-  case 0xFE:
-    cpi(state);
-    break;
-
-  case 0xFF:
-    rst(state, 0x38);
-    break;
-
-  // POP instructions
-  case 0xC1:
-    stack_pop(state, &state->Register.b, &state->Register.c);
-    break; // POP B
-  case 0xD1:
-    stack_pop(state, &state->Register.d, &state->Register.e);
-    break; // POP D
-  case 0xE1:
-    stack_pop(state, &state->Register.h, &state->Register.l);
-    break; // POP H
-  case 0xF1:
-    pop_psw(state);
-    break; // POP PSW
-
-  case 0x08:
-  case 0x10:
-  case 0x18:
-  case 0x20:
-  case 0x28:
-  case 0x30:
-  case 0x38:
-    nop();
-    break; // undocumented NOP
+  return state->cycle - start;
+}
 
-  case 0xCB:
-  case 0xD9:
-  case 0xDD:
-  case 0xED:
-  case 0xFD:
-    unimplemented(opcode);
-    break;
+int i8080_trap(i8080 *state, const u16 addr) {
+  if (at_trap(state, addr))
+    return 0;
+  if (state->trap_count == MAX_TRAPS) {
+    fprintf(stderr, "No room for a trap at %04X\n", addr);
+    return 1;
   }
+
+  state->traps[state->trap_count++] = addr;
+#if HAVE_COMPUTED_GOTO
+  // blocks must end in front of it
+  if (state->cache != NULL)
+    blocks_invalidate(state->cache, addr);
+#endif
+  return 0;
 }
 
-void i8080_execute(i8080 *state) {
-  if (state->inte && state->inte_pending) {
-    state->inte = false;
-    state->inte_pending = false;
-    state->status = RUNNING;
-    i8080_decode(state, state->inte_handle);
-  } else if (state->status != HALTED) {
-    u8 opcode = i8080_fetch(state);
-    i8080_decode(state, opcode);
-  }
+void i8080_clear_traps(i8080 *state) { state->trap_count = 0; }
+
+void i8080_attach_port(i8080 *state, const u8 port, const port_read_fn read,
+                       const port_write_fn write, void *ctx) {
+  state->ports[port] = (struct port){read, write, ctx};
 }
 
 void i8080_interrupt(struct i8080 *state, u8 opcode) {
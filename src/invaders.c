@@ -0,0 +1,241 @@
+#include "invaders.h"
+#include "common.h"
+#include "memory.h"
+#include <stdlib.h>
+#include <string.h>
+
+// 8K of ROM, 1K of work RAM and 7K of video RAM, mirrored up through the
+// rest of the address space
+static const struct mem_region invaders_map[] = {
+    {.kind = REGION_ROM, .start = ROM_ADDRESS, .size = WRAM_ADDRESS},
+    {.kind = REGION_RAM, .start = WRAM_ADDRESS, .size = 0x2000},
+    {.kind = REGION_MIRROR,
+     .start = 0x4000,
+     .size = 0xC000,
+     .source = WRAM_ADDRESS,
+     .source_size = 0x2000},
+};
+
+static u8 io_read(void *ctx, const u8 port, const u64 cycle) {
+  const struct invaders_io *io = ctx;
+  (void)cycle;
+
+  if (port == 3)
+    return io->shift >> (8 - io->shift_offset);
+  return io->inputs[port];
+}
+
+static void io_write(void *ctx, const u8 port, const u8 value,
+                     const u64 cycle) {
+  struct invaders_io *io = ctx;
+
+  switch (port) {
+  case 2:
+    io->shift_offset = value & 7;
+    break;
+  case 3:
+  case 5: {
+    u8 *latch = &io->sound[port == 5];
+    if (*latch != value)
+      io->sound_cycle = cycle;
+    *latch = value;
+    break;
+  }
+  case 4:
+    io->shift = (value << 8) | (io->shift >> 8);
+    break;
+  case 6:
+    io->watchdog = cycle;
+    break;
+  }
+}
+
+// The ports whose values come from outside the board; IN 3 follows from
+// the guest's OUTs
+static const u8 input_ports[] = {0, 1, 2};
+
+// IN 0-3, OUT 2-6
+static void attach_ports(struct invaders_io *io, struct i8080 *state) {
+  for (u8 port = 0; port <= 6; port++)
+    i8080_attach_port(state, port, port <= 3 ? io_read : NULL,
+                      port >= 2 ? io_write : NULL, io);
+}
+
+void invaders_io_attach(struct invaders_io *io, struct i8080 *state) {
+  memset(io, 0, sizeof(*io));
+  io->inputs[0] = 0x0E; // unused bits that read as 1
+  io->inputs[1] = 0x08;
+  attach_ports(io, state);
+}
+
+// Video RAM holds the picture rotated by 90 degrees, one bit per pixel: each
+// 32-byte run is a column of the upright screen, from the bottom up.
+// It is read through the page map, as a clone may still share it.
+void invaders_draw(struct invaders *m) {
+  for (int i = 0; i < GAME_WIDTH * GAME_HEIGHT / 8; i++) {
+    const int x = i * 8 / GAME_HEIGHT;
+    const int y = GAME_HEIGHT - 1 - (i * 8) % GAME_HEIGHT;
+    const u8 byte = mem_read_byte(m->cpu.mem, VRAM_ADDRESS + i);
+
+    for (int bit = 0; bit < 8; bit++) {
+      const u8 level = (byte >> bit) & 1 ? 0xFF : 0x00;
+      memset(m->screen[y - bit][x], level, 3);
+    }
+  }
+}
+
+static void mid_screen(struct scheduler *sched, void *ctx, const u64 cycle) {
+  struct invaders *m = ctx;
+  i8080_interrupt(&m->cpu, 0xCF);
+  sched_add(sched, cycle + INVADERS_FRAME_CYCLES, mid_screen, m);
+}
+
+static void vblank(struct scheduler *sched, void *ctx, const u64 cycle) {
+  struct invaders *m = ctx;
+  invaders_draw(m);
+  m->frames++;
+  i8080_interrupt(&m->cpu, 0xD7);
+  sched_add(sched, cycle + INVADERS_FRAME_CYCLES, vblank, m);
+}
+
+int invaders_init(struct invaders *m, const char *rom,
+                  const enum Engine engine) {
+  m->cpu = i8080_init_engine(engine);
+  invaders_io_attach(&m->io, &m->cpu);
+  memset(m->screen, 0, sizeof(m->screen));
+  m->frames = 0;
+
+  sched_init(&m->sched);
+  sched_add(&m->sched, INVADERS_FRAME_CYCLES / 2, mid_screen, m);
+  sched_add(&m->sched, INVADERS_FRAME_CYCLES, vblank, m);
+
+  const int result = mem_load_file(m->cpu.mem, rom, ROM_ADDRESS);
+  mem_map(m->cpu.mem, invaders_map, ARRAY_SIZE(invaders_map));
+  return result;
+}
+
+void invaders_free(struct invaders *m) { i8080_free(&m->cpu); }
+
+void invaders_run(struct invaders *m, const u64 cycles) {
+  sched_run(&m->sched, &m->cpu, m->cpu.cycle + cycles);
+}
+
+// i8080_run always runs the first instruction and stops once it passes the
+// one-cycle budget
+void invaders_step(struct invaders *m) {
+  sched_run(&m->sched, &m->cpu, m->cpu.cycle + 1);
+}
+
+// When the next event of `fn` is due, or UINT64_MAX if none is pending
+static u64 due(const struct scheduler *sched, const event_fn fn) {
+  for (u8 i = 0; i < sched->count; i++)
+    if (sched->events[i].fn == fn)
+      return sched->events[i].cycle;
+  return UINT64_MAX;
+}
+
+// The scheduler holds pointers to the board, so it is rebuilt rather than
+// copied
+static void schedule(struct invaders *m, const u64 next_mid,
+                     const u64 next_vblank) {
+  sched_init(&m->sched);
+  if (next_mid != UINT64_MAX)
+    sched_add(&m->sched, next_mid, mid_screen, m);
+  if (next_vblank != UINT64_MAX)
+    sched_add(&m->sched, next_vblank, vblank, m);
+}
+
+void invaders_clone(struct invaders *m, const struct invaders *parent,
+                    const enum Engine engine) {
+  m->cpu = i8080_clone(&parent->cpu, engine);
+  m->io = parent->io;
+  attach_ports(&m->io, &m->cpu);
+  m->frames = parent->frames;
+  schedule(m, due(&parent->sched, mid_screen), due(&parent->sched, vblank));
+}
+
+void invaders_save(struct invaders *m, u8 *buf) {
+  const struct invaders_io *io = &m->io;
+
+  buf = savestate_put_header(buf, MACHINE_INVADERS, INVADERS_STATE_SIZE);
+  buf = savestate_put_cpu(buf, &m->cpu);
+
+  for (int i = 0; i < 3; i++)
+    buf = savestate_put_u8(buf, io->inputs[i]);
+  buf = savestate_put_u16(buf, io->shift);
+  buf = savestate_put_u8(buf, io->shift_offset);
+  buf = savestate_put_u8(buf, io->sound[0]);
+  buf = savestate_put_u8(buf, io->sound[1]);
+  buf = savestate_put_u64(buf, io->sound_cycle);
+  buf = savestate_put_u64(buf, io->watchdog);
+  buf = savestate_put_u64(buf, m->frames);
+  buf = savestate_put_u64(buf, due(&m->sched, mid_screen));
+  savestate_put_u64(buf, due(&m->sched, vblank));
+}
+
+int invaders_load(struct invaders *m, const u8 *buf, const size_t length) {
+  if (savestate_check_header(buf, length, MACHINE_INVADERS,
+                             INVADERS_STATE_SIZE) != 0)
+    return 1;
+
+  struct invaders_io *io = &m->io;
+  buf = savestate_get_cpu(buf + SAVESTATE_HEADER_SIZE, &m->cpu);
+
+  for (int i = 0; i < 3; i++)
+    io->inputs[i] = savestate_get_u8(&buf);
+  io->shift = savestate_get_u16(&buf);
+  io->shift_offset = savestate_get_u8(&buf);
+  io->sound[0] = savestate_get_u8(&buf);
+  io->sound[1] = savestate_get_u8(&buf);
+  io->sound_cycle = savestate_get_u64(&buf);
+  io->watchdog = savestate_get_u64(&buf);
+  m->frames = savestate_get_u64(&buf);
+
+  const u64 next_mid = savestate_get_u64(&buf);
+  const u64 next_vblank = savestate_get_u64(&buf);
+  schedule(m, next_mid, next_vblank);
+  return 0;
+}
+
+struct movie *invaders_record(struct invaders *m) {
+  u8 *buf = malloc(INVADERS_STATE_SIZE);
+  if (buf == NULL)
+    return NULL;
+  invaders_save(m, buf);
+  struct movie *mv =
+      movie_record(&m->cpu, MACHINE_INVADERS, buf, INVADERS_STATE_SIZE,
+                   input_ports, ARRAY_SIZE(input_ports));
+  free(buf);
+  return mv;
+}
+
+int invaders_replay(struct invaders *m, struct movie *mv) {
+  if (mv->machine != MACHINE_INVADERS ||
+      invaders_load(m, mv->state, mv->state_size) != 0)
+    return 1;
+  invaders_draw(m);
+  movie_replay(mv, &m->cpu, input_ports, ARRAY_SIZE(input_ports));
+  return 0;
+}
+
+int invaders_save_file(struct invaders *m, const char *path) {
+  u8 *buf = malloc(INVADERS_STATE_SIZE);
+  if (buf == NULL)
+    return 1;
+  invaders_save(m, buf);
+  const int result = savestate_write_file(path, buf, INVADERS_STATE_SIZE);
+  free(buf);
+  return result;
+}
+
+int invaders_load_file(struct invaders *m, const char *path) {
+  size_t length;
+  const u8 *buf = savestate_map_file(path, &length);
+  if (buf == NULL)
+    return 1;
+  const int result = invaders_load(m, buf, length);
+  savestate_unmap_file(buf, length);
+  if (result == 0)
+    invaders_draw(m);
+  return result;
+}
@@ -0,0 +1,1278 @@
+#include "jit.h"
+
+#if JIT_X86_64
+
+#include <cpuid.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+
+// Translated blocks keep the 8080 registers in host registers and jump
+// straight from one block to the next through `entries`, so the interpreter
+// only sees the chain once it ends (and pc is only stored then). Flags are
+// materialized in F with LAHF, whose layout (S Z 0 AC 0 P 1 CY) is the
+// 8080's own, and left out where a later instruction in the block
+// overwrites them unread.
+
+// Size of the executable code cache. When it fills up all native code is
+// dropped and blocks are compiled again as they get hot.
+#define CACHE_SIZE (16 << 20)
+
+// Upper bound on the code one 8080 instruction turns into, including its
+// out-of-line slow paths.
+#define MAX_INSN_CODE 512
+
+#define MAX_LOADS 64
+#define MAX_STORES 64
+#define MAX_EXITS 128
+
+enum Reg {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+  NONE = 0xFF
+};
+
+// Host registers holding the 8080 registers, indexed like the register field
+// of the opcodes: B, C, D, E, H, L, M, A. Only the low byte is used.
+static const u8 HOST[8] = {R14, R15, R8, R9, R10, R11, NONE, R12};
+
+#define HOST_A R12
+#define HOST_F R13
+#define HOST_SP RSI // zero-extended, only ever changed by 16-bit ops
+#define HOST_STATE RBX
+#define HOST_MEM RBP
+
+// The enter stub's stack frame: the cycle count to stop at, and a flag the
+// slow path of a store sets when it has replaced the running block.
+#define SLOT_LIMIT 0
+#define SLOT_RETIRED 8
+
+// x86 ALU group numbers, in the 8080's ADD ADC SUB SBB ANA XRA ORA CMP order
+enum Alu { ADD, OR, ADC, SBB, AND, SUB, XOR, CMP };
+static const u8 ALU_X86[8] = {ADD, ADC, SUB, SBB, AND, XOR, OR, CMP};
+
+// x86 condition codes
+enum Cond { CC_AE = 3, CC_E = 4, CC_NE = 5 };
+
+#define ALL_FLAGS (FLAG_S | FLAG_Z | FLAG_P | FLAG_AC | FLAG_CY)
+
+// The flag tested by Jcc, Ccc and Rcc: NZ Z NC C PO PE P M
+static const u8 CONDITION_FLAG[8] = {FLAG_Z, FLAG_Z, FLAG_CY, FLAG_CY,
+                                     FLAG_P, FLAG_P, FLAG_S,  FLAG_S};
+
+// Extra cycles a conditional call or return takes when the condition holds
+#define TAKEN_CYCLES 6
+
+#define OFFSET(field) ((int32_t)offsetof(i8080, field))
+
+// Where generated code finds memory's watch bytes, relative to HOST_MEM
+#define WATCH_DISP ((int32_t)offsetof(memory, watch))
+
+// The translated code of one CPU
+struct jit {
+  u8 *cache;
+  u8 *cache_end;
+  u8 *code_start; // first byte after the stubs
+  u8 *code;       // where the next block goes
+
+  void (*enter)(i8080 *state, const void *code, u64 limit);
+  u8 *exit_stub;
+  u8 *save_stub;
+  u8 *load_stub;
+
+  // Native entry point of the block starting at each address. Generated
+  // code reads it at its absolute address, as the cache belongs to this CPU.
+  void *entries[MAX_MEMORY];
+
+  const memory *mem;
+};
+
+// The cache being emitted into, and where the next byte goes. Thread-local so
+// CPUs on different threads can translate at the same time.
+static _Thread_local struct jit *active;
+static _Thread_local u8 *code;
+
+static void emit8(const u8 byte) { *code++ = byte; }
+
+static void emit16(const u16 val) {
+  memcpy(code, &val, 2);
+  code += 2;
+}
+
+static void emit32(const u32 val) {
+  memcpy(code, &val, 4);
+  code += 4;
+}
+
+static void emit64(const u64 val) {
+  memcpy(code, &val, 8);
+  code += 8;
+}
+
+// One to three opcode bytes, most significant first.
+static void emit_opcode(const u32 opcode) {
+  if (opcode > 0xFFFF)
+    emit8(opcode >> 16);
+  if (opcode > 0xFF)
+    emit8(opcode >> 8);
+  emit8(opcode);
+}
+
+// `byte` forces a REX prefix so that 4-7 name SPL-DIL rather than AH-BH.
+static void emit_rex(const bool w, const u8 reg, u8 index, const u8 base,
+                     const bool byte) {
+  if (index == NONE)
+    index = 0;
+
+  const u8 rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) |
+                 ((base & 8) >> 3);
+  if (rex != 0x40 || (byte && (reg >= 4 || base >= 4)))
+    emit8(rex);
+}
+
+// Memory operand: [base + index << scale + disp]
+struct ea {
+  u8 base;
+  u8 index;
+  u8 scale;
+  int32_t disp;
+};
+
+static struct ea at(const u8 base, const int32_t disp) {
+  return (struct ea){base, NONE, 0, disp};
+}
+
+static struct ea at_index(const u8 base, const u8 index, const int32_t disp) {
+  return (struct ea){base, index, 0, disp};
+}
+
+// An instruction with a register (or opcode extension) and a register operand
+static void op_rr(const u32 opcode, const bool w, const bool byte,
+                  const u8 reg, const u8 rm) {
+  emit_rex(w, reg, NONE, rm, byte);
+  emit_opcode(opcode);
+  emit8(0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// An instruction with a register (or opcode extension) and a memory operand,
+// always with a 32-bit displacement
+static void op_mem(const u32 opcode, const bool w, const bool byte,
+                   const u8 reg, const struct ea ea) {
+  emit_rex(w, reg, ea.index, ea.base, byte);
+  emit_opcode(opcode);
+  if (ea.index == NONE && (ea.base & 7) != RSP) {
+    emit8(0x80 | (reg & 7) << 3 | (ea.base & 7));
+  } else {
+    const u8 index = ea.index == NONE ? RSP : ea.index;
+    emit8(0x84 | (reg & 7) << 3);
+    emit8(ea.scale << 6 | (index & 7) << 3 | (ea.base & 7));
+  }
+  emit32(ea.disp);
+}
+
+static void mov_rr(const u8 dst, const u8 src) {
+  op_rr(0x88, false, true, src, dst);
+}
+
+static void mov_ri(const u8 dst, const u8 imm) {
+  emit_rex(false, 0, NONE, dst, true);
+  emit8(0xB0 | (dst & 7));
+  emit8(imm);
+}
+
+static void alu_rr(const u8 alu, const u8 dst, const u8 src) {
+  op_rr(alu << 3, false, true, src, dst);
+}
+
+static void alu_ri(const u8 alu, const u8 dst, const u8 imm) {
+  op_rr(0x80, false, true, alu, dst);
+  emit8(imm);
+}
+
+static void load(const u8 dst, const struct ea ea) {
+  op_mem(0x8A, false, true, dst, ea);
+}
+
+static void movzx_rr(const u8 dst, const u8 src) {
+  op_rr(0x0FB6, false, true, dst, src);
+}
+
+static void movzx_rm(const u8 dst, const struct ea ea) {
+  op_mem(0x0FB6, false, false, dst, ea);
+}
+
+static void movzx16_rr(const u8 dst, const u8 src) {
+  op_rr(0x0FB7, false, false, dst, src);
+}
+
+static void mov32_rr(const u8 dst, const u8 src) {
+  op_rr(0x89, false, false, src, dst);
+}
+
+static void mov32_ri(const u8 dst, const u32 imm) {
+  emit_rex(false, 0, NONE, dst, false);
+  emit8(0xB8 | (dst & 7));
+  emit32(imm);
+}
+
+static void mov64_ri(const u8 dst, const u64 imm) {
+  emit_rex(true, 0, NONE, dst, false);
+  emit8(0xB8 | (dst & 7));
+  emit64(imm);
+}
+
+static void lea32(const u8 dst, const u8 base, const int32_t disp) {
+  op_mem(0x8D, false, false, dst, at(base, disp));
+}
+
+static void shl32_ri(const u8 dst, const u8 n) {
+  op_rr(0xC1, false, false, 4, dst);
+  emit8(n);
+}
+
+static void shr32_ri(const u8 dst, const u8 n) {
+  op_rr(0xC1, false, false, 5, dst);
+  emit8(n);
+}
+
+// INC, DEC, NOT and the shifts by one: FE /0, FE /1, F6 /2, D0 /n
+static void unary8(const u32 opcode, const u8 ext, const u8 reg) {
+  op_rr(opcode, false, true, ext, reg);
+}
+
+static void add64_mi(const struct ea ea, const u32 imm) {
+  if (imm < 0x80) {
+    op_mem(0x83, true, false, ADD, ea);
+    emit8(imm);
+  } else {
+    op_mem(0x81, true, false, ADD, ea);
+    emit32(imm);
+  }
+}
+
+static void store16_mi(const struct ea ea, const u16 imm) {
+  emit8(0x66);
+  op_mem(0xC7, false, false, 0, ea);
+  emit16(imm);
+}
+
+static void add_sp(const int8_t n) {
+  emit8(0x66);
+  op_rr(0x83, false, false, ADD, HOST_SP);
+  emit8(n);
+}
+
+static void lahf_to_eax(void) {
+  emit8(0x9F); // lahf
+  emit8(0x0F); // movzx eax, ah
+  emit8(0xB6);
+  emit8(0xC4);
+}
+
+static u8 *jcc(const u8 cc) {
+  emit8(0x0F);
+  emit8(0x80 | cc);
+  emit32(0);
+  return code - 4;
+}
+
+static u8 *jmp(void) {
+  emit8(0xE9);
+  emit32(0);
+  return code - 4;
+}
+
+static void patch(u8 *at, const u8 *target) {
+  const int32_t rel = (int32_t)(target - (at + 4));
+  memcpy(at, &rel, 4);
+}
+
+static void call(const u8 *target) {
+  emit8(0xE8);
+  emit32(0);
+  patch(code - 4, target);
+}
+
+static void call_abs(const void *fn) {
+  mov64_ri(RAX, (u64)(uintptr_t)fn);
+  op_rr(0xFF, false, false, 2, RAX);
+}
+
+static void jmp_rax(void) { op_rr(0xFF, false, false, 4, RAX); }
+
+static void test64_rax(void) { op_rr(0x85, true, false, RAX, RAX); }
+
+static void test32_eax(void) { op_rr(0x85, false, false, RAX, RAX); }
+
+// Called from the slow path of a read from a byte that isn't plain memory.
+static u32 jit_load(i8080 *state, const u32 addr) {
+  return mem_read_byte(state->mem, addr);
+}
+
+// Called from the slow path of a store to a watched byte. Writes it through
+// the page map, which runs the memory hook for code, and reports whether
+// that dropped the running block.
+static int jit_store(i8080 *state, const u32 addr, const u32 val,
+                     const u32 start, const struct jit *jit) {
+  mem_write_byte(state->mem, addr, val);
+  return jit->entries[start] == NULL;
+}
+
+// Runs an instruction the JIT leaves to the interpreter. The interpreter
+// leaves flags pending, but compiled code expects them in F. Reports whether
+// the block has to be left: it was dropped, or a device raised an interrupt.
+static int jit_fallback(i8080 *state, const u32 opcode, const u32 start,
+                        const struct jit *jit) {
+  i8080_decode(state, opcode);
+  i8080_flags_sync(state);
+  return jit->entries[start] == NULL || (state->inte && state->inte_pending);
+}
+
+static void emit_stubs(void) {
+  // Where HOST[i] lives in the i8080 struct, with F in the place of M
+  const int32_t offsets[8] = {
+      OFFSET(Register.b), OFFSET(Register.c), OFFSET(Register.d),
+      OFFSET(Register.e), OFFSET(Register.h), OFFSET(Register.l),
+      OFFSET(Register.f), OFFSET(Register.a)};
+
+  // Spill the mapped registers to the i8080 struct and load them back.
+  active->save_stub = code;
+  for (u8 i = 0; i < 8; i++)
+    op_mem(0x88, false, true, i == 6 ? HOST_F : HOST[i],
+           at(HOST_STATE, offsets[i]));
+  emit8(0x66);
+  op_mem(0x89, false, false, HOST_SP, at(HOST_STATE, OFFSET(Register.sp)));
+  emit8(0xC3);
+
+  active->load_stub = code;
+  for (u8 i = 0; i < 8; i++)
+    movzx_rm(i == 6 ? HOST_F : HOST[i], at(HOST_STATE, offsets[i]));
+  op_mem(0x0FB7, false, false, HOST_SP, at(HOST_STATE, OFFSET(Register.sp)));
+  emit8(0xC3);
+
+  // enter(state, code, limit)
+  active->enter = (void (*)(i8080 *, const void *, u64))(void *)code;
+  static const u8 saved[6] = {RBX, RBP, R12, R13, R14, R15};
+  for (u8 i = 0; i < 6; i++) {
+    emit_rex(false, 0, NONE, saved[i], false);
+    emit8(0x50 | (saved[i] & 7)); // push
+  }
+  op_rr(0x83, true, false, 5, RSP); // sub rsp, 24: realigns rsp to 16
+  emit8(24);
+  op_rr(0x89, true, false, RDI, HOST_STATE);
+  op_mem(0x8B, true, false, HOST_MEM, at(HOST_STATE, OFFSET(mem)));
+  op_mem(0x89, true, false, RDX, at(RSP, SLOT_LIMIT));
+  op_mem(0xC7, true, false, 0, at(RSP, SLOT_RETIRED));
+  emit32(0);
+  op_rr(0x89, true, false, RSI, RAX);
+  call(active->load_stub);
+  jmp_rax();
+
+  active->exit_stub = code;
+  call(active->save_stub);
+  op_rr(0x83, true, false, ADD, RSP);
+  emit8(24);
+  for (int i = 5; i >= 0; i--) {
+    emit_rex(false, 0, NONE, saved[i], false);
+    emit8(0x58 | (saved[i] & 7)); // pop
+  }
+  emit8(0xC3);
+}
+
+struct jit *jit_create(const memory *mem) {
+  // LAHF is missing in 64-bit mode on the earliest x86-64 parts
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(ecx & 1))
+    return NULL;
+
+  struct jit *jit = calloc(1, sizeof(*jit));
+  if (jit == NULL) {
+    fprintf(stderr, "Failed to allocate the JIT\n");
+    return NULL;
+  }
+
+  void *map = mmap(NULL, CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map the JIT code cache\n");
+    free(jit);
+    return NULL;
+  }
+
+  jit->cache = map;
+  jit->cache_end = jit->cache + CACHE_SIZE;
+  jit->mem = mem;
+
+  active = jit;
+  code = jit->cache;
+  emit_stubs();
+  jit->code_start = code;
+  jit->code = code;
+
+  return jit;
+}
+
+void jit_destroy(struct jit *jit) {
+  munmap(jit->cache, CACHE_SIZE);
+  free(jit);
+}
+
+void *jit_lookup(const struct jit *jit, const u16 addr) {
+  return jit->entries[addr];
+}
+
+void jit_invalidate(struct jit *jit, const u16 addr) {
+  jit->entries[addr] = NULL;
+}
+
+void jit_flush(struct jit *jit) {
+  memset(jit->entries, 0, sizeof(jit->entries));
+  jit->code = jit->code_start;
+}
+
+u64 jit_run(const struct jit *jit, i8080 *state, void *native,
+            const u64 limit) {
+  const u64 start = state->cycle;
+  i8080_flags_sync(state);
+  jit->enter(state, native, limit);
+  return state->cycle - start;
+}
+
+// Which flags an instruction reads and writes, for dropping dead flag
+// updates.
+static void flag_usage(const u8 op, u8 *reads, u8 *writes) {
+  *reads = 0;
+  *writes = 0;
+
+  if (op >= 0x80 && op < 0xC0) {
+    *writes = ALL_FLAGS;
+    if ((op & 0xF8) == 0x88 || (op & 0xF8) == 0x98) // ADC, SBB
+      *reads = FLAG_CY;
+    return;
+  }
+
+  switch (op & 0xC7) {
+  case 0x04: // INR
+  case 0x05: // DCR
+    *writes = FLAG_S | FLAG_Z | FLAG_P | FLAG_AC;
+    return;
+  case 0xC6: // immediate ALU ops
+    *writes = ALL_FLAGS;
+    if (op == 0xCE || op == 0xDE) // ACI, SBI
+      *reads = FLAG_CY;
+    return;
+  case 0xC0: // Rcc
+  case 0xC2: // Jcc
+  case 0xC4: // Ccc
+    *reads = CONDITION_FLAG[(op >> 3) & 7];
+    return;
+  }
+
+  if ((op & 0xCF) == 0x09) { // DAD
+    *writes = FLAG_CY;
+    return;
+  }
+
+  switch (op) {
+  case 0x07: // RLC
+  case 0x0F: // RRC
+  case 0x37: // STC
+    *writes = FLAG_CY;
+    return;
+  case 0x17: // RAL
+  case 0x1F: // RAR
+  case 0x3F: // CMC
+    *writes = FLAG_CY;
+    *reads = FLAG_CY;
+    return;
+  case 0xF1: // POP PSW
+    *writes = ALL_FLAGS;
+    return;
+  case 0xF5: // PUSH PSW
+    *reads = ALL_FLAGS;
+    return;
+  }
+}
+
+// DAA and XTHL are rare enough to leave to the interpreter, along with the
+// opcodes it doesn't implement. IN and OUT call devices, which want the
+// cycle count up to date.
+static bool is_fallback(const u8 op) {
+  switch (op) {
+  case 0x27:
+  case 0xD3:
+  case 0xDB:
+  case 0xE3:
+  case 0xCB:
+  case 0xD9:
+  case 0xDD:
+  case 0xED:
+  case 0xFD:
+    return true;
+  }
+  return false;
+}
+
+static bool writes_memory(const u8 op) {
+  switch (op) {
+  case 0x02: // STAX B
+  case 0x12: // STAX D
+  case 0x22: // SHLD
+  case 0x32: // STA
+  case 0x34: // INR M
+  case 0x35: // DCR M
+  case 0x36: // MVI M
+  case 0x77: // MOV M,A
+  case 0xCD: // CALL
+    return true;
+  }
+  if (op >= 0x70 && op <= 0x75) // MOV M,r
+    return true;
+  switch (op & 0xC7) {
+  case 0xC4: // Ccc
+  case 0xC7: // RST
+    return true;
+  }
+  return (op & 0xCF) == 0xC5; // PUSH
+}
+
+// A way out of the block, taken from the jump at `from`: the pc to resume
+// at and the cycles not yet added to state->cycle.
+struct exit {
+  u8 *from;
+  u16 pc;
+  u32 cycles;
+};
+
+// The slow path of a read from a watched byte
+struct load {
+  u8 *from;
+  u8 *resume;
+  u8 reg; // holds the address, NONE for `addr`
+  u16 addr;
+  u8 dst;
+  bool zx; // zero-extend into all of dst
+};
+
+// The slow path of a store to a watched byte
+struct store {
+  u8 *from;
+  u8 *resume;
+  bool dynamic; // address in ecx, otherwise `addr`
+  u16 addr;
+  bool imm;
+  u8 val;
+  bool deferred; // one of several stores; the instruction checks at its end
+  struct exit exit;
+};
+
+struct ctx {
+  u16 start;
+  u8 count;
+  u8 index;    // instruction being compiled
+  u16 next;    // address of the instruction after it
+  u16 exit_pc; // where to resume if the block is left after it
+  u32 cycles;  // cycles since state->cycle was last brought up to date
+  bool multi;  // it stores more than one byte
+
+  struct load loads[MAX_LOADS];
+  u8 load_count;
+  struct store stores[MAX_STORES];
+  u8 store_count;
+  struct exit exits[MAX_EXITS];
+  u8 exit_count;
+};
+
+static struct exit exit_here(const struct ctx *ctx) {
+  return (struct exit){NULL, ctx->exit_pc, ctx->cycles};
+}
+
+static void emit_exit(const u32 cycles, const int pc) {
+  if (cycles)
+    add64_mi(at(HOST_STATE, OFFSET(cycle)), cycles);
+  if (pc >= 0)
+    store16_mi(at(HOST_STATE, OFFSET(Register.pc)), pc);
+  patch(jmp(), active->exit_stub);
+}
+
+// Leaves for C after the current instruction, e.g. after HLT and EI.
+static void leave(struct ctx *ctx, const u16 pc) {
+  emit_exit(ctx->cycles, pc);
+}
+
+// Continues at a fixed address: straight into its native code if there is
+// any, otherwise back to the interpreter.
+static void chain(struct ctx *ctx, const u16 target) {
+  if (ctx->cycles)
+    add64_mi(at(HOST_STATE, OFFSET(cycle)), ctx->cycles);
+  emit8(0x48); // mov rax, [moffs64]
+  emit8(0xA1);
+  emit64((u64)(uintptr_t)&active->entries[target]);
+  test64_rax();
+  struct exit *e = &ctx->exits[ctx->exit_count++];
+  *e = (struct exit){jcc(CC_E), target, 0};
+  jmp_rax();
+}
+
+// Continues at the address in ecx.
+static void chain_ecx(struct ctx *ctx) {
+  if (ctx->cycles)
+    add64_mi(at(HOST_STATE, OFFSET(cycle)), ctx->cycles);
+  emit8(0x66);
+  op_mem(0x89, false, false, RCX, at(HOST_STATE, OFFSET(Register.pc)));
+  mov64_ri(RAX, (u64)(uintptr_t)active->entries);
+  op_mem(0x8B, true, false, RAX, (struct ea){RAX, RCX, 3, 0});
+  test64_rax();
+  patch(jcc(CC_E), active->exit_stub);
+  jmp_rax();
+}
+
+// Loads the byte at the address in `reg`, or at `addr` if that is NONE,
+// into `dst`. Bytes that aren't plain RAM or ROM are read through the page
+// map. Remapping drops all code, so that is only checked for when the map
+// has such pages.
+static void read_mem(struct ctx *ctx, const u8 dst, const bool zx,
+                     const u8 reg, const u16 addr) {
+  const struct ea ea =
+      reg == NONE ? at(HOST_MEM, addr) : at_index(HOST_MEM, reg, 0);
+  const struct ea watch = reg == NONE ? at(HOST_MEM, WATCH_DISP + addr)
+                                      : at_index(HOST_MEM, reg, WATCH_DISP);
+
+  if (active->mem->plain_reads) {
+    if (zx)
+      movzx_rm(dst, ea);
+    else
+      load(dst, ea);
+    return;
+  }
+
+  op_mem(0xF6, false, false, 0, watch); // test byte [watch], WATCH_READ
+  emit8(WATCH_READ);
+
+  struct load *l = &ctx->loads[ctx->load_count++];
+  l->from = jcc(CC_NE);
+  if (zx)
+    movzx_rm(dst, ea);
+  else
+    load(dst, ea);
+  l->resume = code;
+  l->reg = reg;
+  l->addr = addr;
+  l->dst = dst;
+  l->zx = zx;
+}
+
+// Stores the byte register `val` (or the immediate if `imm`) to the address
+// in ecx or to `addr`. Writes to watched bytes go through the page map and
+// the memory hook, and leave the block if that replaced it.
+static void store(struct ctx *ctx, const bool dynamic, const u16 addr,
+                  const bool imm, const u8 val) {
+  const struct ea ea =
+      dynamic ? at_index(HOST_MEM, RCX, 0) : at(HOST_MEM, addr);
+  const struct ea watch = dynamic ? at_index(HOST_MEM, RCX, WATCH_DISP)
+                                  : at(HOST_MEM, WATCH_DISP + addr);
+
+  op_mem(0xF6, false, false, 0, watch); // test byte [watch], ...
+  emit8(WATCH_CODE | WATCH_WRITE);
+
+  struct store *s = &ctx->stores[ctx->store_count++];
+  s->from = jcc(CC_NE);
+  if (imm) {
+    op_mem(0xC6, false, false, 0, ea);
+    emit8(val);
+  } else {
+    op_mem(0x88, false, true, val, ea);
+  }
+  s->resume = code;
+  s->dynamic = dynamic;
+  s->addr = addr;
+  s->imm = imm;
+  s->val = val;
+  s->deferred = ctx->multi;
+  s->exit = exit_here(ctx);
+}
+
+// After the stores of an instruction that makes several: leave if one of
+// them replaced the block.
+static void check_retired(struct ctx *ctx) {
+  op_mem(0x80, false, false, CMP, at(RSP, SLOT_RETIRED));
+  emit8(0);
+  struct exit *e = &ctx->exits[ctx->exit_count++];
+  *e = exit_here(ctx);
+  e->from = jcc(CC_NE);
+}
+
+static void emit_slow_paths(struct ctx *ctx) {
+  static const u8 live[2] = {RCX, RDX}; // scratch that may outlive a read
+
+  for (u8 i = 0; i < ctx->load_count; i++) {
+    const struct load *l = &ctx->loads[i];
+    patch(l->from, code);
+    for (u8 j = 0; j < 2; j++)
+      emit8(0x50 | live[j]); // push
+    call(active->save_stub);
+    if (l->reg == NONE)
+      mov32_ri(RSI, l->addr);
+    else
+      mov32_rr(RSI, l->reg);
+    op_rr(0x89, true, false, HOST_STATE, RDI);
+    call_abs((const void *)jit_load);
+    call(active->load_stub);
+    for (int j = 1; j >= 0; j--)
+      emit8(0x58 | live[j]); // pop
+    if (l->zx)
+      movzx_rr(l->dst, RAX);
+    else
+      mov_rr(l->dst, RAX);
+    patch(jmp(), l->resume);
+  }
+
+  for (u8 i = 0; i < ctx->store_count; i++) {
+    const struct store *s = &ctx->stores[i];
+    patch(s->from, code);
+    call(active->save_stub);
+    if (s->dynamic)
+      mov32_rr(RSI, RCX);
+    else
+      mov32_ri(RSI, s->addr);
+    if (s->imm)
+      mov32_ri(RDX, s->val);
+    else
+      movzx_rr(RDX, s->val);
+    op_rr(0x89, true, false, HOST_STATE, RDI);
+    mov32_ri(RCX, ctx->start);
+    mov64_ri(R8, (u64)(uintptr_t)active);
+    call_abs((const void *)jit_store);
+    call(active->load_stub);
+    if (s->deferred) {
+      op_mem(0x08, false, true, RAX, at(RSP, SLOT_RETIRED));
+      patch(jmp(), s->resume);
+    } else {
+      test32_eax();
+      patch(jcc(CC_E), s->resume);
+      emit_exit(s->exit.cycles, s->exit.pc);
+    }
+  }
+
+  for (u8 i = 0; i < ctx->exit_count; i++) {
+    const struct exit *e = &ctx->exits[i];
+    patch(e->from, code);
+    emit_exit(e->cycles, e->pc);
+  }
+}
+
+// Loads a register pair into the low 16 bits of `dst`: 0 BC, 1 DE, 2 HL, 3 SP
+static void pair_to(const u8 dst, const u8 rp) {
+  if (rp == 3) {
+    mov32_rr(dst, HOST_SP);
+    return;
+  }
+  movzx_rr(dst, HOST[rp * 2]);
+  shl32_ri(dst, 8);
+  mov_rr(dst, HOST[rp * 2 + 1]);
+}
+
+// `dst` = (SP + off) & 0xFFFF
+static void sp_plus(const u8 dst, const int8_t off) {
+  lea32(dst, HOST_SP, off);
+  movzx16_rr(dst, dst);
+}
+
+static void flags_arith(const bool sub) {
+  lahf_to_eax();
+  if (sub) // x86 sets AF on a borrow, the 8080 on no borrow
+    alu_ri(XOR, RAX, FLAG_AC);
+  mov_rr(HOST_F, RAX);
+}
+
+// INR and DCR keep CY
+static void flags_incdec(const bool dec) {
+  lahf_to_eax();
+  alu_ri(AND, RAX, (u8)~FLAG_CY);
+  if (dec)
+    alu_ri(XOR, RAX, FLAG_AC);
+  alu_ri(AND, HOST_F, FLAG_CY);
+  alu_rr(OR, HOST_F, RAX);
+}
+
+// CY from a SETC into `reg`
+static void flags_carry(const u8 reg) {
+  alu_ri(AND, HOST_F, (u8)~FLAG_CY);
+  alu_rr(OR, HOST_F, reg);
+}
+
+// A = A <alu> src, where src is a byte register or, with `imm`, a constant.
+static void alu(const u8 op, const bool imm, const u8 src, const bool flags) {
+  if (op == 7 && !flags) // CMP only sets flags
+    return;
+
+  if (op == 4 && flags) { // ANA: AC is bit 3 of the operands ORed
+    mov_rr(RDI, HOST_A);
+    if (imm)
+      alu_ri(OR, RDI, src);
+    else
+      alu_rr(OR, RDI, src);
+    alu_ri(AND, RDI, 0x08);
+    unary8(0xD0, 4, RDI); // shl dil, 1
+  }
+
+  if (op == 1 || op == 3) { // ADC, SBB: CY into the host carry
+    op_rr(0x0FBA, false, false, 4, HOST_F); // bt r13d, 0
+    emit8(0);
+  }
+
+  if (imm)
+    alu_ri(ALU_X86[op], HOST_A, src);
+  else
+    alu_rr(ALU_X86[op], HOST_A, src);
+
+  if (!flags)
+    return;
+
+  switch (op) {
+  case 0: // ADD
+  case 1: // ADC
+    flags_arith(false);
+    break;
+  case 2: // SUB
+  case 3: // SBB
+  case 7: // CMP
+    flags_arith(true);
+    break;
+  case 4: // ANA
+    lahf_to_eax();
+    alu_ri(AND, RAX, (u8)~FLAG_AC);
+    alu_rr(OR, RAX, RDI);
+    mov_rr(HOST_F, RAX);
+    break;
+  default: // XRA, ORA: AC and CY clear
+    lahf_to_eax();
+    alu_ri(AND, RAX, (u8)~FLAG_AC);
+    mov_rr(HOST_F, RAX);
+    break;
+  }
+}
+
+// Pushes `hi` and `lo`, registers or, with `imm`, constants.
+static void push(struct ctx *ctx, const bool imm, const u8 hi, const u8 lo) {
+  ctx->multi = true;
+  sp_plus(RCX, -1);
+  store(ctx, true, 0, imm, hi);
+  sp_plus(RCX, -2);
+  store(ctx, true, 0, imm, lo);
+  add_sp(-2);
+  check_retired(ctx);
+}
+
+// Pops into ecx.
+static void pop_ecx(struct ctx *ctx) {
+  read_mem(ctx, RCX, true, HOST_SP, 0);
+  sp_plus(RAX, 1);
+  read_mem(ctx, RAX, true, RAX, 0);
+  shl32_ri(RAX, 8);
+  op_rr(0x09, false, false, RAX, RCX); // or ecx, eax
+  add_sp(2);
+}
+
+// Tests the condition of a Jcc, Ccc or Rcc and returns the jump to patch
+// for when it does not hold.
+static u8 *condition_false(const u8 op) {
+  const u8 cond = (op >> 3) & 7;
+  op_rr(0xF6, false, true, 0, HOST_F); // test r13b, flag
+  emit8(CONDITION_FLAG[cond]);
+  // NZ NC PO P hold when the flag is clear
+  return jcc(cond & 1 ? CC_E : CC_NE);
+}
+
+static void fallback(struct ctx *ctx, const u16 addr, const u8 op,
+                     const bool last) {
+  if (ctx->cycles)
+    add64_mi(at(HOST_STATE, OFFSET(cycle)), ctx->cycles);
+  ctx->cycles = 0;
+
+  call(active->save_stub);
+  store16_mi(at(HOST_STATE, OFFSET(Register.pc)), addr + 1);
+  op_rr(0x89, true, false, HOST_STATE, RDI);
+  mov32_ri(RSI, op);
+  mov32_ri(RDX, ctx->start);
+  mov64_ri(RCX, (u64)(uintptr_t)active);
+  call_abs((const void *)jit_fallback);
+  call(active->load_stub);
+
+  // the interpreter has moved pc on
+  if (last) {
+    emit_exit(0, -1);
+  } else {
+    test32_eax();
+    u8 *kept = jcc(CC_E);
+    emit_exit(0, -1);
+    patch(kept, code);
+  }
+}
+
+// Compiles one instruction. Returns true if it left the block itself.
+static bool compile_insn(struct ctx *ctx, const u16 addr,
+                         const struct insn *in, const bool flags,
+                         const bool last) {
+  const u8 op = in->opcode;
+  const u8 d8 = (u8)in->operand;
+  const u16 d16 = in->operand;
+  const u8 dst = HOST[(op >> 3) & 7];
+  const u8 src = HOST[op & 7];
+  const u8 rp = (op >> 4) & 3;
+
+  if (is_fallback(op)) {
+    fallback(ctx, addr, op, last);
+    return last;
+  }
+
+  ctx->cycles += in->cycles;
+
+  // MOV
+  if (op >= 0x40 && op < 0x80 && op != 0x76) {
+    if ((op & 7) == 6) {
+      pair_to(RCX, 2);
+      read_mem(ctx, dst, false, RCX, 0);
+    } else if (((op >> 3) & 7) == 6) {
+      pair_to(RCX, 2);
+      store(ctx, true, 0, false, src);
+    } else if (dst != src) {
+      mov_rr(dst, src);
+    }
+    return false;
+  }
+
+  // ADD ADC SUB SBB ANA XRA ORA CMP
+  if (op >= 0x80 && op < 0xC0) {
+    u8 reg = src;
+    if ((op & 7) == 6) {
+      pair_to(RCX, 2);
+      read_mem(ctx, RDX, false, RCX, 0);
+      reg = RDX;
+    }
+    alu((op >> 3) & 7, false, reg, flags);
+    return false;
+  }
+
+  switch (op & 0xC7) {
+  case 0x04: // INR
+  case 0x05: // DCR
+    if (dst == NONE) {
+      pair_to(RCX, 2);
+      read_mem(ctx, RDX, false, RCX, 0);
+      unary8(0xFE, op & 1, RDX);
+      if (flags)
+        flags_incdec(op & 1);
+      store(ctx, true, 0, false, RDX);
+    } else {
+      unary8(0xFE, op & 1, dst);
+      if (flags)
+        flags_incdec(op & 1);
+    }
+    return false;
+  case 0x06: // MVI
+    if (dst == NONE) {
+      pair_to(RCX, 2);
+      store(ctx, true, 0, true, d8);
+    } else {
+      mov_ri(dst, d8);
+    }
+    return false;
+  case 0xC6: // ADI ACI SUI SBI ANI XRI ORI CPI
+    alu((op >> 3) & 7, true, d8, flags);
+    return false;
+  case 0xC0: { // Rcc
+    u8 *skip = condition_false(op);
+    ctx->cycles += TAKEN_CYCLES;
+    pop_ecx(ctx);
+    chain_ecx(ctx);
+    ctx->cycles -= TAKEN_CYCLES;
+    patch(skip, code);
+    chain(ctx, ctx->next);
+    return true;
+  }
+  case 0xC2: { // Jcc
+    u8 *skip = condition_false(op);
+    chain(ctx, d16);
+    patch(skip, code);
+    chain(ctx, ctx->next);
+    return true;
+  }
+  case 0xC4: { // Ccc
+    u8 *skip = condition_false(op);
+    ctx->cycles += TAKEN_CYCLES;
+    ctx->exit_pc = d16;
+    push(ctx, true, ctx->next >> 8, ctx->next & 0xFF);
+    chain(ctx, d16);
+    ctx->cycles -= TAKEN_CYCLES;
+    patch(skip, code);
+    chain(ctx, ctx->next);
+    return true;
+  }
+  case 0xC7: // RST
+    ctx->exit_pc = op & 0x38;
+    push(ctx, true, ctx->next >> 8, ctx->next & 0xFF);
+    chain(ctx, op & 0x38);
+    return true;
+  }
+
+  switch (op & 0xCF) {
+  case 0x01: // LXI
+    if (rp == 3) {
+      mov32_ri(HOST_SP, d16);
+    } else {
+      mov_ri(HOST[rp * 2], d16 >> 8);
+      mov_ri(HOST[rp * 2 + 1], d16 & 0xFF);
+    }
+    return false;
+  case 0x03: // INX
+  case 0x0B: // DCX
+    if (rp == 3) {
+      emit8(0x66);
+      op_rr(0xFF, false, false, (op >> 3) & 1, HOST_SP);
+    } else {
+      alu_ri(op & 8 ? SUB : ADD, HOST[rp * 2 + 1], 1);
+      alu_ri(op & 8 ? SBB : ADC, HOST[rp * 2], 0);
+    }
+    return false;
+  case 0x09: // DAD
+    pair_to(RAX, 2);
+    pair_to(RCX, rp);
+    emit8(0x66);
+    op_rr(0x01, false, false, RCX, RAX); // add ax, cx
+    if (flags)
+      op_rr(0x0F92, false, true, 0, RCX); // setc cl
+    mov_rr(HOST[5], RAX);
+    shr32_ri(RAX, 8);
+    mov_rr(HOST[4], RAX);
+    if (flags)
+      flags_carry(RCX);
+    return false;
+  case 0xC1: // POP
+    if (rp == 3) {
+      read_mem(ctx, RAX, false, HOST_SP, 0);
+      alu_ri(AND, RAX, (u8)~(FLAG_B3 | FLAG_B5));
+      alu_ri(OR, RAX, FLAG_B1);
+      mov_rr(HOST_F, RAX);
+      sp_plus(RCX, 1);
+      read_mem(ctx, HOST_A, false, RCX, 0);
+    } else {
+      read_mem(ctx, HOST[rp * 2 + 1], false, HOST_SP, 0);
+      sp_plus(RCX, 1);
+      read_mem(ctx, HOST[rp * 2], false, RCX, 0);
+    }
+    add_sp(2);
+    return false;
+  case 0xC5: // PUSH
+    if (rp == 3)
+      push(ctx, false, HOST_A, HOST_F);
+    else
+      push(ctx, false, HOST[rp * 2], HOST[rp * 2 + 1]);
+    return false;
+  }
+
+  switch (op) {
+  case 0x02: // STAX B
+  case 0x12: // STAX D
+    pair_to(RCX, rp);
+    store(ctx, true, 0, false, HOST_A);
+    return false;
+  case 0x0A: // LDAX B
+  case 0x1A: // LDAX D
+    pair_to(RCX, rp);
+    read_mem(ctx, HOST_A, false, RCX, 0);
+    return false;
+  case 0x07: // RLC
+  case 0x0F: // RRC
+  case 0x17: // RAL
+  case 0x1F: // RAR
+    if (op >= 0x17) {
+      op_rr(0x0FBA, false, false, 4, HOST_F); // bt r13d, 0
+      emit8(0);
+    }
+    unary8(0xD0, (op >> 3) & 3, HOST_A); // rol, ror, rcl, rcr by 1
+    if (flags) {
+      op_rr(0x0F92, false, true, 0, RAX); // setc al
+      flags_carry(RAX);
+    }
+    return false;
+  case 0x22: // SHLD
+    ctx->multi = true;
+    store(ctx, false, d16, false, HOST[5]);
+    store(ctx, false, (u16)(d16 + 1), false, HOST[4]);
+    check_retired(ctx);
+    return false;
+  case 0x2A: // LHLD
+    read_mem(ctx, HOST[5], false, NONE, d16);
+    read_mem(ctx, HOST[4], false, NONE, (u16)(d16 + 1));
+    return false;
+  case 0x2F: // CMA
+    unary8(0xF6, 2, HOST_A);
+    return false;
+  case 0x32: // STA
+    store(ctx, false, d16, false, HOST_A);
+    return false;
+  case 0x3A: // LDA
+    read_mem(ctx, HOST_A, false, NONE, d16);
+    return false;
+  case 0x37: // STC
+    alu_ri(OR, HOST_F, FLAG_CY);
+    return false;
+  case 0x3F: // CMC
+    alu_ri(XOR, HOST_F, FLAG_CY);
+    return false;
+  case 0x76: // HLT
+    op_mem(0xC7, false, false, 0, at(HOST_STATE, OFFSET(status)));
+    emit32(HALTED);
+    leave(ctx, ctx->next);
+    return true;
+  case 0xC3: // JMP
+    chain(ctx, d16);
+    return true;
+  case 0xC9: // RET
+    pop_ecx(ctx);
+    chain_ecx(ctx);
+    return true;
+  case 0xCD: // CALL
+    ctx->exit_pc = d16;
+    push(ctx, true, ctx->next >> 8, ctx->next & 0xFF);
+    chain(ctx, d16);
+    return true;
+  case 0xE9: // PCHL
+    pair_to(RCX, 2);
+    chain_ecx(ctx);
+    return true;
+  case 0xEB: // XCHG
+    op_rr(0x86, false, true, HOST[2], HOST[4]);
+    op_rr(0x86, false, true, HOST[3], HOST[5]);
+    return false;
+  case 0xF3: // DI
+  case 0xFB: // EI
+    op_mem(0xC6, false, false, 0, at(HOST_STATE, OFFSET(inte)));
+    emit8(op == 0xFB);
+    if (op == 0xFB) { // an interrupt may be waiting
+      leave(ctx, ctx->next);
+      return true;
+    }
+    return false;
+  case 0xF9: // SPHL
+    pair_to(HOST_SP, 2);
+    return false;
+  }
+
+  // NOP and its undocumented aliases
+  return false;
+}
+
+void *jit_compile(struct jit *jit, const u16 start, const struct insn *insn,
+                  const u8 count) {
+  if (jit->cache_end - jit->code < count * MAX_INSN_CODE + 256)
+    jit_flush(jit);
+
+  active = jit;
+  code = jit->code;
+
+  // A flag update is needed if something reads it before it is written
+  // again. Everything is read once the block is left, which can happen after
+  // any store (it may hit the block's own code) or fallback.
+  bool flags[256];
+  u8 live = ALL_FLAGS;
+  for (int i = count - 1; i >= 0; i--) {
+    const u8 op = insn[i].opcode;
+    u8 reads, writes;
+    if (writes_memory(op) || is_fallback(op))
+      live = ALL_FLAGS;
+    flag_usage(op, &reads, &writes);
+    if (is_fallback(op))
+      reads = ALL_FLAGS;
+    flags[i] = (writes & live) != 0;
+    live = (live & ~writes) | reads;
+  }
+
+  static _Thread_local struct ctx ctx;
+  ctx.start = start;
+  ctx.count = count;
+  ctx.cycles = 0;
+  ctx.load_count = 0;
+  ctx.store_count = 0;
+
+  u8 *native = code;
+
+  // The interpreters stop after the first instruction that reaches the
+  // limit. Only run the block if that can't be before its last one, which is
+  // also the only one that can take extra cycles.
+  u32 lead = 0;
+  for (u8 i = 0; i + 1 < count; i++)
+    lead += insn[i].cycles;
+  op_mem(0x8B, true, false, RAX, at(HOST_STATE, OFFSET(cycle)));
+  if (lead) {
+    op_rr(0x81, true, false, ADD, RAX);
+    emit32(lead);
+  }
+  op_mem(0x3B, true, false, RAX, at(RSP, SLOT_LIMIT));
+  ctx.exits[0] = (struct exit){jcc(CC_AE), start, 0};
+  ctx.exit_count = 1;
+
+  u16 addr = start;
+  bool left = false;
+  for (u8 i = 0; i < count; i++) {
+    ctx.index = i;
+    ctx.next = addr + insn[i].length;
+    ctx.exit_pc = ctx.next;
+    ctx.multi = false;
+    left = compile_insn(&ctx, addr, &insn[i], flags[i], i == count - 1);
+    addr = ctx.next;
+  }
+  if (!left)
+    chain(&ctx, addr);
+
+  emit_slow_paths(&ctx);
+
+  jit->code = code;
+  jit->entries[start] = native;
+  return native;
+}
+
+#else
+
+struct jit *jit_create(const memory *mem) {
+  (void)mem;
+  return NULL;
+}
+
+void jit_destroy(struct jit *jit) { (void)jit; }
+
+void *jit_lookup(const struct jit *jit, const u16 addr) {
+  (void)jit;
+  (void)addr;
+  return NULL;
+}
+
+void *jit_compile(struct jit *jit, const u16 start, const struct insn *insn,
+                  const u8 count) {
+  (void)jit;
+  (void)start;
+  (void)insn;
+  (void)count;
+  return NULL;
+}
+
+void jit_invalidate(struct jit *jit, const u16 addr) {
+  (void)jit;
+  (void)addr;
+}
+
+void jit_flush(struct jit *jit) { (void)jit; }
+
+u64 jit_run(const struct jit *jit, i8080 *state, void *code,
+            const u64 limit) {
+  (void)jit;
+  (void)state;
+  (void)code;
+  (void)limit;
+  return 0;
+}
+
+#endif
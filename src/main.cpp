@@ -1,5 +1,9 @@
+#include "constants.h"
 #include "cpu.h"
+#include "invaders.h"
 #include "memory.h"
+#include "movie.h"
+#include "rewind.h"
 
 #include "imgui.h"
 #include "imgui_impl_opengl3.h"
@@ -11,15 +15,20 @@
 #else
 #include <SDL3/SDL_opengl.h>
 #endif
+#include <algorithm>
 #include <string>
 
-#define GAME_WIDTH 224
-#define GAME_HEIGHT 256
+#define ROM_FILE "roms/invaders"
+#define STATE_FILE "invaders.sav"
+#define MOVIE_FILE "invaders.mov"
 
-#define CLOCK_SPEED 1996800
-#define CYCLES_PER_FRAME = CLOCK_SPEED * 60; // ~33,333 cycles
+// Rewinding keeps a keyframe a second and as much history as fits in the
+// budget, which the Emulator window can change
+#define REWIND_INTERVAL 60
+#define REWIND_BUDGET_MIB 64
 
-#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+// Run-ahead shows the picture from this many frames further on, at most
+#define RUN_AHEAD_MAX 4
 
 int main(int argc, char *argv[]) {
 
@@ -111,13 +120,29 @@ int main(int argc, char *argv[]) {
 
   ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 
-  struct i8080 state = i8080_init();
-
-  state.inte_handle = 0xC7;
-
-  mem_load_file("roms/invaders", 0);
-
-  uint8_t video[GAME_HEIGHT][GAME_WIDTH][3] = {0};
+  // the block engines skip through the game's wait-for-interrupt loops
+  static struct invaders machine;
+  invaders_init(&machine, ROM_FILE, ENGINE_JIT);
+  struct i8080 &state = machine.cpu;
+
+  // one state per host frame while running, popped again while rewinding
+  int rewind_mib = REWIND_BUDGET_MIB;
+  struct rewind *history = rewind_create(INVADERS_STATE_SIZE, REWIND_INTERVAL,
+                                         (size_t)rewind_mib << 20);
+  static u8 snapshot[INVADERS_STATE_SIZE];
+  bool rewinding = false;
+
+  // Each host frame, run this many frames past where the machine is with
+  // the current input, show that picture, and load the state back. It hides
+  // as many frames of the game's and the display's latency.
+  int run_ahead = 0;
+  double run_ahead_ms = 0.0;   // average time spent on it a frame
+  double run_ahead_io_us = 0.0; // of which saving and loading the state
+
+  // A movie being recorded or replayed. Rewinding, run-ahead, resetting and
+  // loading states are off meanwhile, as they would take the machine away
+  // from it.
+  struct movie *movie = NULL;
 
   GLuint my_texture;
   glGenTextures(1, &my_texture);
@@ -127,7 +152,7 @@ int main(int argc, char *argv[]) {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, GAME_WIDTH, GAME_HEIGHT, 0, GL_RGB,
-               GL_UNSIGNED_BYTE, video);
+               GL_UNSIGNED_BYTE, machine.screen);
   glBindTexture(GL_TEXTURE_2D, 0);
 
   bool done = false;
@@ -164,64 +189,59 @@ int main(int argc, char *argv[]) {
       continue;
     }
 
-    glBindTexture(GL_TEXTURE_2D, my_texture);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GAME_WIDTH, GAME_HEIGHT, GL_RGB,
-                    GL_UNSIGNED_BYTE, video);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    if (debug_run) {
+    const bool *keys = SDL_GetKeyboardState(NULL);
+    machine.io.inputs[1] = 0x08 | (keys[SDL_SCANCODE_C] ? INPUT_COIN : 0) |
+                   (keys[SDL_SCANCODE_2] ? INPUT_P2_START : 0) |
+                   (keys[SDL_SCANCODE_1] ? INPUT_P1_START : 0) |
+                   (keys[SDL_SCANCODE_SPACE] ? INPUT_P1_FIRE : 0) |
+                   (keys[SDL_SCANCODE_LEFT] ? INPUT_P1_LEFT : 0) |
+                   (keys[SDL_SCANCODE_RIGHT] ? INPUT_P1_RIGHT : 0);
+
+    if (movie == NULL && (rewinding || keys[SDL_SCANCODE_BACKSPACE])) {
+      if (history != NULL && rewind_pop(history, snapshot) == 0) {
+        invaders_load(&machine, snapshot, sizeof(snapshot));
+        invaders_draw(&machine);
+      }
+    } else if (debug_run) {
       cycle_accumulator = dt * emulation_speed * 1000;
 
-      int count = 0;
-      while (count < cycle_accumulator * CLOCK_SPEED / 1000) {
-        size_t cyc = state.cycle;
-        i8080_execute(&state);
-        size_t elapsed = state.cycle - cyc;
-        count += elapsed;
-
-        if (state.cycle >= (CLOCK_SPEED / 60) / 2) {
-          state.cycle -= (CLOCK_SPEED / 60) / 2;
-
-          i8080_interrupt(&state, state.inte_handle);
-
-          if (state.inte_handle == 0xD7) {
-
-            // delete later and try to come up with your own implementation
-            for (int i = 0; i < 256 * 224 / 8; i++) {
-              const int y = i * 8 / 256;
-              const int base_x = (i * 8) % 256;
-              const uint8_t cur_byte = mem[0x2400 + i];
-
-              for (uint8_t bit = 0; bit < 8; bit++) {
-                int px = base_x + bit;
-                int py = y;
-                const bool is_pixel_lit = (cur_byte >> bit) & 1;
-                uint8_t r = 0, g = 0, b = 0;
-
-                if (is_pixel_lit) {
-                  r = 255;
-                  g = 255;
-                  b = 255;
-                }
-
-                const int temp_x = px;
-                px = py;
-                py = -temp_x + GAME_HEIGHT - 1;
-
-                video[py][px][0] = r;
-                video[py][px][1] = g;
-                video[py][px][2] = b;
-              }
-            }
-          }
-          state.inte_handle = (state.inte_handle == 0xCF) ? 0xD7 : 0xCF;
+      invaders_run(&machine, cycle_accumulator * INVADERS_CLOCK / 1000);
+      if (history != NULL || run_ahead > 0) {
+        const u64 start = SDL_GetPerformanceCounter();
+        invaders_save(&machine, snapshot);
+        if (history != NULL)
+          rewind_push(history, snapshot);
+        const u64 saved = SDL_GetPerformanceCounter();
+
+        // loading leaves the screen as the last frame ahead drew it
+        if (run_ahead > 0 && movie == NULL) {
+          invaders_run(&machine, (u64)run_ahead * INVADERS_FRAME_CYCLES);
+          const u64 ran = SDL_GetPerformanceCounter();
+          invaders_load(&machine, snapshot, sizeof(snapshot));
+          const u64 end = SDL_GetPerformanceCounter();
+
+          const double freq = (double)SDL_GetPerformanceFrequency();
+          const double ms = (end - start) * 1000.0 / freq;
+          const double io_us = ((saved - start) + (end - ran)) * 1e6 / freq;
+          run_ahead_ms += (ms - run_ahead_ms) * 0.05;
+          run_ahead_io_us += (io_us - run_ahead_io_us) * 0.05;
         }
       }
     } else if (debug_step) {
-      i8080_execute(&state);
+      invaders_step(&machine);
       debug_step = false;
     }
 
+    if (movie != NULL && movie->replaying && movie_done(movie)) {
+      movie_destroy(movie);
+      movie = NULL;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, my_texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GAME_WIDTH, GAME_HEIGHT, GL_RGB,
+                    GL_UNSIGNED_BYTE, machine.screen);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
     if (ImGui::BeginMainMenuBar()) {
       if (ImGui::BeginMenu("File")) {
         ImGui::EndMenu();
@@ -238,13 +258,8 @@ int main(int argc, char *argv[]) {
     }
 
     if (ImGui::Begin("Cpu", 0, ImGuiWindowFlags_NoCollapse)) {
-      uint8_t f = 0;
-      f |= state.Flag.s << 7;
-      f |= state.Flag.z << 6;
-      f |= state.Flag.ac << 4;
-      f |= state.Flag.p << 2;
-      f |= 1 << 1;
-      f |= state.Flag.cy << 0;
+      i8080_flags_sync(&state);
+      const uint8_t f = state.Register.f;
 
       ImGui::Text("PC: $%04X", state.Register.pc);
       ImGui::Text("SP: $%04X", state.Register.sp);
@@ -253,23 +268,23 @@ int main(int argc, char *argv[]) {
 
       ImGui::Text("Flags");
 
-      bool flag_s = state.Flag.s;
+      bool flag_s = f & FLAG_S;
       ImGui::Checkbox("S", &flag_s);
       ImGui::SameLine();
 
-      bool flag_z = state.Flag.z;
+      bool flag_z = f & FLAG_Z;
       ImGui::Checkbox("Z", &flag_z);
       ImGui::SameLine();
 
-      bool flag_a = state.Flag.ac == 1;
+      bool flag_a = f & FLAG_AC;
       ImGui::Checkbox("A", &flag_a);
       ImGui::SameLine();
 
-      bool flag_p = state.Flag.p;
+      bool flag_p = f & FLAG_P;
       ImGui::Checkbox("P", &flag_p);
       ImGui::SameLine();
 
-      bool flag_c = state.Flag.cy;
+      bool flag_c = f & FLAG_CY;
       ImGui::Checkbox("C", &flag_c);
 
       ImGui::Separator();
@@ -293,8 +308,9 @@ int main(int argc, char *argv[]) {
 
       ImGui::BeginChild("##simulation",
                         ImVec2(0.0, ImGui::GetFrameHeightWithSpacing()));
-      if (ImGui::Button("Reset")) {
-        state = i8080_init();
+      if (ImGui::Button("Reset") && movie == NULL) {
+        invaders_free(&machine);
+        invaders_init(&machine, ROM_FILE, ENGINE_JIT);
         debug_run = false;
       }
 
@@ -332,7 +348,7 @@ int main(int argc, char *argv[]) {
                                 ImGui::GetWindowWidth());
 
         ImGuiListClipper clipper;
-        clipper.Begin(ARRAY_SIZE(mem), ImGui::GetTextLineHeight());
+        clipper.Begin(MAX_MEMORY, ImGui::GetTextLineHeight());
         while (clipper.Step()) {
           for (int row = clipper.DisplayStart; row < clipper.DisplayEnd;
                row++) {
@@ -348,7 +364,7 @@ int main(int argc, char *argv[]) {
             ImGui::Text("%04X", row);
             ImGui::SameLine();
             ImGui::PopStyleColor();
-            ImGui::Text("%s", instruction_table[mem[row]]);
+            ImGui::Text("%s", instruction_table[mem_peek_byte(state.mem, row)]);
 
             if (state.Register.pc == row) {
               ImU32 cell_bg_color =
@@ -369,8 +385,117 @@ int main(int argc, char *argv[]) {
       ImGui::Text("Speed: ");
       ImGui::SameLine();
       ImGui::SliderFloat("##", &emulation_speed, 0.1, 1.0);
-      ImGui::Text("Clock speed:  %d", CLOCK_SPEED);
-      ImGui::Text("total cycles: %ld", state.cycle);
+      ImGui::Text("Clock speed:  %d", INVADERS_CLOCK);
+      ImGui::Text("total cycles: %llu", (unsigned long long)state.cycle);
+      if (ImGui::Button("Save state"))
+        invaders_save_file(&machine, STATE_FILE);
+      ImGui::SameLine();
+      if (ImGui::Button("Load state") && movie == NULL)
+        invaders_load_file(&machine, STATE_FILE);
+
+      if (movie == NULL) {
+        if (ImGui::Button("Record movie"))
+          movie = invaders_record(&machine);
+        ImGui::SameLine();
+        if (ImGui::Button("Replay movie")) {
+          movie = movie_read_file(MOVIE_FILE);
+          if (movie != NULL && invaders_replay(&machine, movie) != 0) {
+            movie_destroy(movie);
+            movie = NULL;
+          }
+        }
+      } else if (!movie->replaying) {
+        if (ImGui::Button("Stop recording")) {
+          movie_stop(movie);
+          movie_write_file(movie, MOVIE_FILE);
+          movie_destroy(movie);
+          movie = NULL;
+        } else {
+          ImGui::SameLine();
+          ImGui::Text("%llu input changes",
+                      (unsigned long long)movie->count);
+        }
+      } else {
+        if (ImGui::Button("Stop replay")) {
+          movie_destroy(movie);
+          movie = NULL;
+        } else {
+          ImGui::SameLine();
+          ImGui::Text("%llu of %llu cycles%s",
+                      (unsigned long long)state.cycle,
+                      (unsigned long long)movie->end_cycle,
+                      movie->desynced ? ", out of sync" : "");
+        }
+      }
+
+      if (history != NULL) {
+        ImGui::Button("Rewind");
+        rewinding = ImGui::IsItemActive();
+        ImGui::SameLine();
+        ImGui::Text("hold, or Backspace: %zu frames in %.1f MiB",
+                    history->count, history->bytes / 1048576.0);
+        if (ImGui::SliderInt("Rewind MiB", &rewind_mib, 8, 1024))
+          rewind_set_budget(history, (size_t)rewind_mib << 20);
+      }
+
+      ImGui::SliderInt("Run-ahead frames", &run_ahead, 0, RUN_AHEAD_MAX);
+      if (run_ahead > 0)
+        ImGui::Text("run-ahead: %.2f ms a frame, %.0f us saving and loading",
+                    run_ahead_ms, run_ahead_io_us);
+#if STATS
+      if (ImGui::CollapsingHeader("Statistics")) {
+        const struct i8080_stats &stats = state.stats;
+        u64 instructions = 0, cycles = stats.halted_cycles;
+        u64 branches = 0, taken = 0;
+        int order[256];
+        for (int op = 0; op < 256; op++) {
+          order[op] = op;
+          instructions += stats.executed[op];
+          cycles += stats_cycles(&stats, op);
+          if ((op & 0xC7) == 0xC0 || (op & 0xC7) == 0xC2 ||
+              (op & 0xC7) == 0xC4) {
+            branches += stats.executed[op];
+            taken += stats.taken[op];
+          }
+        }
+        std::sort(order, order + 256, [&stats](int a, int b) {
+          return stats_cycles(&stats, a) > stats_cycles(&stats, b);
+        });
+
+        ImGui::Text("instructions: %llu", (unsigned long long)instructions);
+        ImGui::Text("interrupts:   %llu", (unsigned long long)stats.interrupts);
+        ImGui::Text("halted:       %.1f%%",
+                    cycles ? 100.0 * stats.halted_cycles / cycles : 0.0);
+        ImGui::Text("branches taken: %.1f%%",
+                    branches ? 100.0 * taken / branches : 0.0);
+        if (ImGui::Button("Reset counters"))
+          stats_reset(&state.stats);
+
+        if (ImGui::BeginTable(
+                "Opcodes", 4, ImGuiTableFlags_ScrollY,
+                ImVec2(0.0f, ImGui::GetTextLineHeightWithSpacing() * 12))) {
+          ImGui::TableSetupColumn("op");
+          ImGui::TableSetupColumn("instruction");
+          ImGui::TableSetupColumn("executed");
+          ImGui::TableSetupColumn("cycles");
+          ImGui::TableSetupScrollFreeze(0, 1);
+          ImGui::TableHeadersRow();
+          for (int i = 0; i < 256 && stats.executed[order[i]] != 0; i++) {
+            const int op = order[i];
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%02X", op);
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(instruction_table[op]);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)stats.executed[op]);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f%%", 100.0 * stats_cycles(&stats, op) / cycles);
+          }
+          ImGui::EndTable();
+        }
+      }
+#endif
       ImGui::End();
     }
 
@@ -416,7 +541,7 @@ int main(int argc, char *argv[]) {
         ImGui::TableHeadersRow();
 
         ImGuiListClipper clipper;
-        clipper.Begin((ARRAY_SIZE(mem) + column_count - 1) / column_count,
+        clipper.Begin((MAX_MEMORY + column_count - 1) / column_count,
                       ImGui::GetTextLineHeight());
 
         while (clipper.Step()) {
@@ -438,13 +563,15 @@ int main(int argc, char *argv[]) {
 
             for (int col = 0; col < column_count; col++) {
               if (ImGui::TableSetColumnIndex(col + 1)) {
-                if (mem[row * column_count + col] == 0) {
+                const uint8_t byte =
+                    mem_peek_byte(state.mem, row * column_count + col);
+                if (byte == 0) {
                   ImGui::PushStyleColor(ImGuiCol_Text,
                                         IM_COL32(128, 128, 128, 255));
-                  ImGui::Text("%02X", mem[row * column_count + col]);
+                  ImGui::Text("%02X", byte);
                   ImGui::PopStyleColor();
                 } else {
-                  ImGui::Text("%02X", mem[row * column_count + col]);
+                  ImGui::Text("%02X", byte);
                 }
               }
 
@@ -452,10 +579,9 @@ int main(int argc, char *argv[]) {
               ImGui::TextUnformatted("|");
               ImGui::SameLine();
               for (int col = 0; col < column_count; col++) {
-                ImGui::Text("%c", mem[row * column_count + col] >= 32 &&
-                                          mem[row * column_count + col] <= 126
-                                      ? mem[row * column_count + col]
-                                      : '.');
+                const uint8_t byte =
+                    mem_peek_byte(state.mem, row * column_count + col);
+                ImGui::Text("%c", byte >= 32 && byte <= 126 ? byte : '.');
                 ImGui::SameLine();
               }
               ImGui::TextUnformatted("|");
@@ -474,7 +600,7 @@ int main(int argc, char *argv[]) {
       ImGui::AlignTextToFramePadding();
       ImGui::Button("Options");
       ImGui::SameLine();
-      ImGui::Text("Range %04X..%04lX ", 0000, ARRAY_SIZE(mem));
+      ImGui::Text("Range %04X..%04X ", 0000, MAX_MEMORY);
       ImGui::SameLine();
       ImGui::PushItemWidth(40);
       // ImGui::InputText("##goto", &goto_offset,
@@ -495,6 +621,10 @@ int main(int argc, char *argv[]) {
     SDL_GL_SwapWindow(window);
   }
 
+  movie_destroy(movie);
+  rewind_destroy(history);
+  invaders_free(&machine);
+
   ImGui_ImplOpenGL3_Shutdown();
   ImGui_ImplSDL3_Shutdown();
   ImGui::DestroyContext();
@@ -3,23 +3,274 @@
 #include "types.h"
 #include "utils.h"
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-u8 mem[MAX_MEMORY];
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
 
-u8 mem_read_byte(u16 val) { return mem[val]; }
+// Zeroed pages straight from the OS, which only backs the ones that get
+// touched: a clone costs what it writes, not all of data[]
+static memory *mem_alloc(void) {
+  void *m = mmap(NULL, sizeof(memory), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return m == MAP_FAILED ? NULL : m;
+}
+
+void mem_destroy(memory *m) {
+  if (m != NULL)
+    munmap(m, sizeof(*m));
+}
+#else
+static memory *mem_alloc(void) { return calloc(1, sizeof(memory)); }
+
+void mem_destroy(memory *m) { free(m); }
+#endif
+
+static void ignore_write(void *ctx, u16 addr, u8 data) {
+  (void)ctx;
+  (void)addr;
+  (void)data;
+}
+
+static void cow_write(void *ctx, u16 addr, u8 data);
+
+// Whether a clone still reads `page` from the memory it was cloned from
+static bool page_shared(const memory *m, const u32 page) {
+  const uintptr_t at = (uintptr_t)m->read[page] - (uintptr_t)m->data;
+  return m->read[page] != NULL && at >= MAX_MEMORY;
+}
+
+// Sets the watch bits of `page` from the page map, keeping WATCH_CODE.
+// Shared mirrors aren't marked WATCH_SHARED: code is watched at its home
+// address, and code in a mirror isn't cached.
+static void page_watch(memory *m, const u32 page) {
+  const u8 *own = &m->data[page << PAGE_SHIFT];
+  u8 bits = (m->read[page] != own ? WATCH_READ : 0) |
+            (m->write[page] != own ? WATCH_WRITE : 0);
+  if (page_shared(m, page) && m->home[page] == page)
+    bits |= WATCH_SHARED;
+
+  for (u32 i = page << PAGE_SHIFT; i < (page + 1) << PAGE_SHIFT; i++)
+    m->watch[i] = (m->watch[i] & WATCH_CODE) | bits;
+}
+
+// Gives a clone its own copy of page `home` of data[], if it still shares
+// it, and maps every page stored there to the copy
+static void unshare(memory *m, const u32 home) {
+  const u8 *from = NULL;
+  for (u32 page = 0; page < PAGE_COUNT && from == NULL; page++)
+    if (m->home[page] == home && page_shared(m, page))
+      from = m->read[page];
+  if (from == NULL)
+    return;
+
+  u8 *own = &m->data[home << PAGE_SHIFT];
+  memcpy(own, from, PAGE_SIZE);
+  for (u32 page = 0; page < PAGE_COUNT; page++) {
+    if (m->home[page] != home || !page_shared(m, page))
+      continue;
+    m->read[page] = own;
+    if (m->io[page].write == cow_write) {
+      m->write[page] = own;
+      m->io[page].write = ignore_write;
+      m->io[page].ctx = NULL;
+    }
+    page_watch(m, page);
+  }
+  m->dirty[home] = true;
+}
+
+// Writes to a page a clone shares land in its own copy of it
+static void cow_write(void *ctx, const u16 addr, const u8 data) {
+  memory *m = ctx;
+  unshare(m, m->home[addr >> PAGE_SHIFT]);
+  mem_write_byte(m, addr, data);
+}
+
+memory *mem_create(void) {
+  memory *m = mem_alloc();
+  if (m == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return NULL;
+  }
 
-u8 mem_read_word(u16 val) { return mem[val]; }
+  const struct mem_region ram = {.kind = REGION_RAM, .size = MAX_MEMORY};
+  mem_map(m, &ram, 1);
+  return m;
+}
 
-void mem_write_byte(u16 addr, u8 data) { mem[addr] = data; }
+memory *mem_clone(const memory *parent) {
+  memory *m = mem_alloc();
+  if (m == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return NULL;
+  }
 
-void mem_write_word(u16 addr, u16 data) {
-  mem[addr] = get_lo(data);
-  mem[addr + 1] = get_hi(data);
+  // every page reads what the parent's does; writable ones copy on write
+  for (u32 page = 0; page < PAGE_COUNT; page++) {
+    m->read[page] = parent->read[page];
+    m->write[page] = NULL;
+    m->io[page] = parent->io[page];
+    m->home[page] = parent->home[page];
+    if (parent->write[page] != NULL || parent->io[page].write == cow_write) {
+      m->io[page].write = cow_write;
+      m->io[page].ctx = m;
+    }
+    page_watch(m, page);
+  }
+  m->plain_reads = false;
+  return m;
 }
 
-int mem_load_file(const char *rom, const u16 address) {
+static bool region_valid(const struct mem_region *r) {
+  if (r->start % PAGE_SIZE || r->size % PAGE_SIZE ||
+      r->start + r->size > MAX_MEMORY)
+    return false;
+  if (r->kind == REGION_MIRROR)
+    return r->source % PAGE_SIZE == 0 && r->source_size % PAGE_SIZE == 0 &&
+           r->source_size != 0 && r->source + r->source_size <= MAX_MEMORY;
+  if (r->kind == REGION_MMIO)
+    return r->read != NULL && r->write != NULL;
+  return true;
+}
+
+int mem_map(memory *m, const struct mem_region *regions, const size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (!region_valid(&regions[i])) {
+      fprintf(stderr, "Invalid memory region %04X+%X\n", regions[i].start,
+              regions[i].size);
+      return 1;
+    }
+  }
+
+  // the map is rebuilt over data[], so it has to hold everything
+  for (u32 page = 0; page < PAGE_COUNT; page++)
+    unshare(m, page);
+
+  // unmapped pages read as the 0xFF left in them
+  bool mapped[PAGE_COUNT] = {false};
+  for (u32 page = 0; page < PAGE_COUNT; page++) {
+    m->home[page] = (u8)page;
+    m->read[page] = &m->data[page << PAGE_SHIFT];
+    m->write[page] = NULL;
+    m->io[page].read = NULL;
+    m->io[page].write = ignore_write;
+    m->io[page].ctx = NULL;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const struct mem_region *r = &regions[i];
+
+    for (u32 off = 0; off < r->size; off += PAGE_SIZE) {
+      const u32 page = (r->start + off) >> PAGE_SHIFT;
+      u8 *own = &m->data[r->start + off];
+
+      mapped[page] = true;
+      switch (r->kind) {
+      case REGION_RAM:
+        m->read[page] = own;
+        m->write[page] = own;
+        break;
+      case REGION_ROM:
+        m->read[page] = own;
+        break;
+      case REGION_MIRROR: {
+        // take over whatever the source pages are mapped to by now
+        const u32 from = (r->source + off % r->source_size) >> PAGE_SHIFT;
+        m->read[page] = m->read[from];
+        m->write[page] = m->write[from];
+        m->io[page] = m->io[from];
+        m->home[page] = m->home[from];
+        break;
+      }
+      case REGION_MMIO:
+        m->read[page] = NULL;
+        m->io[page].read = r->read;
+        m->io[page].write = r->write;
+        m->io[page].ctx = r->ctx;
+        break;
+      }
+    }
+  }
+
+  // tell direct users of data[] which pages aren't plain
+  m->plain_reads = true;
+  for (u32 page = 0; page < PAGE_COUNT; page++) {
+    u8 *own = &m->data[page << PAGE_SHIFT];
+    if (!mapped[page])
+      memset(own, 0xFF, PAGE_SIZE);
+
+    page_watch(m, page);
+    if (m->watch[page << PAGE_SHIFT] & WATCH_READ)
+      m->plain_reads = false;
+  }
+
+  // code may have been cached from pages that changed
+  for (u32 i = 0; i < MAX_MEMORY; i++)
+    if ((m->watch[i] & WATCH_CODE) && m->write_hook != NULL)
+      m->write_hook(m->hook_ctx, i);
+
+  return 0;
+}
+
+u8 mem_read_io(const memory *m, u16 addr) {
+  const u8 page = addr >> PAGE_SHIFT;
+  return m->io[page].read(m->io[page].ctx, addr);
+}
+
+void mem_write_io(memory *m, u16 addr, u8 data) {
+  const u8 page = addr >> PAGE_SHIFT;
+  m->io[page].write(m->io[page].ctx, addr, data);
+}
+
+static inline void mem_watch_check(memory *m, u16 addr) {
+  if ((m->watch[addr] & WATCH_CODE) && m->write_hook != NULL)
+    m->write_hook(m->hook_ctx, addr);
+}
+
+void mem_write_word(memory *m, u16 addr, u16 data) {
+  mem_write_byte(m, addr, get_lo(data));
+  mem_write_byte(m, addr + 1, get_hi(data));
+}
+
+// Where each page of data[] is held: in data[], or for a page a clone
+// shares, in the memory it shares it with
+static void page_contents(const memory *m, const u8 *contents[PAGE_COUNT]) {
+  for (u32 page = 0; page < PAGE_COUNT; page++)
+    contents[page] = &m->data[page << PAGE_SHIFT];
+  for (u32 page = 0; page < PAGE_COUNT; page++)
+    if (page_shared(m, page))
+      contents[m->home[page]] = m->read[page];
+}
+
+void mem_save(const memory *m, u8 *out) {
+  const u8 *contents[PAGE_COUNT];
+  page_contents(m, contents);
+  for (u32 page = 0; page < PAGE_COUNT; page++)
+    memcpy(&out[page << PAGE_SHIFT], contents[page], PAGE_SIZE);
+}
+
+void mem_restore(memory *m, const u8 *data) {
+  const u8 *contents[PAGE_COUNT];
+  page_contents(m, contents);
+
+  for (u32 page = 0; page < MAX_MEMORY; page += PAGE_SIZE) {
+    if (memcmp(contents[page >> PAGE_SHIFT], &data[page], PAGE_SIZE) == 0)
+      continue;
+    unshare(m, page >> PAGE_SHIFT);
+    for (u32 i = page; i < page + PAGE_SIZE; i++) {
+      if (m->data[i] != data[i]) {
+        m->data[i] = data[i];
+        mem_watch_check(m, i);
+      }
+    }
+  }
+}
+
+int mem_load_file(memory *m, const char *rom, const u16 address) {
   FILE *fp = fopen(rom, "rb");
   if (fp == NULL) {
     fprintf(stderr, "Failed to open file: %s (Error code: %d)\n",
@@ -37,7 +288,12 @@ int mem_load_file(const char *rom, const u16 address) {
     return 1;
   }
 
-  size_t bytes_read = fread(&mem[address], 1, file_size, fp);
+  for (long off = 0; off < file_size; off += PAGE_SIZE)
+    unshare(m, (address + off) >> PAGE_SHIFT);
+  if (file_size > 0)
+    unshare(m, (address + file_size - 1) >> PAGE_SHIFT);
+
+  size_t bytes_read = fread(&m->data[address], 1, file_size, fp);
   fclose(fp);
 
   if (bytes_read != (size_t)file_size) {
@@ -46,5 +302,8 @@ int mem_load_file(const char *rom, const u16 address) {
     return 1;
   }
 
+  for (long i = 0; i < file_size; i++)
+    mem_watch_check(m, address + i);
+
   return 0;
 }
@@ -0,0 +1,239 @@
+#include "movie.h"
+#include "savestate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_VALUE 0x100
+
+// Longest encoding of an event: a 64-bit varint, port and value
+#define MAX_EVENT 12
+
+static struct movie *movie_alloc(const u16 machine, const u8 *start,
+                                 const u32 size) {
+  struct movie *mv = calloc(1, sizeof(*mv));
+  if (mv == NULL || (mv->state = malloc(size)) == NULL) {
+    fprintf(stderr, "Failed to allocate a movie\n");
+    free(mv);
+    return NULL;
+  }
+  memcpy(mv->state, start, size);
+  mv->machine = machine;
+  mv->state_size = size;
+  return mv;
+}
+
+// OUTs to a port the movie took over still go to its device
+static void forward_write(void *ctx, const u8 port, const u8 value,
+                          const u64 cycle) {
+  const struct movie *mv = ctx;
+  const struct port *device = &mv->devices[port];
+  device->write(device->ctx, port, value, cycle);
+}
+
+static void take_ports(struct movie *mv, i8080 *state, const port_read_fn fn,
+                       const u8 *ports, const u8 count) {
+  mv->cpu = state;
+  for (u32 port = 0; port < MAX_PORTS; port++)
+    mv->last[port] = NO_VALUE;
+  for (u8 i = 0; i < count; i++) {
+    const u8 port = ports[i];
+    mv->taken[port] = true;
+    mv->devices[port] = state->ports[port];
+    state->ports[port] = (struct port){
+        fn, state->ports[port].write != NULL ? forward_write : NULL, mv};
+  }
+}
+
+static int append(struct movie *mv, const u64 delta, const u8 port,
+                  const u8 value) {
+  if (mv->size + MAX_EVENT > mv->capacity) {
+    const size_t capacity = mv->capacity ? mv->capacity * 2 : 4096;
+    u8 *events = realloc(mv->events, capacity);
+    if (events == NULL)
+      return 1;
+    mv->events = events;
+    mv->capacity = capacity;
+  }
+
+  u8 *p = mv->events + mv->size;
+  u64 v = delta;
+  while (v >= 0x80) {
+    *p++ = (u8)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (u8)v;
+  *p++ = port;
+  *p++ = value;
+  mv->size = (size_t)(p - mv->events);
+  mv->count++;
+  return 0;
+}
+
+static u8 record_read(void *ctx, const u8 port, const u64 cycle) {
+  struct movie *mv = ctx;
+  const struct port *device = &mv->devices[port];
+  const u8 value =
+      device->read != NULL ? device->read(device->ctx, port, cycle) : 0;
+
+  if (value != mv->last[port]) {
+    if (append(mv, cycle - mv->event_cycle, port, value) != 0) {
+      fprintf(stderr, "Failed to record a movie event\n");
+      return value;
+    }
+    mv->last[port] = value;
+    mv->event_cycle = cycle;
+  }
+  return value;
+}
+
+struct movie *movie_record(i8080 *state, const u16 machine, const u8 *start,
+                           const u32 size, const u8 *ports, const u8 count) {
+  struct movie *mv = movie_alloc(machine, start, size);
+  if (mv == NULL)
+    return NULL;
+  mv->event_cycle = state->cycle;
+  take_ports(mv, state, record_read, ports, count);
+  return mv;
+}
+
+// Decodes the event at mv->pos. Returns where the one after it starts, or
+// 0 if there is none.
+static size_t next_event(const struct movie *mv, u64 *cycle, u8 *port,
+                         u8 *value) {
+  u64 delta = 0;
+  size_t pos = mv->pos;
+  for (int shift = 0; pos < mv->size && shift < 64; shift += 7) {
+    const u8 byte = mv->events[pos++];
+    delta |= (u64)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      if (pos + 2 > mv->size)
+        return 0;
+      *cycle = mv->event_cycle + delta;
+      *port = mv->events[pos];
+      *value = mv->events[pos + 1];
+      return pos + 2;
+    }
+  }
+  return 0;
+}
+
+// Takes every event up to `cycle`. Reads happen at the same cycles as they
+// were recorded, so one that is passed over means the replay went astray.
+static u8 replay_read(void *ctx, const u8 port, const u64 cycle) {
+  struct movie *mv = ctx;
+  u64 at;
+  u8 event_port, value;
+  size_t next;
+
+  while ((next = next_event(mv, &at, &event_port, &value)) != 0 &&
+         at <= cycle) {
+    if ((at != cycle || event_port != port) && !mv->desynced) {
+      fprintf(stderr, "Movie out of sync at cycle %llu\n",
+              (unsigned long long)cycle);
+      mv->desynced = true;
+    }
+    mv->last[event_port] = value;
+    mv->event_cycle = at;
+    mv->pos = next;
+  }
+  return mv->last[port] != NO_VALUE ? (u8)mv->last[port] : 0;
+}
+
+void movie_replay(struct movie *mv, i8080 *state, const u8 *ports,
+                  const u8 count) {
+  mv->replaying = true;
+  mv->desynced = false;
+  mv->pos = 0;
+  mv->event_cycle = state->cycle;
+  take_ports(mv, state, replay_read, ports, count);
+}
+
+bool movie_done(const struct movie *mv) {
+  return mv->cpu == NULL || mv->cpu->cycle >= mv->end_cycle;
+}
+
+void movie_stop(struct movie *mv) {
+  if (mv == NULL || mv->cpu == NULL)
+    return;
+  if (!mv->replaying)
+    mv->end_cycle = mv->cpu->cycle;
+
+  for (u32 port = 0; port < MAX_PORTS; port++)
+    if (mv->taken[port])
+      mv->cpu->ports[port] = mv->devices[port];
+  memset(mv->taken, 0, sizeof(mv->taken));
+  mv->cpu = NULL;
+}
+
+void movie_destroy(struct movie *mv) {
+  if (mv == NULL)
+    return;
+  movie_stop(mv);
+  free(mv->state);
+  free(mv->events);
+  free(mv);
+}
+
+int movie_write_file(const struct movie *mv, const char *path) {
+  const size_t size = MOVIE_HEADER_SIZE + mv->state_size + mv->size;
+  u8 *buf = malloc(size);
+  if (buf == NULL) {
+    fprintf(stderr, "Failed to allocate %zu bytes\n", size);
+    return 1;
+  }
+
+  memcpy(buf, MOVIE_MAGIC, 8);
+  u8 *p = savestate_put_u16(buf + 8, MOVIE_VERSION);
+  p = savestate_put_u16(p, mv->machine);
+  p = savestate_put_u32(p, mv->state_size);
+  p = savestate_put_u64(p, mv->end_cycle);
+  p = savestate_put_u64(p, mv->count);
+  memcpy(p, mv->state, mv->state_size);
+  if (mv->size != 0)
+    memcpy(p + mv->state_size, mv->events, mv->size);
+
+  const int result = savestate_write_file(path, buf, size);
+  free(buf);
+  return result;
+}
+
+struct movie *movie_read_file(const char *path) {
+  size_t length;
+  const u8 *buf = savestate_map_file(path, &length);
+  if (buf == NULL)
+    return NULL;
+
+  struct movie *mv = NULL;
+  const u8 *p = buf + 8;
+  if (length < MOVIE_HEADER_SIZE || memcmp(buf, MOVIE_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s is not a movie\n", path);
+  } else if (savestate_get_u16(&p) != MOVIE_VERSION) {
+    fprintf(stderr, "%s has a version this build doesn't read\n", path);
+  } else {
+    const u16 machine = savestate_get_u16(&p);
+    const u32 state_size = savestate_get_u32(&p);
+    const u64 end_cycle = savestate_get_u64(&p);
+    const u64 count = savestate_get_u64(&p);
+
+    if (state_size > length - MOVIE_HEADER_SIZE) {
+      fprintf(stderr, "%s is cut short\n", path);
+    } else if ((mv = movie_alloc(machine, p, state_size)) != NULL) {
+      mv->end_cycle = end_cycle;
+      mv->count = count;
+      mv->size = length - MOVIE_HEADER_SIZE - state_size;
+      mv->capacity = mv->size;
+      mv->events = malloc(mv->size ? mv->size : 1);
+      if (mv->events == NULL) {
+        fprintf(stderr, "Failed to allocate a movie\n");
+        movie_destroy(mv);
+        mv = NULL;
+      } else {
+        memcpy(mv->events, p + state_size, mv->size);
+      }
+    }
+  }
+
+  savestate_unmap_file(buf, length);
+  return mv;
+}
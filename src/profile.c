@@ -0,0 +1,401 @@
+#include "profile.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest 8080 instruction; addresses closer together than this may belong
+// to one run of code
+#define MAX_INSN_LENGTH 3
+
+struct profile *profile_create(void) {
+  struct profile *profile = calloc(1, sizeof(*profile));
+  if (profile == NULL)
+    fprintf(stderr, "Failed to allocate the profile\n");
+  return profile;
+}
+
+void profile_destroy(struct profile *profile) { free(profile); }
+
+static bool is_hex(const char c) { return isxdigit((unsigned char)c) != 0; }
+
+// Lines with code or a label start with the 4 digit address
+static bool has_address(const char *line) {
+  while (*line == ' ')
+    line++;
+  return is_hex(line[0]) && is_hex(line[1]) && is_hex(line[2]) &&
+         is_hex(line[3]) && !is_hex(line[4]);
+}
+
+static bool label_start(const char c) {
+  return isalpha((unsigned char)c) || c == '_' || c == '?' || c == '@' ||
+         c == '$';
+}
+
+static bool label_char(const char c) {
+  return label_start(c) || isdigit((unsigned char)c);
+}
+
+static int by_address(const void *a, const void *b) {
+  const struct symbol *x = a, *y = b;
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+int symbols_load_prn(struct symbols *symbols, const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return 1;
+  }
+
+  // The source text starts in a fixed column, after the address and code
+  // bytes, which may run right up to it. The first line that is only
+  // source, like a comment, gives it away.
+  int column = -1;
+  char line[256];
+  symbols->count = 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (!has_address(line)) {
+      const int indent = (int)strspn(line, " ");
+      if (column < 0 && indent > 0 && line[indent] != '\0')
+        column = indent;
+      continue;
+    }
+    if (column < 0 || (int)strlen(line) <= column ||
+        !label_start(line[column]))
+      continue;
+
+    // a label, then a colon
+    const char *name = &line[column];
+    size_t length = 0;
+    while (label_char(name[length]))
+      length++;
+    if (name[length] != ':')
+      continue;
+
+    if (symbols->count == MAX_SYMBOLS) {
+      fprintf(stderr, "%s: only the first %d labels are kept\n", path,
+              MAX_SYMBOLS);
+      break;
+    }
+    struct symbol *symbol = &symbols->symbol[symbols->count++];
+    symbol->addr = (u16)strtoul(line, NULL, 16);
+    if (length >= MAX_SYMBOL_NAME)
+      length = MAX_SYMBOL_NAME - 1;
+    memcpy(symbol->name, name, length);
+    symbol->name[length] = '\0';
+  }
+  fclose(fp);
+
+  qsort(symbols->symbol, symbols->count, sizeof(*symbols->symbol),
+        by_address);
+  return 0;
+}
+
+const struct symbol *symbols_find(const struct symbols *symbols,
+                                  const u16 addr) {
+  // the last symbol whose address is at most addr
+  int lo = 0, hi = symbols->count;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (symbols->symbol[mid].addr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? &symbols->symbol[lo - 1] : NULL;
+}
+
+struct range {
+  u16 start;
+  u16 end; // address of the last instruction in it
+  u64 executed;
+  u64 cycles;
+};
+
+static int by_cycles(const void *a, const void *b) {
+  const struct range *x = a, *y = b;
+  return (x->cycles < y->cycles) - (x->cycles > y->cycles);
+}
+
+// Whether a label starts after `last` and at or before `addr`
+static bool label_between(const struct symbols *symbols, const u16 last,
+                          const u16 addr) {
+  if (symbols == NULL)
+    return false;
+  const struct symbol *symbol = symbols_find(symbols, addr);
+  return symbol != NULL && symbol->addr > last;
+}
+
+void profile_report(const struct profile *profile,
+                    const struct symbols *symbols, FILE *fp, const int top) {
+  struct range *ranges = malloc(MAX_MEMORY * sizeof(*ranges));
+  if (ranges == NULL) {
+    fprintf(stderr, "Failed to allocate the profile report\n");
+    return;
+  }
+
+  u32 count = 0;
+  u64 executed = 0, cycles = 0;
+  for (u32 addr = 0; addr < MAX_MEMORY; addr++) {
+    if (profile->executed[addr] == 0)
+      continue;
+
+    struct range *range = count > 0 ? &ranges[count - 1] : NULL;
+    if (range == NULL || addr - range->end > MAX_INSN_LENGTH ||
+        label_between(symbols, range->end, addr)) {
+      range = &ranges[count++];
+      *range = (struct range){.start = addr};
+    }
+    range->end = addr;
+    range->executed += profile->executed[addr];
+    range->cycles += profile->cycles[addr];
+    executed += profile->executed[addr];
+    cycles += profile->cycles[addr];
+  }
+  qsort(ranges, count, sizeof(*ranges), by_cycles);
+
+  fprintf(fp, "%llu instructions, %llu cycles, %u ranges of code\n\n",
+          (unsigned long long)executed, (unsigned long long)cycles, count);
+  fprintf(fp, "%-9s  %-22s %14s %14s %7s %7s\n", "range", "label",
+          "instructions", "cycles", "%", "cumul%");
+
+  u64 cumulative = 0;
+  for (u32 i = 0; i < count && (int)i < top; i++) {
+    const struct range *r = &ranges[i];
+    const struct symbol *symbol =
+        symbols != NULL ? symbols_find(symbols, r->start) : NULL;
+
+    char label[MAX_SYMBOL_NAME + 8] = "";
+    if (symbol != NULL && symbol->addr == r->start)
+      snprintf(label, sizeof(label), "%s", symbol->name);
+    else if (symbol != NULL)
+      snprintf(label, sizeof(label), "%s+%X", symbol->name,
+               r->start - symbol->addr);
+
+    cumulative += r->cycles;
+    fprintf(fp, "%04X-%04X  %-22s %14llu %14llu %6.2f%% %6.2f%%\n", r->start,
+            r->end, label, (unsigned long long)r->executed,
+            (unsigned long long)r->cycles, 100.0 * r->cycles / cycles,
+            100.0 * cumulative / cycles);
+  }
+  free(ranges);
+}
+
+#define ROOTS 0
+#define MAIN 1
+
+struct callgraph *callgraph_create(void) {
+  struct callgraph *graph = calloc(1, sizeof(*graph));
+  if (graph == NULL) {
+    fprintf(stderr, "Failed to allocate the call graph\n");
+    return NULL;
+  }
+
+  // node 0 has no parent and doesn't run; everything else hangs off it
+  graph->node_count = 2;
+  graph->nodes[MAIN].parent = ROOTS;
+  graph->nodes[ROOTS].first_child = MAIN;
+  graph->node = MAIN;
+  return graph;
+}
+
+void callgraph_destroy(struct callgraph *graph) { free(graph); }
+
+void callgraph_sync(struct callgraph *graph, const u64 cycle) {
+  graph->nodes[graph->node].cycles += cycle - graph->cycle;
+  graph->cycle = cycle;
+}
+
+static void pop_frame(struct callgraph *graph) {
+  graph->depth--;
+  graph->node =
+      graph->depth > 0 ? graph->stack[graph->depth - 1].node : (u32)MAIN;
+}
+
+// The child of `parent` for a call of `addr`, made if need be
+static u32 child(struct callgraph *graph, const u32 parent, const u16 addr,
+                 const bool interrupt) {
+  u32 *link = &graph->nodes[parent].first_child;
+  while (*link != 0) {
+    const struct call_node *node = &graph->nodes[*link];
+    if (node->addr == addr && node->interrupt == interrupt)
+      return *link;
+    link = &graph->nodes[*link].next_sibling;
+  }
+
+  if (graph->node_count == MAX_CALL_NODES) {
+    graph->lost_calls++;
+    return parent != ROOTS ? parent : (u32)MAIN;
+  }
+  const u32 index = graph->node_count++;
+  graph->nodes[index] = (struct call_node){
+      .parent = parent, .addr = addr, .interrupt = interrupt};
+  *link = index;
+  return index;
+}
+
+void callgraph_call(struct callgraph *graph, const u16 addr, const u16 sp,
+                    const u64 cycle) {
+  callgraph_sync(graph, cycle);
+
+  // the return address just pushed overwrote any frame at or below it
+  while (graph->depth > 0 && graph->stack[graph->depth - 1].sp <= sp)
+    pop_frame(graph);
+
+  const u32 node = graph->interrupt ? child(graph, ROOTS, addr, true)
+                                    : child(graph, graph->node, addr, false);
+  graph->nodes[node].calls++;
+
+  if (graph->depth == MAX_CALL_DEPTH) {
+    memmove(&graph->stack[0], &graph->stack[1],
+            (MAX_CALL_DEPTH - 1) * sizeof(*graph->stack));
+    graph->depth--;
+  }
+  graph->stack[graph->depth++] = (struct call_frame){sp, node};
+  graph->node = node;
+}
+
+void callgraph_return(struct callgraph *graph, const u16 sp,
+                      const u64 cycle) {
+  callgraph_sync(graph, cycle);
+
+  // frames below the stack pointer were thrown away
+  while (graph->depth > 0 && graph->stack[graph->depth - 1].sp < sp)
+    pop_frame(graph);
+  if (graph->depth > 0 && graph->stack[graph->depth - 1].sp == sp)
+    pop_frame(graph);
+}
+
+static void node_name(const struct callgraph *graph, const u32 index,
+                      const struct symbols *symbols, char *dest,
+                      const size_t size) {
+  const struct call_node *node = &graph->nodes[index];
+  if (index == MAIN) {
+    snprintf(dest, size, "main");
+    return;
+  }
+
+  const struct symbol *symbol =
+      symbols != NULL ? symbols_find(symbols, node->addr) : NULL;
+  const char *prefix = node->interrupt ? "irq:" : "";
+  if (symbol != NULL && symbol->addr == node->addr)
+    snprintf(dest, size, "%s%s", prefix, symbol->name);
+  else if (symbol != NULL)
+    snprintf(dest, size, "%s%s+%X", prefix, symbol->name,
+             node->addr - symbol->addr);
+  else
+    snprintf(dest, size, "%s%04X", prefix, node->addr);
+}
+
+#define MAX_NAME (MAX_SYMBOL_NAME + 16)
+
+// Writes the names from the root down to `index`, separated by ';'
+static void print_path(const struct callgraph *graph, const u32 index,
+                       const struct symbols *symbols, FILE *fp) {
+  if (graph->nodes[index].parent != ROOTS) {
+    print_path(graph, graph->nodes[index].parent, symbols, fp);
+    fputc(';', fp);
+  }
+  char name[MAX_NAME];
+  node_name(graph, index, symbols, name, sizeof(name));
+  fputs(name, fp);
+}
+
+void callgraph_folded(const struct callgraph *graph,
+                      const struct symbols *symbols, FILE *fp) {
+  for (u32 i = MAIN; i < graph->node_count; i++) {
+    if (graph->nodes[i].cycles == 0)
+      continue;
+    print_path(graph, i, symbols, fp);
+    fprintf(fp, " %llu\n", (unsigned long long)graph->nodes[i].cycles);
+  }
+}
+
+struct subroutine {
+  u32 node; // the first node for it, for the name
+  u64 calls;
+  u64 inclusive;
+  u64 exclusive;
+};
+
+static int by_inclusive(const void *a, const void *b) {
+  const struct subroutine *x = a, *y = b;
+  return (x->inclusive < y->inclusive) - (x->inclusive > y->inclusive);
+}
+
+// Whether a caller of node `index` is the same subroutine, so that its
+// cycles already count towards that one's inclusive total.
+static bool recursive(const struct callgraph *graph, const u32 index) {
+  const struct call_node *node = &graph->nodes[index];
+  for (u32 up = node->parent; up != ROOTS; up = graph->nodes[up].parent)
+    if (up != MAIN && graph->nodes[up].addr == node->addr &&
+        graph->nodes[up].interrupt == node->interrupt)
+      return true;
+  return false;
+}
+
+void callgraph_report(const struct callgraph *graph,
+                      const struct symbols *symbols, FILE *fp,
+                      const int top) {
+  // Children come after their parents, so one backwards pass adds every
+  // subtree into its root
+  u64 *inclusive = calloc(graph->node_count, sizeof(*inclusive));
+  struct subroutine *subs = calloc(graph->node_count, sizeof(*subs));
+  if (inclusive == NULL || subs == NULL) {
+    fprintf(stderr, "Failed to allocate the call graph report\n");
+    free(inclusive);
+    free(subs);
+    return;
+  }
+  u64 total = 0;
+  for (u32 i = graph->node_count - 1; i >= MAIN; i--) {
+    inclusive[i] += graph->nodes[i].cycles;
+    if (graph->nodes[i].parent != ROOTS)
+      inclusive[graph->nodes[i].parent] += inclusive[i];
+    total += graph->nodes[i].cycles;
+  }
+
+  // the same subroutine on different paths counts once
+  u32 count = 0;
+  for (u32 i = MAIN; i < graph->node_count; i++) {
+    const struct call_node *node = &graph->nodes[i];
+    u32 s = 0;
+    while (s < count && (subs[s].node == MAIN || i == MAIN ||
+                         graph->nodes[subs[s].node].addr != node->addr ||
+                         graph->nodes[subs[s].node].interrupt !=
+                             node->interrupt))
+      s++;
+    if (s == count)
+      subs[count++] = (struct subroutine){.node = i};
+    subs[s].calls += node->calls;
+    subs[s].exclusive += node->cycles;
+    if (!recursive(graph, i))
+      subs[s].inclusive += inclusive[i];
+  }
+  qsort(subs, count, sizeof(*subs), by_inclusive);
+
+  fprintf(fp, "%llu cycles in %u subroutines, %u call paths",
+          (unsigned long long)total, count, graph->node_count - 2);
+  if (graph->lost_calls != 0)
+    fprintf(fp, ", %llu calls charged to their callers",
+            (unsigned long long)graph->lost_calls);
+  fprintf(fp, "\n\n%-24s %12s %14s %7s %14s %7s\n", "subroutine", "calls",
+          "inclusive", "%", "exclusive", "%");
+
+  for (u32 s = 0; s < count && (int)s < top; s++) {
+    char name[MAX_NAME];
+    node_name(graph, subs[s].node, symbols, name, sizeof(name));
+    fprintf(fp, "%-24s %12llu %14llu %6.2f%% %14llu %6.2f%%\n", name,
+            (unsigned long long)subs[s].calls,
+            (unsigned long long)subs[s].inclusive,
+            100.0 * subs[s].inclusive / total,
+            (unsigned long long)subs[s].exclusive,
+            100.0 * subs[s].exclusive / total);
+  }
+  free(inclusive);
+  free(subs);
+}
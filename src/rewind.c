@@ -0,0 +1,251 @@
+#include "rewind.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#else
+#define HAVE_SSE2 0
+#endif
+
+// Equal bytes it takes to end a run of different ones. Shorter gaps are
+// cheaper to store as part of the run than as a new one.
+#define MIN_GAP 8
+
+// A delta is a list of runs, each the number of bytes to skip and the
+// number of bytes to XOR, as varints, followed by those bytes.
+
+static u8 *put_varint(u8 *p, size_t v) {
+  while (v >= 0x80) {
+    *p++ = (u8)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (u8)v;
+  return p;
+}
+
+static size_t get_varint(const u8 **p) {
+  size_t v = 0;
+  int shift = 0;
+  u8 byte;
+  do {
+    byte = *(*p)++;
+    v |= (size_t)(byte & 0x7F) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return v;
+}
+
+// The first index from `i` on where `a` and `b` differ, or `n`. Nearly all
+// of a state is equal to its keyframe, so this is where capturing one
+// spends its time.
+static size_t skip_equal(const u8 *a, const u8 *b, size_t i, const size_t n) {
+#if HAVE_SSE2
+  for (; i + 16 <= n; i += 16) {
+    const __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    const __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+    const unsigned differ = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+    if (differ != 0)
+      return i + __builtin_ctz(differ);
+  }
+#else
+  for (; i + 8 <= n; i += 8) {
+    u64 x, y;
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    if (x != y)
+      break;
+  }
+#endif
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+// The end of the run of different bytes at `i`: the start of the first
+// MIN_GAP equal ones, or of the equal ones at the end.
+static size_t skip_different(const u8 *a, const u8 *b, size_t i,
+                             const size_t n) {
+  size_t equal = 0;
+  for (; i < n; i++) {
+    if (a[i] != b[i])
+      equal = 0;
+    else if (++equal == MIN_GAP)
+      return i + 1 - MIN_GAP;
+  }
+  return n - equal;
+}
+
+// Writes the delta from `from` to `to` to `out`. Returns its size.
+static size_t encode(const u8 *from, const u8 *to, const size_t n, u8 *out) {
+  u8 *p = out;
+  size_t pos = 0;
+  for (;;) {
+    const size_t start = skip_equal(from, to, pos, n);
+    if (start == n)
+      break;
+    const size_t end = skip_different(from, to, start, n);
+
+    p = put_varint(p, start - pos);
+    p = put_varint(p, end - start);
+    for (size_t i = start; i < end; i++)
+      *p++ = from[i] ^ to[i];
+    pos = end;
+  }
+  return (size_t)(p - out);
+}
+
+// XORs a delta into `state`, which turns either end of it into the other
+static void apply(u8 *state, const u8 *delta, const size_t size) {
+  const u8 *p = delta;
+  const u8 *end = delta + size;
+  size_t pos = 0;
+  while (p < end) {
+    pos += get_varint(&p);
+    const size_t length = get_varint(&p);
+    for (size_t i = 0; i < length; i++)
+      state[pos + i] ^= p[i];
+    p += length;
+    pos += length;
+  }
+}
+
+struct rewind *rewind_create(const size_t state_size, const u32 interval,
+                             const size_t budget) {
+  struct rewind *r = calloc(1, sizeof(*r));
+  if (r == NULL)
+    return NULL;
+
+  r->state_size = state_size;
+  r->interval = interval > 0 ? interval : 1;
+  r->budget = budget;
+  r->key = calloc(1, state_size);
+  // a run of one byte takes MIN_GAP + 1 and at most 10 more for its varints
+  r->scratch = malloc(state_size + (state_size / (MIN_GAP + 1) + 1) * 10);
+  if (r->key == NULL || r->scratch == NULL) {
+    rewind_destroy(r);
+    return NULL;
+  }
+  return r;
+}
+
+void rewind_destroy(struct rewind *r) {
+  if (r == NULL)
+    return;
+  rewind_clear(r);
+  free(r->entries);
+  free(r->key);
+  free(r->scratch);
+  free(r);
+}
+
+static struct rewind_entry *entry(const struct rewind *r, const size_t i) {
+  return &r->entries[(r->first + i) % r->capacity];
+}
+
+static size_t entry_bytes(const struct rewind_entry *e) {
+  return sizeof(*e) + e->size;
+}
+
+// Drops the oldest keyframe and the states that depend on it, unless they
+// are the newest group. Returns false if there was nothing to drop.
+static bool drop_oldest(struct rewind *r) {
+  size_t group = 1;
+  while (group < r->count && !entry(r, group)->keyframe)
+    group++;
+  if (group == r->count)
+    return false;
+
+  for (size_t i = 0; i < group; i++) {
+    struct rewind_entry *e = entry(r, i);
+    r->bytes -= entry_bytes(e);
+    free(e->delta);
+  }
+  r->first = (r->first + group) % r->capacity;
+  r->count -= group;
+  return true;
+}
+
+void rewind_set_budget(struct rewind *r, const size_t budget) {
+  r->budget = budget;
+  while (r->bytes > r->budget && drop_oldest(r))
+    ;
+}
+
+static int grow(struct rewind *r) {
+  const size_t capacity = r->capacity ? r->capacity * 2 : 1024;
+  struct rewind_entry *entries = malloc(capacity * sizeof(*entries));
+  if (entries == NULL)
+    return 1;
+  for (size_t i = 0; i < r->count; i++)
+    entries[i] = *entry(r, i);
+  free(r->entries);
+  r->entries = entries;
+  r->capacity = capacity;
+  r->first = 0;
+  return 0;
+}
+
+int rewind_push(struct rewind *r, const u8 *state) {
+  if (r->count == r->capacity && grow(r) != 0) {
+    fprintf(stderr, "Failed to grow the rewind buffer\n");
+    return 1;
+  }
+
+  // the oldest keyframe's delta is never applied
+  const bool keyframe = r->count == 0 || r->since_key + 1 >= r->interval;
+  const size_t size =
+      r->count != 0 ? encode(r->key, state, r->state_size, r->scratch) : 0;
+  u8 *delta = malloc(size ? size : 1);
+  if (delta == NULL) {
+    fprintf(stderr, "Failed to store a state to rewind to\n");
+    return 1;
+  }
+  memcpy(delta, r->scratch, size);
+
+  struct rewind_entry *e = entry(r, r->count++);
+  *e = (struct rewind_entry){delta, (u32)size, keyframe};
+  r->bytes += entry_bytes(e);
+
+  if (keyframe) {
+    memcpy(r->key, state, r->state_size);
+    r->since_key = 0;
+  } else {
+    r->since_key++;
+  }
+
+  rewind_set_budget(r, r->budget);
+  return 0;
+}
+
+int rewind_pop(struct rewind *r, u8 *state) {
+  if (r->count == 0)
+    return 1;
+
+  struct rewind_entry *e = entry(r, r->count - 1);
+  memcpy(state, r->key, r->state_size);
+  if (e->keyframe) {
+    // groups before the newest are always whole
+    apply(r->key, e->delta, e->size);
+    r->since_key = r->interval - 1;
+  } else {
+    apply(state, e->delta, e->size);
+    r->since_key--;
+  }
+
+  r->bytes -= entry_bytes(e);
+  free(e->delta);
+  r->count--;
+  return 0;
+}
+
+void rewind_clear(struct rewind *r) {
+  for (size_t i = 0; i < r->count; i++)
+    free(entry(r, i)->delta);
+  r->count = 0;
+  r->first = 0;
+  r->bytes = 0;
+  r->since_key = 0;
+}
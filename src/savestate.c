@@ -0,0 +1,151 @@
+#include "savestate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define HAVE_MMAP 0
+#endif
+
+u8 *savestate_put_header(u8 *buf, const u16 machine, const u32 size) {
+  memcpy(buf, SAVESTATE_MAGIC, 8);
+  buf = savestate_put_u16(buf + 8, SAVESTATE_VERSION);
+  buf = savestate_put_u16(buf, machine);
+  return savestate_put_u32(buf, size);
+}
+
+u8 *savestate_put_cpu(u8 *buf, i8080 *state) {
+  i8080_flags_sync(state);
+  buf = savestate_put_u16(buf, state->Register.pc);
+  buf = savestate_put_u16(buf, state->Register.sp);
+  buf = savestate_put_u16(buf, state->Register.psw);
+  buf = savestate_put_u16(buf, state->Register.bc);
+  buf = savestate_put_u16(buf, state->Register.de);
+  buf = savestate_put_u16(buf, state->Register.hl);
+  buf = savestate_put_u64(buf, state->cycle);
+  buf = savestate_put_u8(buf, state->status == HALTED ? 0 : 1);
+  buf = savestate_put_u8(buf, state->inte);
+  buf = savestate_put_u8(buf, state->inte_pending);
+  buf = savestate_put_u8(buf, state->inte_handle);
+
+  mem_save(state->mem, buf);
+  return buf + SAVESTATE_MEMORY_SIZE;
+}
+
+int savestate_check_header(const u8 *buf, const size_t length,
+                           const u16 machine, const u32 size) {
+  if (length < SAVESTATE_HEADER_SIZE ||
+      memcmp(buf, SAVESTATE_MAGIC, 8) != 0) {
+    fprintf(stderr, "Not a saved state\n");
+    return 1;
+  }
+
+  const u8 *p = buf + 8;
+  const u16 version = savestate_get_u16(&p);
+  const u16 kind = savestate_get_u16(&p);
+  const u32 expected = savestate_get_u32(&p);
+  if (version != SAVESTATE_VERSION) {
+    fprintf(stderr, "Saved state has version %u, this build reads %u\n",
+            version, SAVESTATE_VERSION);
+    return 1;
+  }
+  if (kind != machine || expected != size || length < size) {
+    fprintf(stderr, "Saved state is of a different machine\n");
+    return 1;
+  }
+  return 0;
+}
+
+const u8 *savestate_get_cpu(const u8 *buf, i8080 *state) {
+  state->Register.pc = savestate_get_u16(&buf);
+  state->Register.sp = savestate_get_u16(&buf);
+  state->Register.psw = savestate_get_u16(&buf);
+  state->Register.bc = savestate_get_u16(&buf);
+  state->Register.de = savestate_get_u16(&buf);
+  state->Register.hl = savestate_get_u16(&buf);
+#if LAZY_FLAGS
+  state->Lazy.pending = false;
+#endif
+  state->cycle = savestate_get_u64(&buf);
+  state->status = savestate_get_u8(&buf) == 0 ? HALTED : RUNNING;
+  state->inte = savestate_get_u8(&buf) != 0;
+  state->inte_pending = savestate_get_u8(&buf) != 0;
+  state->inte_handle = savestate_get_u8(&buf);
+
+  mem_restore(state->mem, buf);
+  return buf + SAVESTATE_MEMORY_SIZE;
+}
+
+int savestate_write_file(const char *path, const u8 *buf, const size_t size) {
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return 1;
+  }
+  const bool written = fwrite(buf, 1, size, fp) == size;
+  if (fclose(fp) != 0 || !written) {
+    fprintf(stderr, "Failed to write %s\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+#if HAVE_MMAP
+const u8 *savestate_map_file(const char *path, size_t *size) {
+  const int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s\n", path);
+    return NULL;
+  }
+  *size = (size_t)st.st_size;
+  return map;
+}
+
+void savestate_unmap_file(const u8 *buf, const size_t size) {
+  if (buf != NULL)
+    munmap((void *)buf, size);
+}
+#else
+const u8 *savestate_map_file(const char *path, size_t *size) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return NULL;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  const long length = ftell(fp);
+  rewind(fp);
+  u8 *buf = length > 0 ? malloc((size_t)length) : NULL;
+  if (buf == NULL || fread(buf, 1, (size_t)length, fp) != (size_t)length) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    free(buf);
+    fclose(fp);
+    return NULL;
+  }
+  fclose(fp);
+  *size = (size_t)length;
+  return buf;
+}
+
+void savestate_unmap_file(const u8 *buf, const size_t size) {
+  (void)size;
+  free((void *)buf);
+}
+#endif
@@ -0,0 +1,100 @@
+#include "scheduler.h"
+#include <stdio.h>
+
+static bool before(const struct event *a, const struct event *b) {
+  return a->cycle != b->cycle ? a->cycle < b->cycle : a->seq < b->seq;
+}
+
+static void swap(struct event *a, struct event *b) {
+  const struct event t = *a;
+  *a = *b;
+  *b = t;
+}
+
+static void sift_up(struct scheduler *sched, u8 i) {
+  while (i > 0) {
+    const u8 parent = (i - 1) / 2;
+    if (!before(&sched->events[i], &sched->events[parent]))
+      return;
+    swap(&sched->events[i], &sched->events[parent]);
+    i = parent;
+  }
+}
+
+static void sift_down(struct scheduler *sched, u8 i) {
+  for (;;) {
+    const u8 left = 2 * i + 1;
+    const u8 right = left + 1;
+    u8 first = i;
+    if (left < sched->count &&
+        before(&sched->events[left], &sched->events[first]))
+      first = left;
+    if (right < sched->count &&
+        before(&sched->events[right], &sched->events[first]))
+      first = right;
+    if (first == i)
+      return;
+    swap(&sched->events[i], &sched->events[first]);
+    i = first;
+  }
+}
+
+void sched_init(struct scheduler *sched) {
+  sched->count = 0;
+  sched->seq = 0;
+}
+
+int sched_add(struct scheduler *sched, const u64 cycle, const event_fn fn,
+              void *ctx) {
+  if (sched->count == MAX_EVENTS) {
+    fprintf(stderr, "No room for an event at cycle %llu\n",
+            (unsigned long long)cycle);
+    return 1;
+  }
+
+  sched->events[sched->count] = (struct event){cycle, sched->seq++, fn, ctx};
+  sift_up(sched, sched->count++);
+  return 0;
+}
+
+void sched_cancel(struct scheduler *sched, const event_fn fn, void *ctx) {
+  u8 kept = 0;
+  for (u8 i = 0; i < sched->count; i++) {
+    const struct event *e = &sched->events[i];
+    if (e->fn != fn || e->ctx != ctx)
+      sched->events[kept++] = *e;
+  }
+  sched->count = kept;
+
+  for (int i = kept / 2 - 1; i >= 0; i--)
+    sift_down(sched, i);
+}
+
+u64 sched_next(const struct scheduler *sched) {
+  return sched->count ? sched->events[0].cycle : UINT64_MAX;
+}
+
+u64 sched_run(struct scheduler *sched, i8080 *state, const u64 until) {
+  const u64 start = state->cycle;
+
+  while (state->cycle < until) {
+    const u64 next = sched_next(sched);
+    const u64 limit = next < until ? next : until;
+
+    if (state->cycle < limit) {
+      i8080_run(state, limit - state->cycle);
+      // short of the limit without a reason to go on: a trap
+      if (state->cycle < limit && !(state->inte && state->inte_pending))
+        break;
+    }
+
+    while (sched->count && sched->events[0].cycle <= state->cycle) {
+      const struct event e = sched->events[0];
+      sched->events[0] = sched->events[--sched->count];
+      sift_down(sched, 0);
+      e.fn(sched, e.ctx, e.cycle);
+    }
+  }
+
+  return state->cycle - start;
+}
@@ -0,0 +1,101 @@
+#include "stats.h"
+#include "cpu.h"
+#include <string.h>
+
+#if STATS
+
+static bool is_conditional(const u8 opcode) {
+  switch (opcode & 0xC7) {
+  case 0xC0: // Rcc
+  case 0xC2: // Jcc
+  case 0xC4: // Ccc
+    return true;
+  }
+  return false;
+}
+
+void stats_reset(struct i8080_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+u64 stats_cycles(const struct i8080_stats *stats, const u8 opcode) {
+  const bool extra = (opcode & 0xC7) == 0xC0 || (opcode & 0xC7) == 0xC4;
+  return stats->executed[opcode] * OPCODES_CYCLES[opcode] +
+         (extra ? stats->taken[opcode] * 6 : 0);
+}
+
+static void print_csv(const struct i8080_stats *stats, FILE *fp) {
+  fprintf(fp, "opcode,instruction,executed,cycles,taken,not_taken\n");
+  for (int op = 0; op < 256; op++) {
+    if (stats->executed[op] == 0)
+      continue;
+    fprintf(fp, "%02X,\"%s\",%llu,%llu", op, instruction_table[op],
+            (unsigned long long)stats->executed[op],
+            (unsigned long long)stats_cycles(stats, op));
+    if (is_conditional(op))
+      fprintf(fp, ",%llu,%llu\n", (unsigned long long)stats->taken[op],
+              (unsigned long long)(stats->executed[op] - stats->taken[op]));
+    else
+      fprintf(fp, ",,\n");
+  }
+  // the cycles column adds up to the total
+  fprintf(fp, ",interrupts,%llu,,,\n", (unsigned long long)stats->interrupts);
+  fprintf(fp, ",halted,,%llu,,\n", (unsigned long long)stats->halted_cycles);
+}
+
+static void print_json(const struct i8080_stats *stats, FILE *fp) {
+  u64 instructions = 0, cycles = stats->halted_cycles;
+  for (int op = 0; op < 256; op++) {
+    instructions += stats->executed[op];
+    cycles += stats_cycles(stats, op);
+  }
+
+  fprintf(fp, "{\n  \"instructions\": %llu,\n  \"cycles\": %llu,\n",
+          (unsigned long long)instructions, (unsigned long long)cycles);
+  fprintf(fp, "  \"interrupts\": %llu,\n  \"halted_cycles\": %llu,\n",
+          (unsigned long long)stats->interrupts,
+          (unsigned long long)stats->halted_cycles);
+  fprintf(fp, "  \"opcodes\": [");
+
+  bool first = true;
+  for (int op = 0; op < 256; op++) {
+    if (stats->executed[op] == 0)
+      continue;
+    fprintf(fp, "%s\n    {\"opcode\": \"%02X\", \"instruction\": \"%s\", ",
+            first ? "" : ",", op, instruction_table[op]);
+    fprintf(fp, "\"executed\": %llu, \"cycles\": %llu",
+            (unsigned long long)stats->executed[op],
+            (unsigned long long)stats_cycles(stats, op));
+    if (is_conditional(op))
+      fprintf(fp, ", \"taken\": %llu, \"not_taken\": %llu",
+              (unsigned long long)stats->taken[op],
+              (unsigned long long)(stats->executed[op] - stats->taken[op]));
+    fprintf(fp, "}");
+    first = false;
+  }
+  fprintf(fp, "\n  ]\n}\n");
+}
+
+void stats_print(const struct i8080_stats *stats, FILE *fp,
+                 const enum stats_format format) {
+  if (format == STATS_JSON)
+    print_json(stats, fp);
+  else
+    print_csv(stats, fp);
+}
+
+int stats_write(const struct i8080_stats *stats, const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return 1;
+  }
+
+  const size_t length = strlen(path);
+  const bool json = length >= 5 && strcmp(path + length - 5, ".json") == 0;
+  stats_print(stats, fp, json ? STATS_JSON : STATS_CSV);
+  fclose(fp);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#include "trace.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// How long the writer sleeps when the ring is empty
+#define IDLE_NS 200000
+
+// Writes what the CPU has added, in contiguous runs of at most TRACE_CHUNK
+// records, until trace_close() asks it to stop and the ring is empty.
+static void *trace_writer(void *arg) {
+  struct trace *trace = arg;
+  u64 tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+
+  for (;;) {
+    const bool stop = atomic_load_explicit(&trace->stop, memory_order_acquire);
+    const u64 head = atomic_load_explicit(&trace->head, memory_order_acquire);
+    if (head == tail) {
+      if (stop)
+        return NULL;
+      const struct timespec idle = {0, IDLE_NS};
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    const u32 start = tail & (TRACE_RING - 1);
+    u64 count = head - tail;
+    if (count > TRACE_RING - start)
+      count = TRACE_RING - start;
+    if (count > TRACE_CHUNK)
+      count = TRACE_CHUNK;
+
+    if (!trace->failed &&
+        fwrite(&trace->ring[start], sizeof(struct trace_record), count,
+               trace->fp) != count) {
+      fprintf(stderr, "Failed to write the trace\n");
+      trace->failed = true;
+    }
+
+    tail += count;
+    atomic_store_explicit(&trace->tail, tail, memory_order_release);
+  }
+}
+
+struct trace *trace_open(const char *path) {
+  struct trace *trace = calloc(1, sizeof(*trace));
+  if (trace == NULL)
+    return NULL;
+  trace->ring = malloc(TRACE_RING * sizeof(struct trace_record));
+  trace->fp = fopen(path, "wb");
+  if (trace->ring == NULL || trace->fp == NULL) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    if (trace->fp != NULL)
+      fclose(trace->fp);
+    free(trace->ring);
+    free(trace);
+    return NULL;
+  }
+
+  struct trace_header header = {.version = TRACE_VERSION,
+                                .byte_order = 0x0102,
+                                .record_size = sizeof(struct trace_record)};
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  if (fwrite(&header, sizeof(header), 1, trace->fp) != 1) {
+    fprintf(stderr, "Failed to write the trace\n");
+    trace->failed = true;
+  }
+
+  atomic_init(&trace->head, 0);
+  atomic_init(&trace->tail, 0);
+  atomic_init(&trace->stop, false);
+  trace->space_until = TRACE_RING;
+
+  if (pthread_create(&trace->writer, NULL, trace_writer, trace) != 0) {
+    fprintf(stderr, "Failed to start the trace writer\n");
+    fclose(trace->fp);
+    free(trace->ring);
+    free(trace);
+    return NULL;
+  }
+  return trace;
+}
+
+int trace_close(struct trace *trace) {
+  if (trace == NULL)
+    return 0;
+
+  atomic_store_explicit(&trace->stop, true, memory_order_release);
+  pthread_join(trace->writer, NULL);
+
+  bool failed = trace->failed;
+  if (fclose(trace->fp) != 0 && !failed) {
+    fprintf(stderr, "Failed to write the trace\n");
+    failed = true;
+  }
+  free(trace->ring);
+  free(trace);
+  return failed ? 1 : 0;
+}
+
+void trace_wait(struct trace *trace) {
+  const u64 head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+  for (;;) {
+    const u64 tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+    if (head - tail < TRACE_RING) {
+      trace->space_until = tail + TRACE_RING;
+      return;
+    }
+    sched_yield();
+  }
+}
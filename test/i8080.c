@@ -1,89 +1,133 @@
+#include "common.h"
 #include "cpu.h"
 #include "memory.h"
+#include "trace.h"
 #include "utils.h"
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #define TST_ADDRESS 0x0100
 
-u8 pack_flags(const i8080 state) {
-  u8 flag = 0;
-  if (state.Flag.s)
-    flag |= 0x80; // bit 7
-  if (state.Flag.z)
-    flag |= 0x40; // bit 6
-  if (state.Flag.ac)
-    flag |= 0x10; // bit 4 (not bit 5!)
-  if (state.Flag.p)
-    flag |= 0x04; // bit 2
-  if (state.Flag.cy)
-    flag |= 0x01; // bit 0
-  flag |= 0x02;   // bit 1 is always 1 on 8080
-  return flag;
+u8 pack_flags(i8080 state) {
+  i8080_flags_sync(&state);
+  return state.Register.f;
+}
+
+// CP/M programs end by jumping to the warm boot at 0 and print through the
+// BDOS entry at 5. Both are traps, so the CPU runs in large batches and only
+// stops for the harness.
+#define WBOOT 0x0000
+#define BDOS 0x0005
+
+static void bdos(struct i8080 *state) {
+  if (state->Register.c == 2) {
+    printf("%c", state->Register.e);
+  } else if (state->Register.c == 9) {
+    u16 i = state->Register.de;
+    u8 byte;
+    while ((byte = mem_read_byte(state->mem, i)) != '$') {
+      printf("%c", byte);
+      i++;
+    }
+  }
 }
 
 void test_run(struct i8080 *state, const char *test_file) {
   int result;
-  if ((result = mem_load_file(test_file, TST_ADDRESS)) != 0) {
+  if ((result = mem_load_file(state->mem, test_file, TST_ADDRESS)) != 0) {
     printf("ERROR: ROM did not load! Result code: %d\n", result);
     return;
   }
-  mem_write_byte(0x0000, 0xD3);
-  mem_write_byte(0x0001, 0x00);
+  mem_write_byte(state->mem, 0x0000, 0xD3);
+  mem_write_byte(state->mem, 0x0001, 0x00);
 
-  mem_write_byte(0x0005, 0xD3);
-  mem_write_byte(0x0006, 0x01);
-  mem_write_byte(0x0007, 0xC9);
+  mem_write_byte(state->mem, 0x0005, 0xD3);
+  mem_write_byte(state->mem, 0x0006, 0x01);
+  mem_write_byte(state->mem, 0x0007, 0xC9);
 
   state->Register.pc = TST_ADDRESS;
+  state->status = RUNNING;
 
-  for (;;) {
-    /* u8 flag = pack_flags(*state); */
-
-    /* printf("PC: %04X, AF: %04X, BC: %04X, DE: %04X, HL: %04X, SP: %04X, "
-     */
-    /*        "CYC: %ld (%02X %02X %02X %02X)\n", */
-    /*        state->Register.pc, combine(state->Register.a, flag), */
-    /*        state->Register.bc, state->Register.de, state->Register.hl, */
-    /*        state->Register.sp, state->cycle, */
-    /*        mem_read_byte(state->Register.pc), */
-    /*        mem_read_byte(state->Register.pc + 1), */
-    /*        mem_read_byte(state->Register.pc + 2), */
-    /*        mem_read_byte(state->Register.pc + 3)); */
-
-    if (state->Register.pc == 0x0005) {
-      if (state->Register.c == 2) {
-        printf("%c", state->Register.e);
-      } else if (state->Register.c == 9) {
-        u16 i = state->Register.de;
-        u8 byte;
-        while ((byte = mem_read_byte(i)) != '$') {
-          printf("%c", byte);
-          i++;
-        }
-      }
-    }
+  i8080_clear_traps(state);
+  i8080_trap(state, WBOOT);
+  i8080_trap(state, BDOS);
 
-    if (state->Register.pc == 0x0000) {
+  for (;;) {
+    i8080_run(state, UINT64_MAX);
 
+    if (state->Register.pc == BDOS) {
+      bdos(state);
+    } else if (state->Register.pc == WBOOT) {
       printf("\nTest Finished.\n");
       break;
+    } else {
+      printf("ERROR: halted at %04X\n", state->Register.pc - 1);
+      break;
     }
-
-    i8080_execute(state);
   }
 }
 
 int main(int argc, char **argv) {
-  (void)argc;
-  (void)argv;
+  // --stats FILE writes the counters of the 8080EXM run, see stats.h, and
+  // --trace FILE every instruction it runs, see trace.h
+  const char *stats_path = NULL;
+  const char *trace_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      stats_path = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else {
+      fprintf(stderr,
+              "usage: %s [--stats FILE.csv|FILE.json] [--trace FILE]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (stats_path != NULL && !STATS) {
+    fprintf(stderr, "--stats needs a build with STATS=1\n");
+    return 1;
+  }
+  if (trace_path != NULL && !TRACE) {
+    fprintf(stderr, "--trace needs a build with TRACE=1\n");
+    return 1;
+  }
+
+  const enum Engine engines[] = {ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK,
+                                 ENGINE_JIT};
 
-  struct i8080 state = i8080_init();
+  for (size_t i = 0; i < ARRAY_SIZE(engines); i++) {
+    struct i8080 state = i8080_init_engine(engines[i]);
 
-  test_run(&state, "roms/8080PRE.COM");
-  test_run(&state, "roms/TST8080.COM");
-  test_run(&state, "roms/CPUTEST.COM");
-  test_run(&state, "roms/cpudiag.bin");
-  /* test_run(&state, "roms/8080EXM.COM"); */
+    test_run(&state, "roms/8080PRE.COM");
+    test_run(&state, "roms/TST8080.COM");
+    test_run(&state, "roms/CPUTEST.COM");
+    test_run(&state, "roms/cpudiag.bin");
+
+    i8080_free(&state);
+  }
+
+  // 8080EXM runs close to three billion instructions, too many to go through
+  // every engine
+  struct i8080 state = i8080_init_engine(ENGINE_JIT);
+  int result = 0;
+#if TRACE
+  if (trace_path != NULL && (state.trace = trace_open(trace_path)) == NULL) {
+    i8080_free(&state);
+    return 1;
+  }
+#endif
+  test_run(&state, "roms/8080EXM.COM");
+#if TRACE
+  if (trace_close(state.trace) != 0)
+    result = 1;
+#endif
+#if STATS
+  if (stats_path != NULL && stats_write(&state.stats, stats_path) != 0)
+    result = 1;
+#endif
+  i8080_free(&state);
 
-  return 0;
+  return result;
 }
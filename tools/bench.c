@@ -0,0 +1,209 @@
+#include "common.h"
+#include "cpu.h"
+#include "memory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Times the test ROMs on each engine and prints the results as JSON.
+//
+// The ROMs run as in test/i8080.c, but with nothing printed: the BDOS stub
+// at 5 just returns, and the run ends at the warm boot at 0. Each
+// measurement restores the memory image and runs the ROM again, so blocks
+// and native code stay warm from the warm-up run.
+
+#define TST_ADDRESS 0x0100
+#define WBOOT 0x0000
+
+// 8080EXM runs for about 23 billion cycles; the slower engines would take
+// minutes, so by default it is cut off after the first billion.
+#define EXM_CYCLES 1000000000ULL
+
+// Each sample repeats the ROM until it has run at least this long
+#define MIN_SAMPLE_SECONDS 0.1
+#define SAMPLES 5
+
+struct rom {
+  const char *name;
+  const char *path;
+  u8 image[MAX_MEMORY];
+  u64 cycle_limit;
+  u64 instructions; // per run, counted once
+  u64 cycles;
+};
+
+static const char *const engine_names[] = {"switch", "threaded", "block",
+                                           "jit"};
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int rom_load(struct rom *rom) {
+  i8080 state = i8080_init_engine(ENGINE_SWITCH);
+  const int result = mem_load_file(state.mem, rom->path, TST_ADDRESS);
+
+  memory *mem = state.mem;
+  mem->data[0x0000] = 0xD3; // OUT 0
+  mem->data[0x0001] = 0x00;
+  mem->data[0x0005] = 0xD3; // OUT 1; RET
+  mem->data[0x0006] = 0x01;
+  mem->data[0x0007] = 0xC9;
+  memcpy(rom->image, mem->data, MAX_MEMORY);
+
+  i8080_free(&state);
+  return result;
+}
+
+// Puts the ROM's memory image back, writing only the bytes it changed so
+// that blocks over unchanged code survive.
+static void rom_reset(const struct rom *rom, i8080 *state) {
+  for (u32 addr = 0; addr < MAX_MEMORY; addr++)
+    if (state->mem->data[addr] != rom->image[addr])
+      mem_write_byte(state->mem, addr, rom->image[addr]);
+
+  i8080_reset(state);
+  state->Register.pc = TST_ADDRESS;
+}
+
+// Runs the ROM once, up to the warm boot or its cycle limit
+static void rom_run(const struct rom *rom, i8080 *state) {
+  rom_reset(rom, state);
+  i8080_run(state, rom->cycle_limit);
+}
+
+// Single-steps the ROM once to count its instructions. Every engine runs
+// the same instructions, so the timed runs needn't count.
+static void rom_count(struct rom *rom) {
+  i8080 state = i8080_init_engine(ENGINE_SWITCH);
+  rom_reset(rom, &state);
+
+  u64 instructions = 0;
+  do {
+    i8080_execute(&state);
+    instructions++;
+  } while (state.Register.pc != WBOOT && state.cycle < rom->cycle_limit &&
+           state.status != HALTED);
+
+  rom->instructions = instructions;
+  rom->cycles = state.cycle;
+  i8080_free(&state);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  const double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void bench(const struct rom *rom, const enum Engine engine,
+                  const bool last) {
+  i8080 state = i8080_init_engine(engine);
+  i8080_trap(&state, WBOOT);
+
+  // warm up, and find how many runs make a sample long enough to time
+  u32 repeat = 0;
+  const double start = now();
+  do {
+    rom_run(rom, &state);
+    repeat++;
+  } while (now() - start < MIN_SAMPLE_SECONDS);
+
+  if (state.cycle != rom->cycles)
+    fprintf(stderr, "%s on %s ran %llu cycles, expected %llu\n", rom->name,
+            engine_names[engine], (unsigned long long)state.cycle,
+            (unsigned long long)rom->cycles);
+
+  // seconds per run
+  double samples[SAMPLES];
+  for (int i = 0; i < SAMPLES; i++) {
+    const double t = now();
+    for (u32 j = 0; j < repeat; j++)
+      rom_run(rom, &state);
+    samples[i] = (now() - t) / repeat;
+  }
+  qsort(samples, SAMPLES, sizeof(*samples), compare_doubles);
+  const double median = samples[SAMPLES / 2];
+
+  printf("    {\"rom\": \"%s\", \"engine\": \"%s\", ", rom->name,
+         engine_names[engine]);
+  printf("\"instructions\": %llu, \"cycles\": %llu, ",
+         (unsigned long long)rom->instructions,
+         (unsigned long long)rom->cycles);
+  printf("\"runs_per_sample\": %u, \"samples\": %d, ", repeat, SAMPLES);
+  printf("\"wall_s\": {\"min\": %.9f, \"median\": %.9f, \"max\": %.9f}, ",
+         samples[0], median, samples[SAMPLES - 1]);
+  printf("\"instructions_per_s\": %.0f, \"cycles_per_s\": %.0f, ",
+         rom->instructions / median, rom->cycles / median);
+  printf("\"mhz\": %.2f, \"ns_per_instruction\": %.3f}%s\n",
+         rom->cycles / median / 1e6, median * 1e9 / rom->instructions,
+         last ? "" : ",");
+  fflush(stdout);
+
+  i8080_free(&state);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--engine ENGINE]... [--exm-cycles N]\n"
+          "  ENGINE is switch, threaded, block or jit (default all).\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  static struct rom roms[] = {
+      {.name = "8080PRE", .path = "roms/8080PRE.COM"},
+      {.name = "TST8080", .path = "roms/TST8080.COM"},
+      {.name = "CPUTEST", .path = "roms/CPUTEST.COM"},
+      {.name = "cpudiag", .path = "roms/cpudiag.bin"},
+      {.name = "8080EXM", .path = "roms/8080EXM.COM"},
+  };
+
+  bool selected[4] = {false};
+  bool any_selected = false;
+  u64 exm_cycles = EXM_CYCLES;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      i++;
+      int e = 0;
+      while (e < 4 && strcmp(argv[i], engine_names[e]) != 0)
+        e++;
+      if (e == 4) {
+        usage(argv[0]);
+        return 1;
+      }
+      selected[e] = any_selected = true;
+    } else if (strcmp(argv[i], "--exm-cycles") == 0 && i + 1 < argc) {
+      exm_cycles = strtoull(argv[++i], NULL, 10);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  for (size_t i = 0; i < ARRAY_SIZE(roms); i++) {
+    if (rom_load(&roms[i]) != 0)
+      return 1;
+    roms[i].cycle_limit =
+        strcmp(roms[i].name, "8080EXM") == 0 ? exm_cycles : UINT64_MAX;
+    rom_count(&roms[i]);
+  }
+
+  enum Engine engines[4];
+  int engine_count = 0;
+  for (int e = 0; e < 4; e++)
+    if (selected[e] || !any_selected)
+      engines[engine_count++] = (enum Engine)e;
+
+  printf("{\n  \"benchmarks\": [\n");
+  for (size_t i = 0; i < ARRAY_SIZE(roms); i++)
+    for (int e = 0; e < engine_count; e++)
+      bench(&roms[i], engines[e],
+            i + 1 == ARRAY_SIZE(roms) && e + 1 == engine_count);
+  printf("  ]\n}\n");
+
+  return 0;
+}
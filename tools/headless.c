@@ -0,0 +1,260 @@
+#include "cpu.h"
+#include "invaders.h"
+#include "movie.h"
+#include "profile.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Runs Space Invaders without a window, as fast as the host allows, and
+// reports how fast that was.
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--frames N | --cycles N] [--engine ENGINE] "
+          "[--dump FILE.ppm] [--stats FILE.csv|FILE.json]\n"
+          "          [--profile FILE] [--folded FILE] [--prn FILE.PRN] "
+          "[--trace FILE]\n"
+          "          [--load FILE.sav] [--save FILE.sav] [--replay FILE.mov] "
+          "[ROM]\n"
+          "  ENGINE is switch, threaded, block or jit (default jit).\n"
+          "  Runs 600 frames of roms/invaders by default, from the state in\n"
+          "  --load if there is one, and saves the final state to --save.\n"
+          "  --replay runs a movie recorded in the debugger from its start\n"
+          "  to its end, or for as long as --frames or --cycles say.\n"
+          "  --stats, --profile and --folded (call paths for a flame graph)\n"
+          "  need a build with STATS=1 (see stats.h), and --trace (every\n"
+          "  instruction, see trace.h) one with TRACE=1; --prn names the\n"
+          "  profiled code after the labels in a listing.\n",
+          name);
+}
+
+static const char *const engine_names[] = {"switch", "threaded", "block",
+                                           "jit"};
+
+static int parse_engine(const char *name, enum Engine *engine) {
+  for (int i = 0; i < 4; i++) {
+    if (strcmp(name, engine_names[i]) == 0) {
+      *engine = (enum Engine)i;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// FNV-1a, to tell runs apart by their memory and screen
+static u64 hash(const u8 *data, const size_t size) {
+  u64 h = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < size; i++)
+    h = (h ^ data[i]) * 0x100000001B3ULL;
+  return h;
+}
+
+// Binary PPM, viewable nearly everywhere and trivial to diff
+static int dump_screen(const struct invaders *m, const char *path) {
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return 1;
+  }
+  fprintf(fp, "P6\n%d %d\n255\n", GAME_WIDTH, GAME_HEIGHT);
+  fwrite(m->screen, 1, sizeof(m->screen), fp);
+  fclose(fp);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  const char *rom = "roms/invaders";
+  const char *dump = NULL;
+  const char *load = NULL;
+  const char *save = NULL;
+  const char *replay = NULL;
+  const char *stats = NULL;
+  const char *profile = NULL;
+  const char *folded = NULL;
+  const char *trace = NULL;
+  const char *prn = NULL;
+  enum Engine engine = ENGINE_JIT;
+  u64 frames = 0;
+  u64 cycles = 0;
+
+  for (int i = 1; i < argc; i++) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--frames") == 0 && has_value) {
+      frames = strtoull(argv[++i], NULL, 10);
+      cycles = 0;
+    } else if (strcmp(argv[i], "--cycles") == 0 && has_value) {
+      cycles = strtoull(argv[++i], NULL, 10);
+      frames = 0;
+    } else if (strcmp(argv[i], "--engine") == 0 && has_value) {
+      if (parse_engine(argv[++i], &engine) != 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--dump") == 0 && has_value) {
+      dump = argv[++i];
+    } else if (strcmp(argv[i], "--load") == 0 && has_value) {
+      load = argv[++i];
+    } else if (strcmp(argv[i], "--save") == 0 && has_value) {
+      save = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && has_value) {
+      replay = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0 && has_value) {
+      stats = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0 && has_value) {
+      profile = argv[++i];
+    } else if (strcmp(argv[i], "--folded") == 0 && has_value) {
+      folded = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && has_value) {
+      trace = argv[++i];
+    } else if (strcmp(argv[i], "--prn") == 0 && has_value) {
+      prn = argv[++i];
+    } else if (argv[i][0] != '-') {
+      rom = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  const char *counter = stats != NULL     ? "--stats"
+                        : profile != NULL ? "--profile"
+                        : folded != NULL  ? "--folded"
+                                          : NULL;
+  if (counter != NULL && !STATS) {
+    fprintf(stderr, "%s needs a build with STATS=1\n", counter);
+    return 1;
+  }
+  if (trace != NULL && !TRACE) {
+    fprintf(stderr, "--trace needs a build with TRACE=1\n");
+    return 1;
+  }
+
+  if (frames == 0 && cycles == 0 && replay == NULL)
+    frames = 600;
+
+  static struct invaders m;
+  struct movie *movie = NULL;
+  if (invaders_init(&m, rom, engine) != 0 ||
+      (load != NULL && invaders_load_file(&m, load) != 0) ||
+      (replay != NULL && ((movie = movie_read_file(replay)) == NULL ||
+                          invaders_replay(&m, movie) != 0))) {
+    movie_destroy(movie);
+    invaders_free(&m);
+    return 1;
+  }
+
+  static struct symbols symbols;
+  if (prn != NULL && symbols_load_prn(&symbols, prn) != 0) {
+    invaders_free(&m);
+    return 1;
+  }
+#if STATS
+  if ((profile != NULL && (m.cpu.profile = profile_create()) == NULL) ||
+      (folded != NULL && (m.cpu.callgraph = callgraph_create()) == NULL)) {
+    profile_destroy(m.cpu.profile);
+    callgraph_destroy(m.cpu.callgraph);
+    invaders_free(&m);
+    return 1;
+  }
+#endif
+#if TRACE
+  if (trace != NULL && (m.cpu.trace = trace_open(trace)) == NULL) {
+#if STATS
+    profile_destroy(m.cpu.profile);
+    callgraph_destroy(m.cpu.callgraph);
+#endif
+    invaders_free(&m);
+    return 1;
+  }
+#else
+  (void)trace;
+#endif
+
+  // a loaded state goes on from its own frame and cycle counts
+  const u64 first_frame = m.frames;
+  const u64 first_cycle = m.cpu.cycle;
+  const double start = now();
+  if (frames != 0) {
+    while (m.frames - first_frame < frames)
+      invaders_run(&m, INVADERS_FRAME_CYCLES);
+  } else if (cycles != 0) {
+    invaders_run(&m, cycles);
+  } else {
+    // the debugger stops recording mid-frame, so end on its last cycle
+    while (!movie_done(movie)) {
+      const u64 left = movie->end_cycle - m.cpu.cycle;
+      invaders_run(&m, left < INVADERS_FRAME_CYCLES ? left
+                                                    : INVADERS_FRAME_CYCLES);
+    }
+  }
+  const double seconds = now() - start;
+  const u64 ran = m.cpu.cycle - first_cycle;
+
+  printf("engine:    %s\n", engine_names[m.cpu.engine]);
+  printf("frames:    %llu\n", (unsigned long long)m.frames);
+  printf("cycles:    %llu\n", (unsigned long long)m.cpu.cycle);
+  printf("time:      %.3f s\n", seconds);
+  printf("speed:     %.1f MHz (%.0fx real time)\n", ran / seconds / 1e6,
+         ran / seconds / INVADERS_CLOCK);
+  printf("frames/s:  %.1f\n", (m.frames - first_frame) / seconds);
+
+  static u8 memory_copy[MAX_MEMORY];
+  mem_save(m.cpu.mem, memory_copy);
+  printf("memory:    %016llx\n",
+         (unsigned long long)hash(memory_copy, sizeof(memory_copy)));
+  printf("screen:    %016llx\n",
+         (unsigned long long)hash(&m.screen[0][0][0], sizeof(m.screen)));
+
+  int result = dump != NULL ? dump_screen(&m, dump) : 0;
+  if (movie != NULL && movie->desynced)
+    result = 1;
+  if (save != NULL && invaders_save_file(&m, save) != 0)
+    result = 1;
+#if TRACE
+  if (trace_close(m.cpu.trace) != 0)
+    result = 1;
+#endif
+#if STATS
+  if (stats != NULL && stats_write(&m.cpu.stats, stats) != 0)
+    result = 1;
+  if (profile != NULL) {
+    FILE *fp = fopen(profile, "w");
+    if (fp != NULL) {
+      profile_report(m.cpu.profile, prn != NULL ? &symbols : NULL, fp, 50);
+      fclose(fp);
+    } else {
+      fprintf(stderr, "Failed to open %s\n", profile);
+      result = 1;
+    }
+    profile_destroy(m.cpu.profile);
+  }
+  if (folded != NULL) {
+    callgraph_sync(m.cpu.callgraph, m.cpu.cycle);
+    FILE *fp = fopen(folded, "w");
+    if (fp != NULL) {
+      callgraph_folded(m.cpu.callgraph, prn != NULL ? &symbols : NULL, fp);
+      fclose(fp);
+    } else {
+      fprintf(stderr, "Failed to open %s\n", folded);
+      result = 1;
+    }
+    callgraph_destroy(m.cpu.callgraph);
+  }
+#else
+  (void)stats;
+  (void)profile;
+  (void)folded;
+#endif
+  movie_destroy(movie);
+  invaders_free(&m);
+  return result;
+}
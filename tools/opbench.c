@@ -0,0 +1,366 @@
+#include "common.h"
+#include "cpu.h"
+#include "memory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Times each documented opcode on its own and prints a table of the host
+// time per instruction and per emulated cycle, costliest first, followed by
+// the same per class of opcodes.
+//
+// Every opcode gets a kernel: COPIES copies of the instruction followed by a
+// JMP back to the start, long enough to span several blocks so that no
+// engine sees an idle loop. Around that:
+//   - kernels that move SP reset it with LXI SP at the top of the loop
+//   - jumps and calls go to the next instruction, and the conditional ones
+//     run once with their condition holding and once without
+//   - RET and Rcc pop a chain of return addresses set up on the stack
+//   - RST n returns through a RET at n * 8, so it is timed with the RET
+//   - PCHL jumps to itself
+// HLT is left out: a halted CPU idles rather than running instructions.
+//
+// The glue instructions are timed along with the kernel, but there are
+// COPIES times fewer of them.
+
+#define COPIES 240
+#define CODE 0x1000
+#define DATA 0x8000
+#define STACK 0xE000
+
+#define MIN_SAMPLE_SECONDS 0.005
+#define SAMPLES 5
+
+struct result {
+  u8 opcode;
+  char name[32];
+  const char *class;
+  double cycles; // per instruction
+  double ns;     // per instruction
+};
+
+static const char *const engine_names[] = {"switch", "threaded", "block",
+                                           "jit"};
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool documented(const u8 op) {
+  if ((op & 0xC7) == 0x00) // NOP and its undocumented copies
+    return op == 0x00;
+
+  switch (op) {
+  case 0xCB:
+  case 0xD9:
+  case 0xDD:
+  case 0xED:
+  case 0xFD:
+    return false;
+  }
+  return true;
+}
+
+static bool is_conditional(const u8 op) {
+  switch (op & 0xC7) {
+  case 0xC0: // Rcc
+  case 0xC2: // Jcc
+  case 0xC4: // Ccc
+    return true;
+  }
+  return false;
+}
+
+static bool is_return(const u8 op) {
+  return op == 0xC9 || (op & 0xC7) == 0xC0;
+}
+
+static bool moves_sp(const u8 op) {
+  return op == 0xCD || (op & 0xC7) == 0xC4 || is_return(op) ||
+         (op & 0xCB) == 0xC1; // PUSH and POP
+}
+
+static const char *class_of(const u8 op) {
+  if (op >= 0x40 && op < 0x80) {
+    if ((op & 7) == 6)
+      return "mov r,m";
+    return (op & 0xF8) == 0x70 ? "mov m,r" : "mov r,r";
+  }
+  if (op >= 0x80 && op < 0xC0)
+    return (op & 7) == 6 ? "alu m" : "alu r";
+
+  switch (op & 0xC7) {
+  case 0x04:
+  case 0x05:
+    return ((op >> 3) & 7) == 6 ? "inr/dcr m" : "inr/dcr r";
+  case 0x06:
+    return ((op >> 3) & 7) == 6 ? "mvi m" : "mvi r";
+  case 0xC6:
+    return "alu imm";
+  case 0xC7:
+    return "rst (+ret)";
+  case 0xC0:
+    return "rcc";
+  case 0xC2:
+    return "jcc";
+  case 0xC4:
+    return "ccc";
+  }
+
+  switch (op & 0xCF) {
+  case 0x01:
+    return "lxi";
+  case 0x03:
+  case 0x0B:
+    return "inx/dcx";
+  case 0x09:
+    return "dad";
+  case 0xC1:
+    return "pop";
+  case 0xC5:
+    return "push";
+  }
+
+  switch (op) {
+  case 0x07:
+  case 0x0F:
+  case 0x17:
+  case 0x1F:
+    return "rotate";
+  case 0x02:
+  case 0x12:
+  case 0x22:
+  case 0x32:
+    return "store";
+  case 0x0A:
+  case 0x1A:
+  case 0x2A:
+  case 0x3A:
+    return "load";
+  case 0xC3:
+  case 0xC9:
+  case 0xCD:
+  case 0xE9:
+    return "jmp/call/ret";
+  case 0xD3:
+  case 0xDB:
+    return "i/o";
+  }
+  return "misc";
+}
+
+// Lays out the kernel for `op` at CODE and sets up the registers to run it
+// from the start of the loop, which it returns.
+static u16 build(i8080 *state, const u8 op, const bool taken) {
+  u8 *mem = state->mem->data;
+  u16 addr = CODE;
+
+  state->Register.a = 0x55;
+  state->Register.bc = DATA + 0x100;
+  state->Register.de = DATA + 0x200;
+  state->Register.hl = DATA;
+  state->Register.sp = STACK;
+  state->Register.pc = CODE;
+
+  // the flag that decides a conditional op, set so that it holds or not
+  static const u8 condition_flag[4] = {FLAG_Z, FLAG_CY, FLAG_P, FLAG_S};
+  const u8 cond = (op >> 3) & 7;
+  const bool set = (cond & 1) == taken;
+  state->Register.f = FLAG_B1 | (set ? condition_flag[cond >> 1] : 0);
+
+  if (op == 0xE9) { // PCHL
+    state->Register.hl = CODE;
+    mem[CODE] = op;
+    return CODE;
+  }
+
+  for (u8 n = 0; n < 8; n++) // handlers for RST n
+    mem[n * 8] = 0xC9;
+
+  if (moves_sp(op)) {
+    mem[addr++] = 0x31; // LXI SP, STACK
+    mem[addr++] = STACK & 0xFF;
+    mem[addr++] = STACK >> 8;
+  }
+
+  u16 ret_slot = STACK;
+  for (int i = 0; i < COPIES; i++) {
+    const u8 length = OPCODES_LENGTH[op];
+    const u16 next = addr + length;
+    mem[addr] = op;
+    if (length == 2) {
+      mem[addr + 1] = 0x10; // a port, or an immediate
+    } else if (length == 3) {
+      // jumps and calls go on to the next instruction, everything else
+      // points at the data
+      const u16 operand =
+          (op & 0xC7) == 0xC2 || (op & 0xC7) == 0xC4 || op == 0xC3 ||
+                  op == 0xCD
+              ? next
+              : (op == 0x31 ? STACK : DATA);
+      mem[addr + 1] = operand & 0xFF;
+      mem[addr + 2] = operand >> 8;
+    }
+    if (is_return(op)) { // each return comes back to the next one
+      mem[ret_slot] = next & 0xFF;
+      mem[ret_slot + 1] = next >> 8;
+      ret_slot += 2;
+    }
+    addr = next;
+  }
+
+  mem[addr++] = 0xC3; // JMP CODE
+  mem[addr++] = CODE & 0xFF;
+  mem[addr++] = CODE >> 8;
+  return CODE;
+}
+
+// One kernel on one engine: how long an instruction takes, and how many
+// cycles it is worth on average.
+static bool measure(const u8 op, const bool taken, const enum Engine engine,
+                    struct result *out) {
+  // count what an iteration runs by stepping through one
+  i8080 counter = i8080_init_engine(ENGINE_SWITCH);
+  const u16 start = build(&counter, op, taken);
+  u64 instructions = 0;
+  do {
+    i8080_execute(&counter);
+    instructions++;
+  } while (counter.Register.pc != start);
+  const u64 cycles = counter.cycle;
+  i8080_free(&counter);
+
+  i8080 state = i8080_init_engine(engine);
+  build(&state, op, taken);
+
+  // warm up, and find how many iterations make a sample long enough to time
+  u64 iterations = 64;
+  for (;;) {
+    const double t = now();
+    i8080_run(&state, iterations * cycles);
+    if (now() - t >= MIN_SAMPLE_SECONDS)
+      break;
+    iterations *= 2;
+  }
+
+  double samples[SAMPLES];
+  for (int i = 0; i < SAMPLES; i++) {
+    const double t = now();
+    i8080_run(&state, iterations * cycles);
+    samples[i] = now() - t;
+  }
+
+  // runs stop on a cycle rather than an iteration boundary: finish the
+  // iteration, which must come back to the start
+  i8080_trap(&state, start);
+  i8080_run(&state, cycles);
+  const bool ok = state.Register.pc == start && state.status == RUNNING;
+  i8080_free(&state);
+  if (!ok) {
+    fprintf(stderr, "%02X: the kernel went astray\n", op);
+    return false;
+  }
+
+  // median
+  for (int i = 0; i < SAMPLES; i++)
+    for (int j = i + 1; j < SAMPLES; j++)
+      if (samples[j] < samples[i]) {
+        const double t = samples[i];
+        samples[i] = samples[j];
+        samples[j] = t;
+      }
+
+  out->opcode = op;
+  snprintf(out->name, sizeof(out->name), "%s%s", instruction_table[op],
+           !is_conditional(op) ? ""
+           : taken             ? " (taken)"
+                               : " (not taken)");
+  out->class = class_of(op);
+  out->cycles = (double)cycles / instructions;
+  out->ns = samples[SAMPLES / 2] * 1e9 / (iterations * instructions);
+  return true;
+}
+
+static int by_cost(const void *a, const void *b) {
+  const double x = ((const struct result *)a)->ns;
+  const double y = ((const struct result *)b)->ns;
+  return (x < y) - (x > y);
+}
+
+struct class_total {
+  const char *class;
+  int count;
+  double ns;
+  double ns_per_cycle;
+};
+
+static int class_by_cost(const void *a, const void *b) {
+  const struct class_total *x = a, *y = b;
+  const double p = x->ns / x->count, q = y->ns / y->count;
+  return (p < q) - (p > q);
+}
+
+int main(int argc, char **argv) {
+  enum Engine engine = ENGINE_SWITCH;
+
+  if (argc == 3 && strcmp(argv[1], "--engine") == 0) {
+    int e = 0;
+    while (e < 4 && strcmp(argv[2], engine_names[e]) != 0)
+      e++;
+    engine = (enum Engine)e;
+  }
+  if ((argc != 1 && argc != 3) || engine > ENGINE_JIT) {
+    fprintf(stderr,
+            "usage: %s [--engine ENGINE]\n"
+            "  ENGINE is switch (the default), threaded, block or jit.\n",
+            argv[0]);
+    return 1;
+  }
+
+  static struct result results[512];
+  int count = 0;
+  for (int op = 0; op < 256; op++) {
+    if (!documented(op) || op == 0x76)
+      continue;
+    if (measure(op, true, engine, &results[count]))
+      count++;
+    if (is_conditional(op) && measure(op, false, engine, &results[count]))
+      count++;
+  }
+
+  qsort(results, count, sizeof(*results), by_cost);
+
+  printf("engine: %s\n\n", engine_names[engine]);
+  printf("op  %-22s %-13s %6s %9s %9s\n", "instruction", "class", "cycles",
+         "ns/insn", "ns/cycle");
+  for (int i = 0; i < count; i++) {
+    const struct result *r = &results[i];
+    printf("%02X  %-22s %-13s %6.1f %9.3f %9.3f\n", r->opcode, r->name,
+           r->class, r->cycles, r->ns, r->ns / r->cycles);
+  }
+
+  static struct class_total classes[64];
+  int class_count = 0;
+  for (int i = 0; i < count; i++) {
+    int c = 0;
+    while (c < class_count && strcmp(classes[c].class, results[i].class))
+      c++;
+    if (c == class_count)
+      classes[class_count++] = (struct class_total){results[i].class, 0, 0, 0};
+    classes[c].count++;
+    classes[c].ns += results[i].ns;
+    classes[c].ns_per_cycle += results[i].ns / results[i].cycles;
+  }
+  qsort(classes, class_count, sizeof(*classes), class_by_cost);
+
+  printf("\n%-13s %7s %9s %9s\n", "class", "opcodes", "ns/insn", "ns/cycle");
+  for (int c = 0; c < class_count; c++)
+    printf("%-13s %7d %9.3f %9.3f\n", classes[c].class, classes[c].count,
+           classes[c].ns / classes[c].count,
+           classes[c].ns_per_cycle / classes[c].count);
+
+  return 0;
+}
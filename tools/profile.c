@@ -0,0 +1,158 @@
+#include "cpu.h"
+#include "memory.h"
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Runs a CP/M program with a profile and a call graph and prints where its
+// cycles went: by ranges of code, then by subroutine including what they
+// call, named after the labels in the program's .PRN listing. --folded
+// also writes the call paths for a flame graph.
+//
+// The program runs as in tools/bench.c: BDOS calls just return, and the run
+// ends at the warm boot at 0.
+
+#if !STATS
+#error "the profiler needs the CPU's counters, build with -DSTATS=1"
+#endif
+
+#define TST_ADDRESS 0x0100
+#define WBOOT 0x0000
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--engine ENGINE] [--cycles N] [--top N] "
+          "[--prn FILE.PRN] [--folded FILE] PROGRAM.COM\n"
+          "  ENGINE is switch, threaded or block (default block).\n"
+          "  The labels come from PROGRAM.PRN if there is one.\n",
+          name);
+}
+
+static const char *const engine_names[] = {"switch", "threaded", "block",
+                                           "jit"};
+
+// PROGRAM.COM -> PROGRAM.PRN, or NULL if there is no such file
+static char *listing_for(const char *program) {
+  const char *dot = strrchr(program, '.');
+  const size_t stem = dot != NULL ? (size_t)(dot - program) : strlen(program);
+
+  char *path = malloc(stem + 5);
+  if (path == NULL)
+    return NULL;
+  memcpy(path, program, stem);
+  strcpy(path + stem, ".PRN");
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    free(path);
+    return NULL;
+  }
+  fclose(fp);
+  return path;
+}
+
+int main(int argc, char **argv) {
+  const char *program = NULL;
+  const char *prn = NULL;
+  const char *folded = NULL;
+  enum Engine engine = ENGINE_BLOCK;
+  u64 cycles = UINT64_MAX;
+  int top = 25;
+
+  for (int i = 1; i < argc; i++) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--engine") == 0 && has_value) {
+      i++;
+      int e = 0;
+      while (e < 4 && strcmp(argv[i], engine_names[e]) != 0)
+        e++;
+      if (e == 4) {
+        usage(argv[0]);
+        return 1;
+      }
+      engine = (enum Engine)e;
+    } else if (strcmp(argv[i], "--cycles") == 0 && has_value) {
+      cycles = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--top") == 0 && has_value) {
+      top = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--prn") == 0 && has_value) {
+      prn = argv[++i];
+    } else if (strcmp(argv[i], "--folded") == 0 && has_value) {
+      folded = argv[++i];
+    } else if (argv[i][0] != '-' && program == NULL) {
+      program = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (program == NULL) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  static struct symbols symbols;
+  char *found = prn == NULL ? listing_for(program) : NULL;
+  if (found != NULL)
+    prn = found;
+  const int loaded = prn != NULL ? symbols_load_prn(&symbols, prn) : 1;
+  if (prn != NULL && loaded != 0) {
+    free(found);
+    return 1;
+  }
+
+  i8080 state = i8080_init_engine(engine);
+  struct profile *profile = profile_create();
+  struct callgraph *graph = callgraph_create();
+  if (profile == NULL || graph == NULL ||
+      mem_load_file(state.mem, program, TST_ADDRESS) != 0) {
+    profile_destroy(profile);
+    callgraph_destroy(graph);
+    i8080_free(&state);
+    free(found);
+    return 1;
+  }
+  mem_write_byte(state.mem, 0x0000, 0xD3); // OUT 0
+  mem_write_byte(state.mem, 0x0001, 0x00);
+  mem_write_byte(state.mem, 0x0005, 0xD3); // OUT 1; RET
+  mem_write_byte(state.mem, 0x0006, 0x01);
+  mem_write_byte(state.mem, 0x0007, 0xC9);
+  state.Register.pc = TST_ADDRESS;
+  i8080_trap(&state, WBOOT);
+
+  state.profile = profile;
+  state.callgraph = graph;
+  i8080_run(&state, cycles);
+  callgraph_sync(graph, state.cycle);
+
+  const struct symbols *labels = prn != NULL ? &symbols : NULL;
+  int result = 0;
+  if (folded != NULL) {
+    FILE *fp = fopen(folded, "w");
+    if (fp != NULL) {
+      callgraph_folded(graph, labels, fp);
+      fclose(fp);
+    } else {
+      fprintf(stderr, "Failed to open %s\n", folded);
+      result = 1;
+    }
+  }
+
+  printf("%s on %s", program, engine_names[state.engine]);
+  if (prn != NULL)
+    printf(", %d labels from %s", symbols.count, prn);
+  printf("\n");
+  if (state.Register.pc != WBOOT)
+    printf("stopped at %04X before the end\n", state.Register.pc);
+  printf("\n");
+  profile_report(profile, labels, stdout, top);
+  printf("\n");
+  callgraph_report(graph, labels, stdout, top);
+
+  profile_destroy(profile);
+  callgraph_destroy(graph);
+  i8080_free(&state);
+  free(found);
+  return result;
+}
@@ -0,0 +1,53 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Prints a trace written with --trace (see trace.h) as text, one line per
+// instruction in the format test/i8080.c used to print as it ran, so traces
+// diff against those of other emulators.
+
+// Records read at a time
+#define BATCH 4096
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s FILE.trace\n", argv[0]);
+    return 1;
+  }
+
+  FILE *fp = fopen(argv[1], "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s\n", argv[1]);
+    return 1;
+  }
+
+  struct trace_header header;
+  const char *error = fread(&header, sizeof(header), 1, fp) == 1
+                          ? trace_header_error(&header)
+                          : "is not a trace";
+  if (error != NULL) {
+    fprintf(stderr, "%s %s\n", argv[1], error);
+    fclose(fp);
+    return 1;
+  }
+
+  static struct trace_record batch[BATCH];
+  size_t count;
+  while ((count = fread(batch, sizeof(batch[0]), BATCH, fp)) != 0) {
+    for (size_t i = 0; i < count; i++) {
+      const struct trace_record *r = &batch[i];
+      printf("PC: %04X, AF: %04X, BC: %04X, DE: %04X, HL: %04X, SP: %04X, "
+             "CYC: %llu (%02X %02X %02X %02X)\n",
+             r->pc, r->af, r->bc, r->de, r->hl, r->sp,
+             (unsigned long long)r->cycle, r->bytes[0], r->bytes[1],
+             r->bytes[2], r->bytes[3]);
+    }
+  }
+
+  const int result = ferror(fp) ? 1 : 0;
+  if (result != 0)
+    fprintf(stderr, "Failed to read %s\n", argv[1]);
+  fclose(fp);
+  return result;
+}
@@ -0,0 +1,376 @@
+#include "trace.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Finds the first instruction where two traces disagree and prints the ones
+// around it, like diff: lines both share, then - for the first trace and +
+// for the second, with the fields that differ in red on a terminal or
+// marked with ^ below. Each trace is a file written with --trace (see
+// trace.h) or a text log in the format tools/trace2txt.c prints; other lines
+// of a log, like what the program printed, are skipped.
+//
+// Files are mapped rather than read. Two binary traces are compared a block
+// of bytes at a time until the first one that differs, so only the
+// instructions around it are decoded.
+//
+// Exits with 0 if the traces are the same, 1 if they differ and 2 on
+// trouble, as diff does.
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--context N] [--no-cycles] TRACE TRACE\n"
+          "  A TRACE is written with --trace or is a text log.\n"
+          "  --context shows N instructions on either side (default 5);\n"
+          "  --no-cycles ignores cycle counts, for other emulators' logs.\n",
+          name);
+}
+
+struct reader {
+  const char *path;
+  const u8 *data;
+  size_t size;
+  size_t pos;
+  bool binary;
+  u64 index; // records read
+  u64 line;  // of the last record, in a text log
+};
+
+static int reader_open(struct reader *r, const char *path) {
+  memset(r, 0, sizeof(*r));
+  r->path = path;
+
+  const int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+  r->size = (size_t)st.st_size;
+  if (r->size != 0) {
+    void *map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %s\n", path);
+      close(fd);
+      return 1;
+    }
+    madvise(map, r->size, MADV_SEQUENTIAL);
+    r->data = map;
+  }
+  close(fd);
+
+  const struct trace_header *header = (const void *)r->data;
+  if (r->size >= sizeof(*header) &&
+      memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) == 0) {
+    const char *error = trace_header_error(header);
+    if (error != NULL) {
+      fprintf(stderr, "%s %s\n", path, error);
+      return 1;
+    }
+    r->binary = true;
+    r->pos = sizeof(*header);
+  }
+  return 0;
+}
+
+static void reader_close(struct reader *r) {
+  if (r->data != NULL)
+    munmap((void *)r->data, r->size);
+}
+
+// Reads a hex or decimal number of at most `digits` digits at *p
+static bool number(const char **p, const char *end, int base, int digits,
+                   u64 *value) {
+  const char *s = *p;
+  u64 v = 0;
+  while (s < end && s - *p < digits) {
+    int d;
+    if (*s >= '0' && *s <= '9')
+      d = *s - '0';
+    else if (base == 16 && *s >= 'A' && *s <= 'F')
+      d = *s - 'A' + 10;
+    else if (base == 16 && *s >= 'a' && *s <= 'f')
+      d = *s - 'a' + 10;
+    else
+      break;
+    v = v * base + d;
+    s++;
+  }
+  if (s == *p)
+    return false;
+  *p = s;
+  *value = v;
+  return true;
+}
+
+static bool literal(const char **p, const char *end, const char *text) {
+  const size_t n = strlen(text);
+  if ((size_t)(end - *p) < n || memcmp(*p, text, n) != 0)
+    return false;
+  *p += n;
+  return true;
+}
+
+// One line of a text log, from after "PC: " to its end
+static bool parse_line(const char *p, const char *end,
+                       struct trace_record *record) {
+  static const char *const labels[] = {", AF: ", ", BC: ", ", DE: ",
+                                       ", HL: ", ", SP: "};
+  u16 *const regs[] = {&record->af, &record->bc, &record->de, &record->hl,
+                       &record->sp};
+  u64 v;
+
+  if (!number(&p, end, 16, 4, &v))
+    return false;
+  record->pc = (u16)v;
+  for (int i = 0; i < 5; i++) {
+    if (!literal(&p, end, labels[i]) || !number(&p, end, 16, 4, &v))
+      return false;
+    *regs[i] = (u16)v;
+  }
+  if (!literal(&p, end, ", CYC: ") || !number(&p, end, 10, 20, &record->cycle))
+    return false;
+  if (!literal(&p, end, " ("))
+    return false;
+  for (int i = 0; i < 4; i++) {
+    if ((i > 0 && !literal(&p, end, " ")) || !number(&p, end, 16, 2, &v))
+      return false;
+    record->bytes[i] = (u8)v;
+  }
+  return literal(&p, end, ")");
+}
+
+// Returns 1 with the next record, 0 at the end and -1 on a line that starts
+// like a record but isn't one.
+static int reader_next(struct reader *r, struct trace_record *record) {
+  if (r->binary) {
+    if (r->size - r->pos < sizeof(*record))
+      return 0;
+    memcpy(record, r->data + r->pos, sizeof(*record));
+    r->pos += sizeof(*record);
+    r->index++;
+    return 1;
+  }
+
+  while (r->pos < r->size) {
+    const char *start = (const char *)r->data + r->pos;
+    const char *end = memchr(start, '\n', r->size - r->pos);
+    if (end == NULL)
+      end = (const char *)r->data + r->size;
+    r->pos = end - (const char *)r->data + 1;
+    r->line++;
+
+    const char *p = start;
+    if (!literal(&p, end, "PC: "))
+      continue;
+    if (end > p && end[-1] == '\r')
+      end--;
+    if (!parse_line(p, end, record)) {
+      fprintf(stderr, "%s:%llu: not a trace line\n", r->path,
+              (unsigned long long)r->line);
+      return -1;
+    }
+    r->index++;
+    return 1;
+  }
+  return 0;
+}
+
+// Moves two binary traces on to `keep` records before the first bytes they
+// differ in, or before the end of the shorter one.
+static void skip_same(struct reader *a, struct reader *b, const u64 keep) {
+  const size_t size = sizeof(struct trace_record);
+  const size_t block = 1 << 20;
+
+  size_t same = 0;
+  const size_t left = a->size - a->pos < b->size - b->pos ? a->size - a->pos
+                                                          : b->size - b->pos;
+  while (same < left) {
+    const size_t n = left - same < block ? left - same : block;
+    if (memcmp(a->data + a->pos + same, b->data + b->pos + same, n) != 0) {
+      while (a->data[a->pos + same] == b->data[b->pos + same])
+        same++;
+      break;
+    }
+    same += n;
+  }
+
+  u64 records = same / size;
+  records = records > keep ? records - keep : 0;
+  a->pos += records * size;
+  b->pos += records * size;
+  a->index += records;
+  b->index += records;
+}
+
+enum field { F_PC, F_AF, F_BC, F_DE, F_HL, F_SP, F_CYC, F_BYTES, FIELDS };
+
+static unsigned differences(const struct trace_record *a,
+                            const struct trace_record *b, const bool cycles) {
+  unsigned mask = 0;
+  mask |= (a->pc != b->pc) << F_PC;
+  mask |= (a->af != b->af) << F_AF;
+  mask |= (a->bc != b->bc) << F_BC;
+  mask |= (a->de != b->de) << F_DE;
+  mask |= (a->hl != b->hl) << F_HL;
+  mask |= (a->sp != b->sp) << F_SP;
+  mask |= (cycles && a->cycle != b->cycle) << F_CYC;
+  mask |= (memcmp(a->bytes, b->bytes, sizeof(a->bytes)) != 0) << F_BYTES;
+  return mask;
+}
+
+// One record as a line of diff output, with the fields in `diff` marked
+static void print_record(char mark, u64 index,
+                         const struct trace_record *r, unsigned diff,
+                         bool color) {
+  char fields[FIELDS][32];
+  snprintf(fields[F_PC], sizeof(fields[0]), "PC: %04X", r->pc);
+  snprintf(fields[F_AF], sizeof(fields[0]), "AF: %04X", r->af);
+  snprintf(fields[F_BC], sizeof(fields[0]), "BC: %04X", r->bc);
+  snprintf(fields[F_DE], sizeof(fields[0]), "DE: %04X", r->de);
+  snprintf(fields[F_HL], sizeof(fields[0]), "HL: %04X", r->hl);
+  snprintf(fields[F_SP], sizeof(fields[0]), "SP: %04X", r->sp);
+  snprintf(fields[F_CYC], sizeof(fields[0]), "CYC: %llu",
+           (unsigned long long)r->cycle);
+  snprintf(fields[F_BYTES], sizeof(fields[0]), "(%02X %02X %02X %02X)",
+           r->bytes[0], r->bytes[1], r->bytes[2], r->bytes[3]);
+
+  char carets[256];
+  int col = printf("%c %10llu  ", mark, (unsigned long long)index);
+  int last = 0;
+  memset(carets, ' ', sizeof(carets));
+  for (int f = 0; f < FIELDS; f++) {
+    if (f > 0)
+      col += printf(f == F_BYTES ? " " : ", ");
+    const int len = (int)strlen(fields[f]);
+    if ((diff >> f & 1) && color) {
+      printf("\033[1;31m%s\033[0m", fields[f]);
+    } else {
+      printf("%s", fields[f]);
+    }
+    if ((diff >> f & 1) && col + len < (int)sizeof(carets)) {
+      memset(carets + col, '^', len);
+      last = col + len;
+    }
+    col += len;
+  }
+  printf("\n");
+  if (diff != 0 && !color)
+    printf("%.*s\n", last, carets);
+}
+
+int main(int argc, char **argv) {
+  const char *paths[2] = {NULL, NULL};
+  int files = 0;
+  u64 context = 5;
+  bool cycles = true;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--context") == 0 && i + 1 < argc) {
+      context = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--no-cycles") == 0) {
+      cycles = false;
+    } else if (argv[i][0] != '-' && files < 2) {
+      paths[files++] = argv[i];
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (files != 2) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  struct reader a, b;
+  if (reader_open(&a, paths[0]) != 0)
+    return 2;
+  if (reader_open(&b, paths[1]) != 0) {
+    reader_close(&a);
+    return 2;
+  }
+  const bool color = isatty(STDOUT_FILENO);
+
+  if (a.binary && b.binary && cycles)
+    skip_same(&a, &b, context);
+
+  // the last `context` records both share
+  struct trace_record *history = malloc((context + 1) * sizeof(*history));
+  if (history == NULL) {
+    reader_close(&a);
+    reader_close(&b);
+    return 2;
+  }
+  u64 shared = 0;
+
+  struct trace_record ra, rb;
+  int got_a, got_b;
+  unsigned diff = 0;
+  for (;;) {
+    got_a = reader_next(&a, &ra);
+    got_b = reader_next(&b, &rb);
+    if (got_a < 0 || got_b < 0 || got_a != got_b || got_a == 0)
+      break;
+    diff = differences(&ra, &rb, cycles);
+    if (diff != 0)
+      break;
+    if (context != 0)
+      history[shared++ % context] = ra;
+  }
+
+  int result = 1;
+  if (got_a < 0 || got_b < 0) {
+    result = 2;
+  } else if (got_a == 0 && got_b == 0) {
+    printf("no difference in %llu instructions\n",
+           (unsigned long long)a.index);
+    result = 0;
+  } else {
+    const u64 index = got_a > 0 ? a.index : b.index;
+    if (got_a > 0 && got_b > 0) {
+      printf("first difference at instruction %llu", (unsigned long long)index);
+    } else {
+      printf("%s ends after %llu instructions",
+             got_a == 0 ? paths[0] : paths[1], (unsigned long long)index - 1);
+    }
+    if (!a.binary)
+      printf(", %s line %llu", paths[0], (unsigned long long)a.line);
+    if (!b.binary)
+      printf(", %s line %llu", paths[1], (unsigned long long)b.line);
+    printf("\n--- %s\n+++ %s\n", paths[0], paths[1]);
+
+    const u64 before = shared < context ? shared : context;
+    for (u64 i = shared - before; i < shared; i++)
+      print_record(' ', index - (shared - i), &history[i % context], 0, color);
+
+    // the rest of the context, marking the records that differ
+    for (u64 i = 0; i <= context; i++) {
+      if (i > 0) {
+        got_a = got_a > 0 ? reader_next(&a, &ra) : 0;
+        got_b = got_b > 0 ? reader_next(&b, &rb) : 0;
+        if (got_a <= 0 && got_b <= 0)
+          break;
+        diff = got_a > 0 && got_b > 0 ? differences(&ra, &rb, cycles) : 0;
+      }
+      if (got_a > 0 && got_b > 0 && diff == 0) {
+        print_record(' ', index + i, &ra, 0, color);
+        continue;
+      }
+      if (got_a > 0)
+        print_record('-', index + i, &ra, diff, color);
+      if (got_b > 0)
+        print_record('+', index + i, &rb, diff, color);
+    }
+  }
+
+  free(history);
+  reader_close(&a);
+  reader_close(&b);
+  return result;
+}